@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "calcLib.h"
+#include "lineFramer.h"
+#include "batchEval.h"
+
+#define RESULT_SIZE 25           // Longest rendered result, "%8.8g" or "ERROR", with its newline
+
+/**
+ * Output of one chunk. Slot i % window holds chunk i.
+ */
+struct batch_slot {
+    char *out;
+    size_t length;
+    size_t capacity;
+    size_t in_end;               // Input offset the chunk ends at
+    bool ready;                  // Evaluated, waiting to be written
+};
+
+struct batch_job {
+    const char *data;
+    size_t size;
+    size_t chunk_count;
+    unsigned window;             // Slots in use
+
+    pthread_mutex_t lock;
+    pthread_cond_t chunk_done;   // A slot became ready
+    pthread_cond_t slot_free;    // A slot was written out
+    size_t next_chunk;           // Next chunk to hand to a worker
+    size_t written;              // Chunks written out, in order
+    bool failed;
+    uint64_t lines, errors;
+
+    struct batch_slot slots[BATCH_MAX_THREADS * BATCH_WINDOW];
+};
+
+/**
+ * Input offset chunk i starts at: just after the first newline at or after its nominal
+ * start, so every line belongs to exactly one chunk.
+ */
+static size_t chunk_start(const struct batch_job *job, size_t i) {
+    size_t nominal = i * (size_t)BATCH_CHUNK_SIZE;
+    if (i == 0) {
+        return 0;
+    }
+    if (nominal >= job->size) {
+        return job->size;
+    }
+    const char *newline = (const char*)memchr(job->data + nominal - 1, '\n', job->size - nominal + 1);
+    return newline != NULL ? (size_t)(newline - job->data) + 1 : job->size;
+}
+
+/**
+ * Parse "<op> <a> <b>" (without its newline) into task i of batch.
+ *
+ * @return: false if the line is not a task.
+ */
+static bool parse_task(const char *p, const char *end, calc_task_batch_t *batch, size_t i) {
+    const char *name;
+    size_t name_length;
+    if (!parse_word(&p, end, &name, &name_length)) {
+        return false;
+    }
+    calc_op_t op = calcOpLookup(name, name_length);
+    if (op == CALC_OP_COUNT) {
+        return false;
+    }
+
+    batch->op[i] = op;
+    if (calcOpIsFloat(op)) {
+        if (!parse_double(&p, end, &batch->a[i].f) || !parse_double(&p, end, &batch->b[i].f)) {
+            return false;
+        }
+    } else if (!parse_int(&p, end, &batch->a[i].i) || !parse_int(&p, end, &batch->b[i].i)) {
+        return false;
+    }
+
+    p = skip_spaces(p, end);
+    if (p < end && *p == '\r') {
+        p++;
+    }
+    return p == end;
+}
+
+/**
+ * Evaluate the lines of [p, end) into slot's output.
+ *
+ * @return: 0 on success, -1 if the output buffer cannot grow.
+ */
+static int evaluate_chunk(const char *p, const char *end, struct batch_slot *slot, uint64_t *lines, uint64_t *errors) {
+    calc_task_batch_t batch;
+    bool bad[CALC_BATCH_SIZE];
+
+    slot->length = 0;
+    while (p < end) {
+        if (slot->capacity - slot->length < CALC_BATCH_SIZE * RESULT_SIZE) {
+            size_t capacity = slot->capacity > 0 ? slot->capacity * 2 : BATCH_CHUNK_SIZE;
+            char *out = (char*)realloc(slot->out, capacity);
+            if (out == NULL) {
+                return -1;
+            }
+            slot->out = out;
+            slot->capacity = capacity;
+        }
+
+        size_t n = 0;
+        while (p < end && n < CALC_BATCH_SIZE) {
+            const char *newline = (const char*)memchr(p, '\n', end - p);
+            const char *line_end = newline != NULL ? newline : end;
+            bad[n] = !parse_task(p, line_end, &batch, n);
+            if (bad[n]) {
+                batch.op[n] = CALC_ADD; // Computed like the rest, then ignored
+                batch.a[n].i = batch.b[n].i = 0;
+            }
+            p = newline != NULL ? newline + 1 : end;
+            n++;
+        }
+        calcComputeBatch(&batch, n);
+
+        char *out = slot->out + slot->length;
+        for (size_t i = 0; i < n; i++) {
+            if (bad[i]) {
+                memcpy(out, "ERROR", 5);
+                out += 5;
+                (*errors)++;
+            } else if (calcOpIsFloat(batch.op[i])) {
+                out += format_float8(out, batch.expected[i].f);
+            } else {
+                out += format_int(out, batch.expected[i].i);
+            }
+            *out++ = '\n';
+        }
+        slot->length = out - slot->out;
+        *lines += n;
+    }
+    return 0;
+}
+
+static void *batch_worker(void *arg) {
+    struct batch_job *job = (struct batch_job*)arg;
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        // The slot of chunk next_chunk is free once the chunk window places before it is written
+        while (job->next_chunk < job->chunk_count && job->next_chunk >= job->written + job->window) {
+            pthread_cond_wait(&job->slot_free, &job->lock);
+        }
+        if (job->next_chunk >= job->chunk_count) {
+            break;
+        }
+        size_t i = job->next_chunk++;
+        pthread_mutex_unlock(&job->lock);
+
+        struct batch_slot *slot = &job->slots[i % job->window];
+        size_t start = chunk_start(job, i);
+        slot->in_end = chunk_start(job, i + 1);
+        uint64_t lines = 0, errors = 0;
+        int rv = evaluate_chunk(job->data + start, job->data + slot->in_end, slot, &lines, &errors);
+
+        pthread_mutex_lock(&job->lock);
+        if (rv == -1) {
+            job->failed = true;
+        }
+        job->lines += lines;
+        job->errors += errors;
+        slot->ready = true;
+        pthread_cond_signal(&job->chunk_done);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * Write the chunks out in order as the workers finish them, dropping written input from
+ * the mapping.
+ *
+ * @return: 0 on success, -1 on failure (the workers are told to stop).
+ */
+static int write_chunks(struct batch_job *job, int output_fd) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t released = 0;
+
+    for (size_t i = 0; i < job->chunk_count; i++) {
+        struct batch_slot *slot = &job->slots[i % job->window];
+
+        pthread_mutex_lock(&job->lock);
+        while (!slot->ready && !job->failed) {
+            pthread_cond_wait(&job->chunk_done, &job->lock);
+        }
+        bool failed = job->failed;
+        pthread_mutex_unlock(&job->lock);
+
+        if (failed) {
+            fprintf(stderr, "Out of memory for the results\n");
+        } else if (write_all(output_fd, slot->out, slot->length) == -1) {
+            perror("Failed to write the results");
+            failed = true;
+        }
+        if (failed) {
+            pthread_mutex_lock(&job->lock);
+            job->next_chunk = job->chunk_count; // Workers finish their chunk and stop
+            pthread_cond_broadcast(&job->slot_free);
+            pthread_mutex_unlock(&job->lock);
+            return -1;
+        }
+
+        size_t release_end = slot->in_end & ~(page - 1);
+        if (release_end > released) {
+            madvise((char*)job->data + released, release_end - released, MADV_DONTNEED);
+            released = release_end;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        slot->ready = false;
+        job->written++;
+        pthread_cond_broadcast(&job->slot_free);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return 0;
+}
+
+int batch_evaluate(const char *input_path, int output_fd, unsigned threads, struct batch_stats *stats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(*stats));
+
+    int fd = open(input_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("Failed to open the task file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Failed to read the task file size");
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file
+    if (data == MAP_FAILED) {
+        perror("Failed to map the task file");
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    static struct batch_job job; // Too large for the stack
+    memset(&job, 0, sizeof(job));
+    job.data = (const char*)data;
+    job.size = st.st_size;
+    job.chunk_count = (job.size + BATCH_CHUNK_SIZE - 1) / BATCH_CHUNK_SIZE;
+    if (threads == 0) {
+        threads = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > BATCH_MAX_THREADS) {
+        threads = BATCH_MAX_THREADS;
+    }
+    if (threads > job.chunk_count) {
+        threads = (unsigned)job.chunk_count;
+    }
+    job.window = threads * BATCH_WINDOW;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.chunk_done, NULL);
+    pthread_cond_init(&job.slot_free, NULL);
+    calcSimdName(); // Pick the kernels before the workers race to
+
+    pthread_t workers[BATCH_MAX_THREADS];
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        int rv = pthread_create(&workers[started], NULL, batch_worker, &job);
+        if (rv != 0) {
+            fprintf(stderr, "Failed to start worker %u: %s\n", started, strerror(rv));
+            break;
+        }
+    }
+
+    int rv = -1;
+    if (started == threads) {
+        rv = write_chunks(&job, output_fd);
+    } else {
+        pthread_mutex_lock(&job.lock);
+        job.next_chunk = job.chunk_count;
+        pthread_cond_broadcast(&job.slot_free);
+        pthread_mutex_unlock(&job.lock);
+    }
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (unsigned i = 0; i < job.window; i++) {
+        free(job.slots[i].out);
+    }
+    pthread_cond_destroy(&job.slot_free);
+    pthread_cond_destroy(&job.chunk_done);
+    pthread_mutex_destroy(&job.lock);
+    munmap(data, st.st_size);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->lines = job.lines;
+    stats->errors = job.errors;
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return rv;
+}
@@ -0,0 +1,44 @@
+#ifndef __BATCH_EVAL
+#define __BATCH_EVAL
+
+/*
+
+Offline evaluator for files of recorded tasks, one "<op> <a> <b>" line each.
+
+The file is memory-mapped and cut into BATCH_CHUNK_SIZE pieces that end at a newline. Worker
+threads take the chunks in turn, parse their lines with the parse_* helpers, compute the
+results BATCH_SIZE at a time with calcComputeBatch() and render them into the chunk's output
+buffer. The calling thread writes the buffers out in input order as they complete: one line
+per input line, the result as a client would send it ("%d" or "%8.8g"), or "ERROR" if the
+line is not a task.
+
+At most BATCH_WINDOW chunks per thread are in flight, their output buffers are reused, and
+input that has been written out is dropped from the mapping, so memory use does not depend on
+the size of the file.
+
+Implementation in batchEval.cpp
+
+*/
+
+#include <stdint.h>
+
+#define BATCH_CHUNK_SIZE (1 << 20) // Input bytes per chunk, cut back to a newline
+#define BATCH_WINDOW 2           // Chunks in flight per worker thread
+#define BATCH_MAX_THREADS 64
+
+struct batch_stats {
+    uint64_t lines;
+    uint64_t errors;             // Lines that are not a task
+    double seconds;
+};
+
+/**
+ * Evaluate every task in input_path and write the results to output_fd.
+ *
+ * @param threads: Worker threads, 0 for one per online CPU.
+ * @param stats: Receives the line counts and the run time.
+ * @return: 0 on success, -1 with a message on stderr on failure.
+ */
+int batch_evaluate(const char *input_path, int output_fd, unsigned threads, struct batch_stats *stats);
+
+#endif
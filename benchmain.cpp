@@ -0,0 +1,584 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include "calcLib.h"
+#include "lineFramer.h"
+#include "binaryProtocol.h"
+#include "taskPool.h"
+#include "serverEngine.h"
+#include "serverLog.h"
+
+/*
+
+Microbenchmarks of the calculation library and the protocol hot paths.
+
+Every benchmark is warmed up, then timed in BENCH_SAMPLES samples of a batch size picked so
+that one sample takes about BENCH_SAMPLE_MS. The median of the samples is reported as ns/op
+(with min, mean and standard deviation next to it), on stdout as a table and in a JSON file
+that later runs can be diffed against. The round trip benchmarks run the server's event
+loop on a thread of this process, on a loopback port.
+
+*/
+
+#define BENCH_SAMPLES 15         // Timed samples per benchmark
+#define BENCH_SAMPLE_MS 10       // Target duration of one sample
+#define BENCH_WARMUP_MS 50       // Untimed run before the samples
+#define FLOAT_PRECISION 0.0001   // Tolerance of the server's result check
+#define TASK_COUNT 1024          // Tasks prepared for the formatting, parsing and checking benchmarks
+
+struct bench_result {
+    const char *name;
+    size_t iterations;           // Per sample
+    double median_ns, min_ns, mean_ns, stddev_ns;
+};
+
+static struct bench_result results[64];
+static size_t result_count;
+static int sample_count = BENCH_SAMPLES;
+static const char *filter;
+
+/**
+ * Keep the compiler from dropping a computation whose result is not used.
+ */
+template <typename T>
+static inline void keep(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool selected(const char *name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+/**
+ * Time op, called once per operation, and record the result under name.
+ */
+template <typename Op>
+static void bench(const char *name, Op op) {
+    if (!selected(name)) {
+        return;
+    }
+
+    // Warm up, and find a batch size that takes about BENCH_SAMPLE_MS
+    size_t iterations = 1;
+    long long warmup_end = now_ns() + BENCH_WARMUP_MS * 1000000LL;
+    while (1) {
+        long long start = now_ns();
+        for (size_t i = 0; i < iterations; i++) {
+            op();
+        }
+        long long elapsed = now_ns() - start;
+        if (elapsed >= BENCH_SAMPLE_MS * 1000000LL && now_ns() >= warmup_end) {
+            break;
+        }
+        if (elapsed < BENCH_SAMPLE_MS * 1000000LL) {
+            iterations = elapsed > 0 ? std::max(iterations * 2, (size_t)(iterations * BENCH_SAMPLE_MS * 1e6 / elapsed)) : iterations * 2;
+        }
+    }
+
+    double samples[BENCH_SAMPLES];
+    double sum = 0.0;
+    for (int s = 0; s < sample_count; s++) {
+        long long start = now_ns();
+        for (size_t i = 0; i < iterations; i++) {
+            op();
+        }
+        samples[s] = (double)(now_ns() - start) / iterations;
+        sum += samples[s];
+    }
+    std::sort(samples, samples + sample_count);
+
+    struct bench_result *r = &results[result_count++];
+    r->name = name;
+    r->iterations = iterations;
+    r->median_ns = samples[sample_count / 2];
+    r->min_ns = samples[0];
+    r->mean_ns = sum / sample_count;
+    double variance = 0.0;
+    for (int s = 0; s < sample_count; s++) {
+        variance += (samples[s] - r->mean_ns) * (samples[s] - r->mean_ns);
+    }
+    r->stddev_ns = sqrt(variance / sample_count);
+
+    printf("%-28s %12.1f ns/op %14.0f ops/s   (min %.1f, stddev %.1f)\n", name, r->median_ns, 1e9 / r->median_ns,
+           r->min_ns, r->stddev_ns);
+    fflush(stdout);
+}
+
+/**
+ * The tasks the formatting, parsing and checking benchmarks cycle through, rendered both
+ * ways the server has sent them.
+ */
+struct bench_tasks {
+    calc_task_batch_t batches[TASK_COUNT / CALC_BATCH_SIZE];
+    struct prepared_task prepared[TASK_COUNT];
+    calc_op_t op[TASK_COUNT];
+    calc_value_t expected[TASK_COUNT];
+    calc_value_t client[TASK_COUNT];  // Results as a client would send them, some of them wrong
+    char results[TASK_COUNT][32];     // client[] as text
+    unsigned char correct[TASK_COUNT];
+};
+
+static void bench_tasks_init(struct bench_tasks *t) {
+    for (size_t i = 0; i < TASK_COUNT; i++) {
+        calc_task_batch_t *batch = &t->batches[i / CALC_BATCH_SIZE];
+        if (i % CALC_BATCH_SIZE == 0) {
+            randomTaskBatch(batch, CALC_BATCH_SIZE);
+        }
+        task_prepare(&t->prepared[i], batch, i % CALC_BATCH_SIZE);
+        t->op[i] = batch->op[i % CALC_BATCH_SIZE];
+        t->expected[i] = batch->expected[i % CALC_BATCH_SIZE];
+        t->client[i] = t->expected[i];
+        if (i % 8 == 0) {
+            if (calcOpIsFloat(t->op[i])) {
+                t->client[i].f += 1.0;
+            } else {
+                t->client[i].i += 1;
+            }
+        }
+        if (calcOpIsFloat(t->op[i])) {
+            snprintf(t->results[i], sizeof(t->results[i]), "%8.8g\n", t->client[i].f);
+        } else {
+            snprintf(t->results[i], sizeof(t->results[i]), "%d\n", t->client[i].i);
+        }
+    }
+}
+
+/**
+ * The server's original per-result checks.
+ */
+static int check_float_result(double expected, double result) {
+    return fabs(expected - result) < FLOAT_PRECISION;
+}
+
+static int check_integer_result(int expected, int result) {
+    return expected == result;
+}
+
+static void bench_random(void) {
+    bench("random/randomType", [] { keep(randomType()); });
+    bench("random/randomOp", [] { keep(randomOp()); });
+    bench("random/randomInt", [] { keep(randomInt()); });
+    bench("random/randomFloat", [] { keep(randomFloat()); });
+
+    static calc_task_batch_t batch;
+    bench("random/task_batch_64", [] { randomTaskBatch(&batch, CALC_BATCH_SIZE); keep(batch); });
+}
+
+static void bench_format(struct bench_tasks *t) {
+    static size_t i;
+    static char line[64];
+
+    bench("format/task_sprintf", [t] {
+        size_t k = i++ % TASK_COUNT;
+        const struct prepared_task *task = &t->prepared[k];
+        int length = calcOpIsFloat(task->op)
+            ? snprintf(line, sizeof(line), "%s %8.8g %8.8g\n", calcOps[task->op].name, task->a.f, task->b.f)
+            : snprintf(line, sizeof(line), "%s %d %d\n", calcOps[task->op].name, task->a.i, task->b.i);
+        keep(length);
+    });
+    bench("format/task_fast", [t] {
+        size_t k = i++ % TASK_COUNT;
+        const struct prepared_task *task = &t->prepared[k];
+        const calc_op_info_t *info = &calcOps[task->op];
+        size_t length = info->length;
+        memcpy(line, info->name, length);
+        line[length++] = ' ';
+        if (info->is_float) {
+            length += format_float8(line + length, task->a.f);
+            line[length++] = ' ';
+            length += format_float8(line + length, task->b.f);
+        } else {
+            length += format_int(line + length, task->a.i);
+            line[length++] = ' ';
+            length += format_int(line + length, task->b.i);
+        }
+        line[length++] = '\n';
+        keep(length);
+    });
+    bench("format/task_prepare", [t] {
+        size_t k = i++ % TASK_COUNT;
+        static struct prepared_task task;
+        task_prepare(&task, &t->batches[k / CALC_BATCH_SIZE], k % CALC_BATCH_SIZE);
+        keep(task);
+    });
+}
+
+static void bench_parse(struct bench_tasks *t) {
+    static size_t i;
+
+    bench("parse/task_sscanf", [t] {
+        size_t k = i++ % TASK_COUNT;
+        char name[8];
+        double a, b;
+        int rv = sscanf(t->prepared[k].text, "%7s %lg %lg", name, &a, &b);
+        keep(rv);
+        keep(a);
+        keep(b);
+    });
+    bench("parse/task_fast", [t] {
+        size_t k = i++ % TASK_COUNT;
+        const char *p = t->prepared[k].text;
+        const char *end = p + t->prepared[k].text_length;
+        const char *name;
+        size_t name_length;
+        double a = 0.0, b = 0.0;
+        parse_word(&p, end, &name, &name_length);
+        calc_op_t op = calcOpLookup(name, name_length);
+        parse_double(&p, end, &a);
+        parse_double(&p, end, &b);
+        keep(op);
+        keep(a);
+        keep(b);
+    });
+    bench("parse/result_sscanf", [t] {
+        size_t k = i++ % TASK_COUNT;
+        calc_value_t value;
+        int rv = calcOpIsFloat(t->op[k]) ? sscanf(t->results[k], "%lg", &value.f) : sscanf(t->results[k], "%d", &value.i);
+        keep(rv);
+        keep(value);
+    });
+    bench("parse/result_fast", [t] {
+        size_t k = i++ % TASK_COUNT;
+        const char *p = t->results[k];
+        const char *end = p + strlen(p);
+        calc_value_t value;
+        if (calcOpIsFloat(t->op[k])) {
+            value.f = 0.0;
+            parse_double(&p, end, &value.f);
+        } else {
+            value.i = 0;
+            parse_int(&p, end, &value.i);
+        }
+        keep(value);
+    });
+}
+
+static void bench_check(struct bench_tasks *t) {
+    static size_t i;
+
+    bench("check/float_result", [t] {
+        size_t k = i++ % TASK_COUNT;
+        keep(check_float_result(t->expected[k].f, t->client[k].f));
+    });
+    bench("check/integer_result", [t] {
+        size_t k = i++ % TASK_COUNT;
+        keep(check_integer_result(t->expected[k].i, t->client[k].i));
+    });
+    bench("check/scalar_mixed", [t] {
+        size_t k = i++ % TASK_COUNT;
+        int correct = calcOpIsFloat(t->op[k]) ? check_float_result(t->expected[k].f, t->client[k].f)
+                                              : check_integer_result(t->expected[k].i, t->client[k].i);
+        keep(correct);
+    });
+    // One call checks CALC_BATCH_SIZE results; reported per result below
+    bench("check/batch_64", [t] {
+        size_t k = (i++ * CALC_BATCH_SIZE) % TASK_COUNT;
+        keep(calcCheckBatch(t->op + k, t->expected + k, t->client + k, t->correct + k, CALC_BATCH_SIZE, FLOAT_PRECISION));
+    });
+    if (result_count > 0 && strcmp(results[result_count - 1].name, "check/batch_64") == 0) {
+        struct bench_result per_result = results[result_count - 1];
+        per_result.name = "check/batch_per_result";
+        per_result.iterations *= CALC_BATCH_SIZE;
+        per_result.median_ns /= CALC_BATCH_SIZE;
+        per_result.min_ns /= CALC_BATCH_SIZE;
+        per_result.mean_ns /= CALC_BATCH_SIZE;
+        per_result.stddev_ns /= CALC_BATCH_SIZE;
+        results[result_count++] = per_result;
+        printf("%-28s %12.1f ns/op %14.0f ops/s\n", per_result.name, per_result.median_ns, 1e9 / per_result.median_ns);
+    }
+}
+
+/**
+ * Thread running the server's event loop on a listening socket.
+ */
+static void *server_main(void *arg) {
+    static struct server_config config = {0, MAX_WINDOW, TASK_POOL_SIZE, false, 0, RESPONSE_TIMEOUT * 1000,
+                                           RESPONSE_TIMEOUT * 1000, RESPONSE_TIMEOUT * 1000, false};
+    initCalcLib_stream(1);
+    run_event_loop((int)(intptr_t)arg, &config, 2);
+    return NULL;
+}
+
+/**
+ * Start an event loop on a loopback port.
+ *
+ * @return: The port, or 0 on failure.
+ */
+static int start_server(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1
+        || getsockname(fd, (struct sockaddr*)&addr, &length) == -1) {
+        perror("Failed to start server");
+        return 0;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_main, (void*)(intptr_t)fd) != 0) {
+        return 0;
+    }
+    pthread_detach(thread);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * A blocking connection with the framer the client library uses.
+ */
+struct bench_connection {
+    int fd;
+    struct line_framer in;
+    char storage[4096];
+};
+
+static bool bench_fill(struct bench_connection *c) {
+    size_t space;
+    char *free_space = framer_write_ptr(&c->in, &space);
+    ssize_t received = recv(c->fd, free_space, space, 0);
+    if (received <= 0) {
+        return false;
+    }
+    framer_commit(&c->in, received);
+    return true;
+}
+
+static bool bench_read_line(struct bench_connection *c, const char **line, size_t *length) {
+    while (!framer_next_line(&c->in, line, length)) {
+        if (!bench_fill(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool bench_read(struct bench_connection *c, void *out, size_t length) {
+    while (!framer_read(&c->in, out, length)) {
+        if (!bench_fill(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Connect, read the greeting and send the protocol reply.
+ */
+static bool bench_connect(struct bench_connection *c, int port, const char *reply) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    framer_init(&c->in, c->storage, sizeof(c->storage));
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (c->fd == -1 || connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("Failed to connect to server");
+        return false;
+    }
+    const char *line;
+    size_t length;
+    do {
+        if (!bench_read_line(c, &line, &length)) {
+            return false;
+        }
+    } while (length > 1);
+    return send(c->fd, reply, strlen(reply), MSG_NOSIGNAL) == (ssize_t)strlen(reply);
+}
+
+/**
+ * Solve a text task ("op a b\n") into result, including the newline.
+ */
+static size_t solve_line(const char *line, size_t length, char *result) {
+    const char *end = line + length;
+    const char *name;
+    size_t name_length;
+    double a = 0.0, b = 0.0;
+    parse_word(&line, end, &name, &name_length);
+    parse_double(&line, end, &a);
+    parse_double(&line, end, &b);
+    calc_op_t op = calcOpLookup(name, name_length);
+    calc_value_t x, y;
+    size_t result_length;
+    if (op == CALC_OP_COUNT) {
+        result_length = format_int(result, 0);
+    } else if (calcOps[op].is_float) {
+        x.f = a;
+        y.f = b;
+        result_length = format_float8(result, calcOps[op].compute(x, y).f);
+    } else {
+        x.i = (int)a;
+        y.i = (int)b;
+        result_length = format_int(result, calcOps[op].compute(x, y).i);
+    }
+    result[result_length++] = '\n';
+    return result_length;
+}
+
+static void bench_roundtrip(void) {
+    if (!selected("roundtrip/text_1_1") && !selected("roundtrip/binary_1_0")) {
+        return;
+    }
+    int port = start_server();
+    if (port == 0) {
+        return;
+    }
+
+    // TEXT TCP 1.1, lockstep: send a result, read its verdict and the next task
+    static struct bench_connection text;
+    static char task[64], result[32];
+    static size_t task_length;
+    const char *line;
+    size_t length;
+    if (bench_connect(&text, port, PERSISTENT_REQUEST) && bench_read_line(&text, &line, &length)) {
+        task_length = std::min(length, sizeof(task));
+        memcpy(task, line, task_length);
+        bench("roundtrip/text_1_1", [] {
+            const char *line;
+            size_t length;
+            size_t result_length = solve_line(task, task_length, result);
+            if (send(text.fd, result, result_length, MSG_NOSIGNAL) != (ssize_t)result_length
+                || !bench_read_line(&text, &line, &length) || !bench_read_line(&text, &line, &length)) {
+                fprintf(stderr, "Round trip failed\n");
+                exit(EXIT_FAILURE);
+            }
+            task_length = std::min(length, sizeof(task));
+            memcpy(task, line, task_length);
+        });
+        close(text.fd);
+    }
+
+    // BINARY TCP 1.0, lockstep
+    static struct bench_connection binary;
+    static struct binary_frame frame;
+    if (bench_connect(&binary, port, BINARY_REQUEST "\n") && bench_read(&binary, &frame, sizeof(frame))) {
+        bench("roundtrip/binary_1_0", [] {
+            struct binary_frame reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.opcode = BINARY_RESULT;
+            reply.width = frame.width;
+            reply.seq = frame.seq;
+            calc_value_t x, y;
+            if (calcOps[frame.opcode].is_float) {
+                x.f = frame.a.f;
+                y.f = frame.b.f;
+                reply.a.f = calcOps[frame.opcode].compute(x, y).f;
+            } else {
+                x.i = frame.a.i;
+                y.i = frame.b.i;
+                reply.a.i = calcOps[frame.opcode].compute(x, y).i;
+            }
+            struct binary_frame verdict;
+            if (send(binary.fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply)
+                || !bench_read(&binary, &verdict, sizeof(verdict)) || !bench_read(&binary, &frame, sizeof(frame))) {
+                fprintf(stderr, "Round trip failed\n");
+                exit(EXIT_FAILURE);
+            }
+        });
+        close(binary.fd);
+    }
+}
+
+/**
+ * Write every result as JSON.
+ */
+static int write_json(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror("Failed to write results");
+        return -1;
+    }
+    fprintf(out, "{\n  \"simd\": \"%s\",\n", calcSimdName());
+#ifdef __OPTIMIZE__
+    fprintf(out, "  \"optimized\": true,\n");
+#else
+    fprintf(out, "  \"optimized\": false,\n");
+#endif
+    fprintf(out, "  \"cpus\": %ld,\n  \"samples\": %d,\n  \"results\": [\n", sysconf(_SC_NPROCESSORS_ONLN), sample_count);
+    for (size_t i = 0; i < result_count; i++) {
+        const struct bench_result *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f, \"min_ns\": %.2f, "
+                     "\"mean_ns\": %.2f, \"stddev_ns\": %.2f, \"iterations\": %zu}%s\n",
+                r->name, r->median_ns, 1e9 / r->median_ns, r->min_ns, r->mean_ns, r->stddev_ns, r->iterations,
+                i + 1 < result_count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--output FILE] [--filter TEXT] [--samples N] [--pin CPU]\n", program);
+    fprintf(stderr, "  --output FILE  Write the results as JSON to FILE (default bench.json)\n");
+    fprintf(stderr, "  --filter TEXT  Run only the benchmarks whose name contains TEXT\n");
+    fprintf(stderr, "  --samples N    Timed samples per benchmark, up to %d (default %d)\n", BENCH_SAMPLES, BENCH_SAMPLES);
+    fprintf(stderr, "  --pin CPU      Run on CPU only, for steadier numbers\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = "bench.json";
+    int cpu = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            sample_count = atoi(argv[++i]);
+            if (sample_count < 1 || sample_count > BENCH_SAMPLES) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--pin") == 0 && i + 1 < argc) {
+            cpu = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+            perror("Failed to pin to CPU");
+        }
+    }
+
+    initCalcLib_seed(1); // The same tasks every run
+    log_start(LOG_OFF, 1);
+    printf("Batch kernels: %s\n", calcSimdName());
+
+    static struct bench_tasks tasks;
+    bench_tasks_init(&tasks);
+    bench_random();
+    bench_format(&tasks);
+    bench_parse(&tasks);
+    bench_check(&tasks);
+    bench_roundtrip();
+
+    if (write_json(output) == -1) {
+        return EXIT_FAILURE;
+    }
+    printf("Results written to %s\n", output);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef __BINARY_PROTOCOL
+#define __BINARY_PROTOCOL
+
+/*
+
+Frame layout of the "BINARY TCP 1.0" protocol, shared by the server and the client.
+
+A client selects it by answering the server's greeting with BINARY_REQUEST, optionally
+followed by a window ("BINARY TCP 1.0 16\n") to have up to that many tasks outstanding.
+From then on both directions carry nothing but fixed-size binary_frame records:
+
+  server -> client   task      opcode = operation (BINARY_OP_ADD..), operands in a and b
+  client -> server   result    opcode = BINARY_RESULT, result in a
+  server -> client   verdict   opcode = BINARY_VERDICT, flags = BINARY_CORRECT or 0
+  client -> server   quit      opcode = BINARY_QUIT, ends the session
+  server -> client   error     opcode = BINARY_ERROR, flags = BINARY_ERROR_TIMEOUT
+
+Every frame carries the sequence number of the task it belongs to. All fields are little
+endian, so on the hosts we run on a frame is decoded with a single memcpy(). Float operands
+travel as exact doubles instead of as %8.8g text.
+
+*/
+
+#include <stdint.h>
+#include "calcLib.h"
+
+#define BINARY_REQUEST "BINARY TCP 1.0" // Client reply selecting the protocol
+
+// Task opcodes are the calc_op_t of the operation
+#define BINARY_OP_ADD  CALC_ADD
+#define BINARY_OP_DIV  CALC_DIV
+#define BINARY_OP_MUL  CALC_MUL
+#define BINARY_OP_SUB  CALC_SUB
+#define BINARY_OP_FADD CALC_FADD
+#define BINARY_OP_FDIV CALC_FDIV
+#define BINARY_OP_FMUL CALC_FMUL
+#define BINARY_OP_FSUB CALC_FSUB
+#define BINARY_OP_COUNT CALC_OP_COUNT
+
+// Control opcodes
+#define BINARY_RESULT  0x80
+#define BINARY_VERDICT 0x81
+#define BINARY_QUIT    0x82
+#define BINARY_ERROR   0x83
+
+#define BINARY_CORRECT 1         // Verdict flag
+#define BINARY_ERROR_TIMEOUT 1   // Error flag, the binary "ERROR TO"
+
+#define BINARY_WIDTH_INT 4       // Operands are int32 (in the i member)
+#define BINARY_WIDTH_FLOAT 8     // Operands are float64 (in the f member)
+
+union binary_value {
+    int32_t i;
+    double f;
+};
+
+struct binary_frame {
+    uint8_t opcode;
+    uint8_t width;               // BINARY_WIDTH_INT or BINARY_WIDTH_FLOAT
+    uint16_t flags;
+    uint32_t seq;
+    union binary_value a;
+    union binary_value b;
+};
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "binary_frame is decoded with memcpy() and assumes a little-endian host"
+#endif
+
+#ifdef __cplusplus
+static_assert(sizeof(struct binary_frame) == 24, "binary_frame must stay 24 bytes on the wire");
+#else
+_Static_assert(sizeof(struct binary_frame) == 24, "binary_frame must stay 24 bytes on the wire");
+#endif
+
+#endif
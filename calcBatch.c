@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/* Batch kernels of calcLib: reference results for a whole calc_task_batch_t, and checking
+   many client results at once.
+
+   Every kernel has a plain C version. On x86 there are also SSE2 and AVX2 versions, picked
+   at run time from what the CPU supports; CALC_SIMD=scalar, sse2 or avx2 in the environment
+   overrides the choice (mainly to compare them). All versions give identical results.
+
+   Integer arithmetic wraps around like the hardware does instead of being undefined:
+   add, sub and mul are done modulo 2^32, INT_MIN / -1 gives INT_MIN and x / 0 gives 0.
+*/
+#include "calcLib.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CALC_X86 1
+#endif
+
+_Static_assert(sizeof(calc_op_t) == 4, "the kernels load calc_op_t arrays as int32");
+_Static_assert(sizeof(calc_value_t) == 8, "the kernels load calc_value_t arrays as doubles");
+
+enum { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 };
+static const char *simdNames[]={"scalar", "sse2", "avx2"};
+static int simdLevel=-1;
+
+static int simd_level(void){
+  int cached=__atomic_load_n(&simdLevel, __ATOMIC_RELAXED);
+  if(cached < 0){
+    int level=SIMD_SCALAR;
+#ifdef CALC_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+      level=SIMD_AVX2;
+    } else if(__builtin_cpu_supports("sse2")){
+      level=SIMD_SSE2;
+    }
+#endif
+    const char *forced=getenv("CALC_SIMD");
+    for(int i=0;forced != NULL && i <= level;i++){
+      if(strcmp(forced, simdNames[i]) == 0){
+        level=i; // Only ever step down to what the CPU has
+      }
+    }
+    __atomic_store_n(&simdLevel, level, __ATOMIC_RELAXED); // Racing threads all store the same value
+    cached=level;
+  }
+  return cached;
+}
+
+const char *calcSimdName(void){
+  return simdNames[simd_level()];
+}
+
+int calcIntAdd(int a, int b){ return (int)((unsigned)a + (unsigned)b); }
+int calcIntSub(int a, int b){ return (int)((unsigned)a - (unsigned)b); }
+int calcIntMul(int a, int b){ return (int)((unsigned)a * (unsigned)b); }
+int calcIntDiv(int a, int b){
+  if(b == 0){
+    return 0;
+  }
+  if(a == INT_MIN && b == -1){
+    return INT_MIN;
+  }
+  return a / b;
+}
+
+static void compute_scalar(calc_task_batch_t *tasks, size_t first, size_t n){
+  for(size_t i=first;i<n;i++){
+    calc_value_t a=tasks->a[i], b=tasks->b[i], r;
+    r.f=0.0;
+    switch(tasks->op[i]){
+    case CALC_ADD:  r.i=calcIntAdd(a.i, b.i); break;
+    case CALC_DIV:  r.i=calcIntDiv(a.i, b.i); break;
+    case CALC_MUL:  r.i=calcIntMul(a.i, b.i); break;
+    case CALC_SUB:  r.i=calcIntSub(a.i, b.i); break;
+    case CALC_FADD: r.f=a.f + b.f; break;
+    case CALC_FDIV: r.f=a.f / b.f; break;
+    case CALC_FMUL: r.f=a.f * b.f; break;
+    case CALC_FSUB: r.f=a.f - b.f; break;
+    default:        break;
+    }
+    tasks->expected[i]=r;
+  }
+}
+
+static size_t check_scalar(const calc_op_t *op, const calc_value_t *expected, const calc_value_t *result,
+                           unsigned char *correct, size_t first, size_t n, double tolerance){
+  size_t count=0;
+  for(size_t i=first;i<n;i++){
+    int ok;
+    if(calcOpIsFloat(op[i])){
+      double diff=expected[i].f - result[i].f;
+      ok=diff < tolerance && diff > -tolerance;
+    } else {
+      ok=expected[i].i == result[i].i;
+    }
+    correct[i]=(unsigned char)ok;
+    count+=ok;
+  }
+  return count;
+}
+
+#ifdef CALC_X86
+
+/* Four tasks per step. Every lane computes all eight operators and keeps the one it needs;
+   integer division goes through doubles, which is exact for 32-bit operands. */
+__attribute__((target("avx2")))
+static size_t compute_avx2(calc_task_batch_t *tasks, size_t n){
+  const __m256i pack=_mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+  const __m128i last_int=_mm_set1_epi32(CALC_FIRST_FLOAT - 1);
+  size_t i=0;
+
+  for(;i + 4 <= n;i+=4){
+    __m128i op=_mm_loadu_si128((const __m128i*)&tasks->op[i]);
+    __m256d fa=_mm256_loadu_pd(&tasks->a[i].f);
+    __m256d fb=_mm256_loadu_pd(&tasks->b[i].f);
+
+    // Float operators, selected by opcode
+    __m256i op64=_mm256_cvtepi32_epi64(op);
+    __m256d fr=_mm256_add_pd(fa, fb);
+    fr=_mm256_blendv_pd(fr, _mm256_div_pd(fa, fb), _mm256_castsi256_pd(_mm256_cmpeq_epi64(op64, _mm256_set1_epi64x(CALC_FDIV))));
+    fr=_mm256_blendv_pd(fr, _mm256_mul_pd(fa, fb), _mm256_castsi256_pd(_mm256_cmpeq_epi64(op64, _mm256_set1_epi64x(CALC_FMUL))));
+    fr=_mm256_blendv_pd(fr, _mm256_sub_pd(fa, fb), _mm256_castsi256_pd(_mm256_cmpeq_epi64(op64, _mm256_set1_epi64x(CALC_FSUB))));
+
+    // Integer operators on the low halves of the operands
+    __m128i ia=_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(fa), pack));
+    __m128i ib=_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(fb), pack));
+    __m128i quotient=_mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(ia), _mm256_cvtepi32_pd(ib)));
+    quotient=_mm_andnot_si128(_mm_cmpeq_epi32(ib, _mm_setzero_si128()), quotient); // x / 0 is 0, INT_MIN / -1 converts to INT_MIN
+    __m128i ir=_mm_add_epi32(ia, ib);
+    ir=_mm_blendv_epi8(ir, quotient, _mm_cmpeq_epi32(op, _mm_set1_epi32(CALC_DIV)));
+    ir=_mm_blendv_epi8(ir, _mm_mullo_epi32(ia, ib), _mm_cmpeq_epi32(op, _mm_set1_epi32(CALC_MUL)));
+    ir=_mm_blendv_epi8(ir, _mm_sub_epi32(ia, ib), _mm_cmpeq_epi32(op, _mm_set1_epi32(CALC_SUB)));
+
+    __m256d is_float=_mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpgt_epi32(op, last_int)));
+    __m256d r=_mm256_blendv_pd(_mm256_castsi256_pd(_mm256_cvtepu32_epi64(ir)), fr, is_float);
+    _mm256_storeu_pd(&tasks->expected[i].f, r);
+  }
+  return i;
+}
+
+/* Two tasks per step, with SSE2 only. Like compute_avx2(), but SSE2 has no blend and no
+   32-bit multiply: lanes are picked with and/andnot masks, and the integer operands stay in
+   the low halves of their 64-bit lanes, where _mm_mul_epu32() multiplies them. */
+__attribute__((target("sse2")))
+static size_t compute_sse2(calc_task_batch_t *tasks, size_t n){
+  const __m128i low=_mm_set_epi32(0, -1, 0, -1);
+  const __m128i last_int=_mm_set1_epi32(CALC_FIRST_FLOAT - 1);
+  size_t i=0;
+
+#define SELECT_PD(mask, a, b) _mm_or_pd(_mm_and_pd(_mm_castsi128_pd(mask), a), _mm_andnot_pd(_mm_castsi128_pd(mask), b))
+#define SELECT_SI(mask, a, b) _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+// Compare of the two opcodes, spread over the 64-bit lanes of their tasks
+#define OP_IS(op, value) _mm_shuffle_epi32(_mm_cmpeq_epi32(op, _mm_set1_epi32(value)), _MM_SHUFFLE(1, 1, 0, 0))
+
+  for(;i + 2 <= n;i+=2){
+    __m128i op=_mm_loadl_epi64((const __m128i*)&tasks->op[i]);
+    __m128d fa=_mm_loadu_pd(&tasks->a[i].f);
+    __m128d fb=_mm_loadu_pd(&tasks->b[i].f);
+
+    // Float operators, selected by opcode
+    __m128d fr=_mm_add_pd(fa, fb);
+    fr=SELECT_PD(OP_IS(op, CALC_FDIV), _mm_div_pd(fa, fb), fr);
+    fr=SELECT_PD(OP_IS(op, CALC_FMUL), _mm_mul_pd(fa, fb), fr);
+    fr=SELECT_PD(OP_IS(op, CALC_FSUB), _mm_sub_pd(fa, fb), fr);
+
+    // Integer operators; division on the two operands packed together, through doubles
+    __m128i ia=_mm_castpd_si128(fa), ib=_mm_castpd_si128(fb);
+    __m128i pa=_mm_shuffle_epi32(ia, _MM_SHUFFLE(2, 2, 2, 0)), pb=_mm_shuffle_epi32(ib, _MM_SHUFFLE(2, 2, 2, 0));
+    __m128i quotient=_mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(pa), _mm_cvtepi32_pd(pb)));
+    quotient=_mm_andnot_si128(_mm_cmpeq_epi32(pb, _mm_setzero_si128()), quotient); // x / 0 is 0, INT_MIN / -1 converts to INT_MIN
+    __m128i ir=_mm_add_epi32(ia, ib);
+    ir=SELECT_SI(OP_IS(op, CALC_DIV), _mm_shuffle_epi32(quotient, _MM_SHUFFLE(1, 1, 0, 0)), ir);
+    ir=SELECT_SI(OP_IS(op, CALC_MUL), _mm_mul_epu32(ia, ib), ir); // The low 32 bits are the wrapped signed product
+    ir=SELECT_SI(OP_IS(op, CALC_SUB), _mm_sub_epi32(ia, ib), ir);
+    ir=_mm_and_si128(ir, low);
+
+    __m128i is_float=_mm_shuffle_epi32(_mm_cmpgt_epi32(op, last_int), _MM_SHUFFLE(1, 1, 0, 0));
+    _mm_storeu_pd(&tasks->expected[i].f, SELECT_PD(is_float, fr, _mm_castsi128_pd(ir)));
+  }
+#undef SELECT_PD
+#undef SELECT_SI
+#undef OP_IS
+  return i;
+}
+
+/* Four results per step: a tolerance compare for float lanes, an exact compare of the low
+   32 bits for integer lanes. */
+__attribute__((target("avx2")))
+static size_t check_avx2(const calc_op_t *op, const calc_value_t *expected, const calc_value_t *result,
+                         unsigned char *correct, size_t n, double tolerance, size_t *count){
+  const __m256d sign=_mm256_set1_pd(-0.0);
+  const __m256d limit=_mm256_set1_pd(tolerance);
+  const __m256i low=_mm256_set1_epi64x(0xffffffffLL);
+  const __m128i last_int=_mm_set1_epi32(CALC_FIRST_FLOAT - 1);
+  size_t i=0;
+
+  for(;i + 4 <= n;i+=4){
+    __m256d e=_mm256_loadu_pd(&expected[i].f);
+    __m256d r=_mm256_loadu_pd(&result[i].f);
+    __m256d float_ok=_mm256_cmp_pd(_mm256_andnot_pd(sign, _mm256_sub_pd(e, r)), limit, _CMP_LT_OQ);
+    __m256i int_ok=_mm256_cmpeq_epi64(_mm256_and_si256(_mm256_castpd_si256(e), low),
+                                      _mm256_and_si256(_mm256_castpd_si256(r), low));
+    __m128i ops=_mm_loadu_si128((const __m128i*)&op[i]);
+    __m256d is_float=_mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpgt_epi32(ops, last_int)));
+    int mask=_mm256_movemask_pd(_mm256_blendv_pd(_mm256_castsi256_pd(int_ok), float_ok, is_float));
+
+    correct[i]=mask & 1;
+    correct[i + 1]=(mask >> 1) & 1;
+    correct[i + 2]=(mask >> 2) & 1;
+    correct[i + 3]=(mask >> 3) & 1;
+    *count+=__builtin_popcount(mask);
+  }
+  return i;
+}
+
+/* Two results per step, with SSE2 only (always there on x86-64). */
+__attribute__((target("sse2")))
+static size_t check_sse2(const calc_op_t *op, const calc_value_t *expected, const calc_value_t *result,
+                         unsigned char *correct, size_t n, double tolerance, size_t *count){
+  const __m128d sign=_mm_set1_pd(-0.0);
+  const __m128d limit=_mm_set1_pd(tolerance);
+  const __m128i last_int=_mm_set1_epi32(CALC_FIRST_FLOAT - 1);
+  size_t i=0;
+
+  for(;i + 2 <= n;i+=2){
+    __m128d e=_mm_loadu_pd(&expected[i].f);
+    __m128d r=_mm_loadu_pd(&result[i].f);
+    __m128d float_ok=_mm_cmplt_pd(_mm_andnot_pd(sign, _mm_sub_pd(e, r)), limit);
+    // Spread the compare of each low half over its whole 64-bit lane
+    __m128i int_ok=_mm_shuffle_epi32(_mm_cmpeq_epi32(_mm_castpd_si128(e), _mm_castpd_si128(r)), _MM_SHUFFLE(2, 2, 0, 0));
+    __m128i is_float=_mm_shuffle_epi32(_mm_cmpgt_epi32(_mm_loadl_epi64((const __m128i*)&op[i]), last_int), _MM_SHUFFLE(1, 1, 0, 0));
+    __m128d ok=_mm_or_pd(_mm_and_pd(_mm_castsi128_pd(is_float), float_ok),
+                         _mm_andnot_pd(_mm_castsi128_pd(is_float), _mm_castsi128_pd(int_ok)));
+    int mask=_mm_movemask_pd(ok);
+
+    correct[i]=mask & 1;
+    correct[i + 1]=(mask >> 1) & 1;
+    *count+=__builtin_popcount(mask);
+  }
+  return i;
+}
+
+#endif
+
+void calcComputeBatch(calc_task_batch_t *tasks, size_t n){
+  size_t done=0;
+#ifdef CALC_X86
+  int level=simd_level();
+  if(level >= SIMD_AVX2){
+    done=compute_avx2(tasks, n);
+  } else if(level >= SIMD_SSE2){
+    done=compute_sse2(tasks, n);
+  }
+#endif
+  compute_scalar(tasks, done, n);
+}
+
+size_t calcCheckBatch(const calc_op_t *op, const calc_value_t *expected, const calc_value_t *result,
+                      unsigned char *correct, size_t n, double tolerance){
+  size_t done=0, count=0;
+#ifdef CALC_X86
+  int level=simd_level();
+  if(level >= SIMD_AVX2){
+    done=check_avx2(op, expected, result, correct, n, tolerance, &count);
+  } else if(level >= SIMD_SSE2){
+    done=check_sse2(op, expected, result, correct, n, tolerance, &count);
+  }
+#endif
+  return count + check_scalar(op, expected, result, correct, done, n, tolerance);
+}
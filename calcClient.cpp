@@ -0,0 +1,787 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <algorithm>
+#include <functional>
+#include "shmTransport.h"
+#include "calcClient.h"
+
+#define PERSISTENT_REQUEST "TEXT TCP 1.1"  // Asks the server for a persistent session
+#define QUIT_MESSAGE "QUIT\n"              // Ends a persistent session
+#define UNIX_CONNECT_RETRY_NS 200000      // Pause before connecting again to a full Unix socket
+
+namespace calcclient {
+
+const char *status_text(Status status) {
+    switch (status) {
+    case Status::OK:       return "ok";
+    case Status::CLOSED:   return "closed by the server";
+    case Status::TIMEOUT:  return "timed out";
+    case Status::ERROR:    return "socket error";
+    case Status::PROTOCOL: return "unexpected data from the server";
+    case Status::BUSY:     return "server busy";
+    }
+    return "unknown";
+}
+
+static bool is_line(const char *line, size_t length, const char *expected) {
+    return length == strlen(expected) && memcmp(line, expected, length) == 0;
+}
+
+/**
+ * Busy-wait hint for the spin on a shared-memory ring.
+ */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Top-level frame of a spawned task. It starts at once, keeps itself on the executor's
+ * list while it runs and frees itself when the task finishes.
+ */
+struct Executor::detached {
+    struct promise_type {
+        task_link link;
+
+        promise_type(Executor &executor, Task<void>&) {
+            link.prev = executor.live.prev;
+            link.next = &executor.live;
+            executor.live.prev->next = &link;
+            executor.live.prev = &link;
+        }
+        ~promise_type() {
+            link.prev->next = link.next;
+            link.next->prev = link.prev;
+        }
+
+        detached get_return_object() {
+            link.handle = std::coroutine_handle<promise_type>::from_promise(*this);
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+Executor::detached Executor::run_detached(Executor&, Task<void> task) {
+    co_await task;
+}
+
+Executor::Executor() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("Failed to create epoll instance");
+    }
+    update_clock();
+    timer_wheel_init(&timers, now_ms());
+    live.prev = live.next = &live;
+}
+
+Executor::~Executor() {
+    while (live.next != &live) {
+        live.next->handle.destroy();
+    }
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+    }
+}
+
+void Executor::update_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void Executor::spawn(Task<void> task) {
+    run_detached(*this, std::move(task));
+}
+
+void Executor::add_sleeper(long long when, std::coroutine_handle<> handle) {
+    sleepers.push_back(sleeper{when, handle});
+    std::push_heap(sleepers.begin(), sleepers.end(), std::greater<sleeper>());
+}
+
+void Executor::timer_expired(struct timer_node *node, void *) {
+    Connection *connection = ((Connection::connection_timer*)node)->owner;
+    connection->timed_out = true;
+    if (connection->waiter) {
+        connection->waiter.resume();
+    }
+}
+
+void Executor::run(long long deadline_ns) {
+    struct epoll_event events[CLIENT_EVENTS];
+
+    update_clock();
+    while (live.next != &live && (deadline_ns < 0 || now < deadline_ns) && epoll_fd != -1) {
+        // Sleep until the first socket event, timeout, sleeper or the deadline
+        long long wait = -1;
+        int timer_ms = timer_wheel_next_timeout(&timers, now_ms());
+        if (timer_ms >= 0) {
+            wait = timer_ms * 1000000LL;
+        }
+        if (!sleepers.empty()) {
+            long long until = sleepers.front().when > now ? sleepers.front().when - now : 0;
+            wait = wait < 0 || until < wait ? until : wait;
+        }
+        if (deadline_ns >= 0 && (wait < 0 || deadline_ns - now < wait)) {
+            wait = deadline_ns - now;
+        }
+        struct timespec timeout = { (time_t)(wait / 1000000000LL), (long)(wait % 1000000000LL) };
+
+        int ready = epoll_pwait2(epoll_fd, events, CLIENT_EVENTS, wait < 0 ? NULL : &timeout, NULL);
+        update_clock();
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_pwait2 failed");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            Connection *connection = (Connection*)events[i].data.ptr;
+            if (connection->waiter) {
+                connection->waiter.resume();
+            }
+        }
+
+        timer_wheel_advance(&timers, now_ms(), timer_expired, this);
+
+        while (!sleepers.empty() && sleepers.front().when <= now) {
+            std::coroutine_handle<> handle = sleepers.front().handle;
+            std::pop_heap(sleepers.begin(), sleepers.end(), std::greater<sleeper>());
+            sleepers.pop_back();
+            handle.resume();
+        }
+    }
+
+    while (live.next != &live) {
+        live.next->handle.destroy(); // Closes the connections on their frames
+    }
+    sleepers.clear();
+}
+
+Connection::Connection(Executor &executor)
+    : executor(executor), fd(-1), deadline(0), timed_out(false), shm(NULL), doorbell(-1), peer_doorbell(-1) {
+    memset(&timer, 0, sizeof(timer));
+    timer.owner = this;
+    framer_init(&in, in_storage, sizeof(in_storage));
+}
+
+Connection::~Connection() {
+    close();
+}
+
+void Connection::close() {
+    timer_wheel_cancel(&executor.timers, &timer.node);
+    if (fd != -1) {
+        ::close(fd); // Also takes it out of the epoll set
+        fd = -1;
+    }
+    if (shm != NULL) {
+        shm_channel_unmap(shm);
+        shm = NULL;
+        ::close(doorbell);
+        ::close(peer_doorbell);
+        doorbell = peer_doorbell = -1;
+    }
+    framer_init(&in, in_storage, sizeof(in_storage));
+}
+
+void Connection::ready_awaiter::await_suspend(std::coroutine_handle<> h) {
+    connection->waiter = h;
+    connection->timed_out = false;
+    if (connection->deadline > 0) {
+        timer_wheel_arm(&connection->executor.timers, &connection->timer.node, connection->deadline);
+    }
+}
+
+bool Connection::ready_awaiter::await_resume() {
+    timer_wheel_cancel(&connection->executor.timers, &connection->timer.node);
+    connection->waiter = nullptr;
+    return !connection->timed_out;
+}
+
+bool Connection::shm_pending(bool room) const {
+    if (room) {
+        return shm_ring_room(&shm->to_server) > 0 || shm->server_closed.load(std::memory_order_acquire);
+    }
+    return shm_ring_length(&shm->to_client) > 0 || shm->server_closed.load(std::memory_order_acquire);
+}
+
+bool Connection::shm_awaiter::await_ready() {
+    // Spinning only helps if the server runs at the same time
+    static const int spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    for (int i = 0; i < spin; i++) {
+        if (connection->shm_pending(room)) {
+            return true;
+        }
+        cpu_relax();
+    }
+    // Announce the sleep, then look once more: the server may have just missed it
+    connection->shm->client_sleeping.store(1, std::memory_order_seq_cst);
+    if (connection->shm_pending(room)) {
+        connection->shm->client_sleeping.store(0, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void Connection::shm_awaiter::await_suspend(std::coroutine_handle<> h) {
+    suspended = true;
+    connection->ready().await_suspend(h);
+}
+
+bool Connection::shm_awaiter::await_resume() {
+    if (!suspended) {
+        return true;
+    }
+    connection->shm->client_sleeping.store(0, std::memory_order_relaxed);
+    shm_drain_doorbell(connection->doorbell); // Edge-triggered: the next ring must be a new edge
+    return connection->ready().await_resume();
+}
+
+Task<Status> Connection::connect(const struct addrinfo *server) {
+    close();
+    fd = socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, server->ai_protocol);
+    if (fd == -1) {
+        co_return Status::ERROR;
+    }
+
+    // Registered once for both directions; whoever waits on the connection is resumed
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = this;
+    if (epoll_ctl(executor.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        co_return Status::ERROR;
+    }
+
+    if (::connect(fd, server->ai_addr, server->ai_addrlen) == 0) {
+        co_return Status::OK;
+    }
+    // A Unix socket does not queue connects in progress: with the listen queue full it fails
+    // with EAGAIN at once, and there is no event to wait for. Try again shortly instead.
+    while (errno == EAGAIN && server->ai_family == AF_UNIX) {
+        if (deadline > 0 && executor.now_ms() >= deadline) {
+            co_return Status::TIMEOUT;
+        }
+        co_await executor.sleep_until(executor.now_ns() + UNIX_CONNECT_RETRY_NS);
+        if (::connect(fd, server->ai_addr, server->ai_addrlen) == 0) {
+            co_return Status::OK;
+        }
+    }
+    while (errno == EINPROGRESS || errno == EALREADY || errno == EINTR) {
+        if (!co_await ready()) {
+            co_return Status::TIMEOUT;
+        }
+        // Asking again tells a finished connect from a pending one, even on a stray wakeup
+        if (::connect(fd, server->ai_addr, server->ai_addrlen) == 0 || errno == EISCONN) {
+            co_return Status::OK;
+        }
+    }
+    co_return Status::ERROR;
+}
+
+Task<Status> Connection::fill() {
+    while (true) {
+        size_t space;
+        char *free_space = framer_write_ptr(&in, &space);
+        if (space == 0) {
+            co_return Status::PROTOCOL; // Line longer than the buffer
+        }
+        if (shm != NULL) {
+            size_t copied = shm_ring_read(&shm->to_client, free_space, space);
+            if (copied > 0) {
+                framer_commit(&in, copied);
+                shm_wake(&shm->server_sleeping, peer_doorbell); // It may be waiting for room
+                co_return Status::OK;
+            }
+            // The server puts its last output into the ring before it sets server_closed
+            if (shm->server_closed.load(std::memory_order_acquire) && shm_ring_length(&shm->to_client) == 0) {
+                co_return Status::CLOSED;
+            }
+            if (!co_await shm_ready(false)) {
+                co_return Status::TIMEOUT;
+            }
+            continue;
+        }
+        ssize_t received_bytes = recv(fd, free_space, space, 0);
+        if (received_bytes > 0) {
+            framer_commit(&in, received_bytes);
+            co_return Status::OK;
+        }
+        if (received_bytes == 0) {
+            co_return Status::CLOSED;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!co_await ready()) {
+                co_return Status::TIMEOUT;
+            }
+        } else if (errno != EINTR) {
+            co_return Status::ERROR;
+        }
+    }
+}
+
+Task<Status> Connection::read_line(const char **line, size_t *length) {
+    while (!framer_next_line(&in, line, length)) {
+        Status status = co_await fill();
+        if (status != Status::OK) {
+            co_return status;
+        }
+    }
+    co_return Status::OK;
+}
+
+Task<Status> Connection::read(void *out, size_t length) {
+    while (!framer_read(&in, out, length)) {
+        Status status = co_await fill();
+        if (status != Status::OK) {
+            co_return status;
+        }
+    }
+    co_return Status::OK;
+}
+
+Task<Status> Connection::write(const void *data, size_t length) {
+    const char *p = (const char*)data;
+    while (length > 0) {
+        if (shm != NULL) {
+            size_t copied = shm_ring_write(&shm->to_server, p, length);
+            if (copied > 0) {
+                p += copied;
+                length -= copied;
+                shm_wake(&shm->server_sleeping, peer_doorbell);
+            } else if (shm->server_closed.load(std::memory_order_acquire)) {
+                co_return Status::CLOSED;
+            } else if (!co_await shm_ready(true)) {
+                co_return Status::TIMEOUT;
+            }
+            continue;
+        }
+        ssize_t sent_bytes = send(fd, p, length, MSG_NOSIGNAL);
+        if (sent_bytes >= 0) {
+            p += sent_bytes;
+            length -= sent_bytes;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!co_await ready()) {
+                co_return Status::TIMEOUT;
+            }
+        } else if (errno != EINTR) {
+            co_return Status::ERROR;
+        }
+    }
+    co_return Status::OK;
+}
+
+static void close_fds(const int *fds, int count) {
+    for (int i = 0; i < count; i++) {
+        ::close(fds[i]);
+    }
+}
+
+Task<Status> Connection::share_memory(bool *granted) {
+    *granted = false;
+    Status status = co_await write(SHM_REQUEST, strlen(SHM_REQUEST));
+    if (status != Status::OK) {
+        co_return status;
+    }
+
+    // Read the answer with recvmsg(), the descriptors come with it
+    int fds[SHM_FD_COUNT];
+    int fd_count = 0;
+    const char *line;
+    size_t length;
+    while (!framer_next_line(&in, &line, &length)) {
+        size_t space;
+        char *free_space = framer_write_ptr(&in, &space);
+        int received_fds[SHM_FD_COUNT];
+        int received_count;
+        ssize_t received_bytes = space == 0 ? -1 : shm_recv_fds(fd, free_space, space, received_fds, &received_count);
+        if (received_bytes > 0 && received_count > 0 && fd_count == 0) {
+            memcpy(fds, received_fds, sizeof(int) * received_count);
+            fd_count = received_count;
+        } else if (received_bytes > 0) {
+            close_fds(received_fds, received_count);
+        }
+
+        if (received_bytes > 0) {
+            framer_commit(&in, received_bytes);
+            continue;
+        }
+        if (received_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (co_await ready()) {
+                continue;
+            }
+            status = Status::TIMEOUT;
+        } else {
+            status = space == 0 ? Status::PROTOCOL : received_bytes == 0 ? Status::CLOSED : Status::ERROR;
+        }
+        close_fds(fds, fd_count);
+        co_return status;
+    }
+
+    if (is_line(line, length, SHM_DECLINE)) {
+        close_fds(fds, fd_count);
+        co_return Status::OK;
+    }
+    struct shm_channel *channel = NULL;
+    if (!is_line(line, length, SHM_ACCEPT) || fd_count != SHM_FD_COUNT
+        || (channel = shm_channel_map(fds[SHM_FD_MEMORY])) == NULL) {
+        close_fds(fds, fd_count);
+        co_return Status::PROTOCOL;
+    }
+    ::close(fds[SHM_FD_MEMORY]); // The mapping keeps the memory
+    shm = channel;
+    doorbell = fds[SHM_FD_CLIENT_DOORBELL];
+    peer_doorbell = fds[SHM_FD_SERVER_DOORBELL];
+
+    // From now on the connection waits for its doorbell; the socket stays open only to end the session
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = this;
+    if (epoll_ctl(executor.epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1
+        || epoll_ctl(executor.epoll_fd, EPOLL_CTL_ADD, doorbell, &ev) == -1) {
+        co_return Status::ERROR;
+    }
+    *granted = true;
+    co_return Status::OK;
+}
+
+size_t solve_assignment(const char *assignment, size_t length, char *result) {
+    const char *end = assignment + length;
+    const char *name = "";
+    size_t name_length = 0;
+    calc_value_t operand1, operand2;
+    double double_operand1 = 0.0, double_operand2 = 0.0;
+
+    parse_word(&assignment, end, &name, &name_length);
+    parse_double(&assignment, end, &double_operand1);
+    parse_double(&assignment, end, &double_operand2);
+
+    // An unknown operation is answered with 0
+    calc_op_t op = calcOpLookup(name, name_length);
+    size_t result_length;
+    if (op == CALC_OP_COUNT) {
+        result_length = format_int(result, 0);
+    } else if (calcOps[op].is_float) {
+        operand1.f = double_operand1;
+        operand2.f = double_operand2;
+        result_length = format_float8(result, calcOps[op].compute(operand1, operand2).f);
+    } else {
+        operand1.i = (int)double_operand1;
+        operand2.i = (int)double_operand2;
+        result_length = format_int(result, calcOps[op].compute(operand1, operand2).i);
+    }
+    result[result_length++] = '\n';
+    return result_length;
+}
+
+void solve_frame(const struct binary_frame *task, struct binary_frame *result) {
+    memset(result, 0, sizeof(*result));
+    result->opcode = BINARY_RESULT;
+    result->width = task->width;
+    result->seq = task->seq;
+
+    calc_value_t operand1, operand2;
+    if (calcOps[task->opcode].is_float) {
+        operand1.f = task->a.f;
+        operand2.f = task->b.f;
+        result->a.f = calcOps[task->opcode].compute(operand1, operand2).f;
+    } else {
+        operand1.i = task->a.i;
+        operand2.i = task->b.i;
+        result->a.i = calcOps[task->opcode].compute(operand1, operand2).i;
+    }
+}
+
+size_t solve_udp_task(const char *task, size_t length, char *reply) {
+    if (length < UDP_TOKEN_LENGTH + 2 || length > UDP_MAX_DATAGRAM - 32 || task[UDP_TOKEN_LENGTH] != ' '
+        || task[length - 1] != '\n') {
+        return 0;
+    }
+    memcpy(reply, task, length - 1);
+    reply[length - 1] = ' ';
+    return length + solve_assignment(task + UDP_TOKEN_LENGTH + 1, length - UDP_TOKEN_LENGTH - 1, reply + length);
+}
+
+Session::Session(Executor &executor, long long timeout_ms)
+    : executor(executor), conn(executor), timeout(timeout_ms), protocol(Protocol::TEXT_1_0),
+      greeting_size(0), error_size(0) {
+}
+
+void Session::start_step() {
+    conn.set_deadline(timeout > 0 ? executor.now_ms() + timeout : 0);
+}
+
+/**
+ * Keep an error line from the server and tell its status.
+ */
+Status Session::server_error(const char *line, size_t length) {
+    error_size = length < sizeof(error_text) ? length : sizeof(error_text);
+    memcpy(error_text, line, error_size);
+    if (is_line(line, length, "ERROR TO\n")) {
+        return Status::TIMEOUT;
+    }
+    return is_line(line, length, "ERROR BUSY\n") ? Status::BUSY : Status::PROTOCOL;
+}
+
+Task<Status> Session::connect(const struct addrinfo *server) {
+    start_step();
+    error_size = 0;
+    co_return co_await conn.connect(server);
+}
+
+Task<Status> Session::greet() {
+    const char *line;
+    size_t length;
+    bool offered = false;
+
+    start_step();
+    greeting_size = 0;
+    do {
+        Status status = co_await conn.read_line(&line, &length);
+        if (status != Status::OK) {
+            co_return status;
+        }
+        if (greeting_size == 0 && is_line(line, length, "ERROR BUSY\n")) {
+            co_return server_error(line, length);
+        }
+        greeting_size += length;
+        if (memmem(line, length, "TEXT TCP 1.0", strlen("TEXT TCP 1.0")) != NULL) {
+            offered = true;
+        }
+    } while (length > 1 && greeting_size <= 100);
+
+    co_return offered && greeting_size <= 100 ? Status::OK : Status::PROTOCOL;
+}
+
+Task<Status> Session::share_memory(bool *granted) {
+    start_step();
+    co_return co_await conn.share_memory(granted);
+}
+
+Task<Status> Session::request(Protocol requested, unsigned window) {
+    char message[50];
+
+    start_step();
+    protocol = requested;
+    if (protocol == Protocol::TEXT_1_0) {
+        snprintf(message, sizeof(message), "OK\n");
+    } else {
+        const char *name = protocol == Protocol::BINARY ? BINARY_REQUEST : PERSISTENT_REQUEST;
+        if (window > 0) {
+            snprintf(message, sizeof(message), "%s %u\n", name, window);
+        } else {
+            snprintf(message, sizeof(message), "%s\n", name);
+        }
+    }
+    co_return co_await conn.write(message, strlen(message));
+}
+
+Task<Status> Session::next_task(Assignment &task) {
+    start_step();
+    if (protocol == Protocol::BINARY) {
+        struct binary_frame frame;
+        Status status = co_await conn.read(&frame, sizeof(frame));
+        if (status != Status::OK) {
+            co_return status;
+        }
+        if (frame.opcode == BINARY_ERROR) {
+            co_return (frame.flags & BINARY_ERROR_TIMEOUT) ? server_error("ERROR TO\n", 9) : server_error("ERROR\n", 6);
+        }
+        if (frame.opcode >= BINARY_OP_COUNT) {
+            co_return Status::PROTOCOL;
+        }
+        task.line_length = 0;
+        solve_frame(&frame, &task.frame);
+        co_return Status::OK;
+    }
+
+    const char *line;
+    size_t length;
+    Status status = co_await conn.read_line(&line, &length);
+    if (status != Status::OK) {
+        co_return status;
+    }
+    if (length >= 5 && memcmp(line, "ERROR", 5) == 0) {
+        co_return server_error(line, length);
+    }
+    task.line_length = length < sizeof(task.line) ? length : sizeof(task.line);
+    memcpy(task.line, line, task.line_length);
+    task.result_length = solve_assignment(task.line, task.line_length, task.result);
+    co_return Status::OK;
+}
+
+Task<Status> Session::answer(Assignment &task) {
+    start_step();
+    if (protocol == Protocol::BINARY) {
+        struct binary_frame frame;
+        Status status = co_await conn.write(&task.frame, sizeof(task.frame));
+        if (status == Status::OK) {
+            status = co_await conn.read(&frame, sizeof(frame));
+        }
+        if (status != Status::OK) {
+            co_return status;
+        }
+        if (frame.opcode == BINARY_ERROR) {
+            co_return (frame.flags & BINARY_ERROR_TIMEOUT) ? server_error("ERROR TO\n", 9) : server_error("ERROR\n", 6);
+        }
+        if (frame.opcode != BINARY_VERDICT || frame.seq != task.frame.seq) {
+            co_return Status::PROTOCOL;
+        }
+        task.correct = (frame.flags & BINARY_CORRECT) != 0;
+        task.verdict_length = task.correct ? 3 : 6;
+        memcpy(task.verdict, task.correct ? "OK\n" : "ERROR\n", task.verdict_length);
+        co_return Status::OK;
+    }
+
+    const char *line;
+    size_t length;
+    Status status = co_await conn.write(task.result, task.result_length);
+    if (status == Status::OK) {
+        status = co_await conn.read_line(&line, &length);
+    }
+    if (status != Status::OK) {
+        co_return status;
+    }
+    if (is_line(line, length, "ERROR TO\n")) {
+        co_return server_error(line, length);
+    }
+    task.verdict_length = length < sizeof(task.verdict) ? length : sizeof(task.verdict);
+    memcpy(task.verdict, line, task.verdict_length);
+    task.correct = is_line(line, length, "OK\n");
+    co_return Status::OK;
+}
+
+Task<Status> Session::quit() {
+    start_step();
+    if (protocol == Protocol::BINARY) {
+        struct binary_frame frame;
+        memset(&frame, 0, sizeof(frame));
+        frame.opcode = BINARY_QUIT;
+        co_return co_await conn.write(&frame, sizeof(frame));
+    }
+    if (protocol == Protocol::TEXT_1_1) {
+        co_return co_await conn.write(QUIT_MESSAGE, strlen(QUIT_MESSAGE));
+    }
+    co_return Status::OK;
+}
+
+Task<Status> Session::run_window(unsigned task_count, unsigned *verdicts, unsigned *correct) {
+    *verdicts = *correct = 0;
+    if (protocol == Protocol::BINARY) {
+        co_return co_await run_binary_window(task_count, verdicts, correct);
+    }
+    co_return co_await run_text_window(task_count, verdicts, correct);
+}
+
+/**
+ * Pipelined TEXT TCP 1.1: every line carries the sequence number of its task.
+ */
+Task<Status> Session::run_text_window(unsigned task_count, unsigned *verdicts, unsigned *correct) {
+    char results[CLIENT_BUFFER_SIZE];
+    size_t results_length = 0;
+    unsigned tasks_answered = 0;
+
+    while (*verdicts < task_count) {
+        // Handle every line already received, answering the tasks in one batch
+        const char *line;
+        size_t length;
+        bool full = false;
+        while (!(full = sizeof(results) - results_length < 64) && framer_next_line(conn.input(), &line, &length)) {
+            const char *end = line + length;
+            const char *rest = line;
+            uint32_t seq;
+
+            if (length >= 5 && memcmp(line, "ERROR", 5) == 0) {
+                co_return server_error(line, length);
+            }
+            if (!parse_uint32(&rest, end, &seq)) {
+                continue;
+            }
+            if (end - rest == 4 && memcmp(rest, " OK\n", 4) == 0) {
+                (*verdicts)++;
+                (*correct)++;
+            } else if (end - rest == 7 && memcmp(rest, " ERROR\n", 7) == 0) {
+                (*verdicts)++;
+            } else if (tasks_answered < task_count) {
+                results_length += format_uint32(results + results_length, seq);
+                results[results_length++] = ' ';
+                results_length += solve_assignment(rest, end - rest, results + results_length);
+                tasks_answered++;
+            }
+        }
+
+        start_step();
+        if (results_length > 0) {
+            Status status = co_await conn.write(results, results_length);
+            if (status != Status::OK) {
+                co_return status;
+            }
+            results_length = 0;
+        }
+        if (*verdicts == task_count) {
+            break;
+        }
+        if (!full) {
+            Status status = co_await conn.fill();
+            if (status != Status::OK) {
+                co_return status;
+            }
+        }
+    }
+    co_return Status::OK;
+}
+
+/**
+ * BINARY TCP 1.0 with a window: the same with binary_frame records.
+ */
+Task<Status> Session::run_binary_window(unsigned task_count, unsigned *verdicts, unsigned *correct) {
+    struct binary_frame results[CLIENT_BUFFER_SIZE / sizeof(struct binary_frame)];
+    unsigned tasks_answered = 0;
+
+    while (*verdicts < task_count) {
+        size_t result_count = 0;
+        struct binary_frame frame;
+        while (result_count < sizeof(results) / sizeof(results[0]) && framer_read(conn.input(), &frame, sizeof(frame))) {
+            if (frame.opcode == BINARY_VERDICT) {
+                (*verdicts)++;
+                *correct += (frame.flags & BINARY_CORRECT) != 0;
+            } else if (frame.opcode == BINARY_ERROR) {
+                co_return (frame.flags & BINARY_ERROR_TIMEOUT) ? server_error("ERROR TO\n", 9) : server_error("ERROR\n", 6);
+            } else if (frame.opcode < BINARY_OP_COUNT && tasks_answered < task_count) {
+                solve_frame(&frame, &results[result_count++]);
+                tasks_answered++;
+            }
+        }
+
+        start_step();
+        if (result_count > 0) {
+            Status status = co_await conn.write(results, result_count * sizeof(struct binary_frame));
+            if (status != Status::OK) {
+                co_return status;
+            }
+        }
+        if (*verdicts == task_count) {
+            break;
+        }
+        if (framer_length(conn.input()) < sizeof(frame)) {
+            Status status = co_await conn.fill();
+            if (status != Status::OK) {
+                co_return status;
+            }
+        }
+    }
+    co_return Status::OK;
+}
+
+}
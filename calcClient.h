@@ -0,0 +1,437 @@
+#ifndef __CALC_CLIENT
+#define __CALC_CLIENT
+
+/*
+
+Client side of the calculation protocols as a small coroutine library.
+
+Every protocol step is a C++20 coroutine returning a calcclient::Task, so a session reads
+like the blocking client it replaces:
+
+    calcclient::Session session(executor, timeout_ms);
+    if (co_await session.connect(server) != Status::OK) ...
+    co_await session.greet();
+    co_await session.request(Protocol::TEXT_1_1);
+    co_await session.next_task(task);
+    co_await session.answer(task);
+
+but a step that would block suspends the coroutine instead of the thread. One Executor (an
+edge-triggered epoll loop plus a timer wheel for the per-step timeouts) drives any number
+of sessions on a single thread.
+
+A session on a Unix socket may move to the shared-memory transport (shmTransport.h) right
+after the greeting with share_memory(). Its connection then reads and writes the rings
+instead of the socket, and only waits on the executor once a ring stayed empty (or full)
+for SHM_SPIN polls (at once on a single CPU).
+
+Errors are returned as a Status, never thrown.
+
+Implementation in calcClient.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <vector>
+#include "calcLib.h"
+#include "binaryProtocol.h"
+#include "udpProtocol.h"
+#include "lineFramer.h"
+#include "timerWheel.h"
+
+#define CLIENT_BUFFER_SIZE 4096  // Input framer of a connection, a power of two
+#define CLIENT_EVENTS 256        // epoll events handled per loop iteration
+
+struct shm_channel;
+
+namespace calcclient {
+
+enum class Status {
+    OK,
+    CLOSED,                      // The server closed the connection
+    TIMEOUT,                     // The step ran into the session's timeout, or the server's
+    ERROR,                       // A socket call failed
+    PROTOCOL,                    // The server sent something unexpected
+    BUSY                         // The server turned the connection away with "ERROR BUSY"
+};
+
+const char *status_text(Status status);
+
+/**
+ * A lazily started coroutine producing a T. It runs when awaited, and resumes its awaiter
+ * when it finishes.
+ */
+template <typename T>
+class Task {
+public:
+    struct promise_type;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type h) noexcept {
+            std::coroutine_handle<> continuation = h.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        T value{};
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Task(handle_type h) : handle(h) {}
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task &operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() { return std::move(handle.promise().value); }
+
+private:
+    handle_type handle;
+};
+
+template <>
+class Task<void> {
+public:
+    struct promise_type;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type h) noexcept {
+            std::coroutine_handle<> continuation = h.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Task(handle_type h) : handle(h) {}
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task &operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    void await_resume() {}
+
+    handle_type release() { return std::exchange(handle, nullptr); }
+
+private:
+    handle_type handle;
+};
+
+class Connection;
+
+/**
+ * Single-threaded event loop that resumes coroutines when their socket is ready, their
+ * timeout expires or their sleep ends.
+ */
+class Executor {
+public:
+    Executor();
+    ~Executor();
+    Executor(const Executor&) = delete;
+    Executor &operator=(const Executor&) = delete;
+
+    /**
+     * Start task and let the executor own it. It runs until its first suspension now.
+     * A connection may only be closed by the task using it.
+     */
+    void spawn(Task<void> task);
+
+    /**
+     * Run until every spawned task has finished, or until deadline_ns (see now_ns()).
+     * Tasks still suspended at the deadline are destroyed, closing their connections.
+     */
+    void run(long long deadline_ns = -1);
+
+    /**
+     * Monotonic clock, read once per loop iteration.
+     */
+    long long now_ns() const { return now; }
+    long long now_ms() const { return now / 1000000; }
+
+    /**
+     * co_await executor.sleep_until(when_ns) suspends the caller until when_ns.
+     */
+    struct sleep_awaiter {
+        Executor *executor;
+        long long when;
+        bool await_ready() const noexcept { return when <= executor->now; }
+        void await_suspend(std::coroutine_handle<> h) { executor->add_sleeper(when, h); }
+        void await_resume() const noexcept {}
+    };
+    sleep_awaiter sleep_until(long long when_ns) { return sleep_awaiter{this, when_ns}; }
+
+private:
+    friend class Connection;
+
+    struct sleeper {
+        long long when;
+        std::coroutine_handle<> handle;
+        bool operator>(const sleeper &other) const { return when > other.when; }
+    };
+
+    /**
+     * Spawned task in the list of live ones.
+     */
+    struct task_link {
+        task_link *prev, *next;
+        std::coroutine_handle<> handle;
+    };
+    struct detached;
+    static detached run_detached(Executor &executor, Task<void> task);
+
+    void add_sleeper(long long when, std::coroutine_handle<> handle);
+    void update_clock();
+    static void timer_expired(struct timer_node *node, void *context);
+
+    int epoll_fd;
+    long long now;
+    struct timer_wheel timers;
+    std::vector<sleeper> sleepers;   // Min-heap on when
+    task_link live;                  // Sentinel of the spawned tasks still running
+};
+
+/**
+ * A non-blocking TCP or Unix socket connection with a line framer on its input.
+ */
+class Connection {
+public:
+    explicit Connection(Executor &executor);
+    ~Connection();
+    Connection(const Connection&) = delete;
+    Connection &operator=(const Connection&) = delete;
+
+    /**
+     * Deadline of every following step, in executor milliseconds; 0 for none.
+     */
+    void set_deadline(long long deadline_ms) { deadline = deadline_ms; }
+
+    Task<Status> connect(const struct addrinfo *server);
+    Task<Status> read_line(const char **line, size_t *length); // Line is valid until the next read
+    Task<Status> read(void *out, size_t length);
+    Task<Status> write(const void *data, size_t length);
+
+    /**
+     * Ask the server for the shared-memory transport (SHM_REQUEST) and switch to it if the
+     * server agrees. *granted tells which; a declined request leaves the connection as it was.
+     */
+    Task<Status> share_memory(bool *granted);
+
+    /**
+     * Receive at least one more byte into the framer.
+     */
+    Task<Status> fill();
+
+    struct line_framer *input() { return &in; }
+    void close();
+
+private:
+    friend class Executor;
+
+    /**
+     * Suspends until the socket reports an event or the deadline passes. Resumes with
+     * false on timeout. Events are edge-triggered, so only await this after a socket call
+     * failed with EAGAIN.
+     */
+    struct ready_awaiter {
+        Connection *connection;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        bool await_resume();
+    };
+    ready_awaiter ready() { return ready_awaiter{this}; }
+
+    /**
+     * Shared-memory transport: spins for a while, then suspends until the server rings the
+     * doorbell or the deadline passes. Resumes with false on timeout.
+     */
+    struct shm_awaiter {
+        Connection *connection;
+        bool room;               // Wait for room in the ring to the server, not for data
+        bool suspended;
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> h);
+        bool await_resume();
+    };
+    shm_awaiter shm_ready(bool room) { return shm_awaiter{this, room, false}; }
+    bool shm_pending(bool room) const;
+
+    struct connection_timer {
+        struct timer_node node;  // First, the expiry callback casts the node back
+        Connection *owner;
+    };
+
+    Executor &executor;
+    int fd;
+    long long deadline;
+    bool timed_out;
+    std::coroutine_handle<> waiter;  // The one coroutine waiting on this connection
+    struct connection_timer timer;
+    struct line_framer in;
+    char in_storage[CLIENT_BUFFER_SIZE];
+
+    struct shm_channel *shm;     // Shared-memory transport, NULL on the socket
+    int doorbell;                // Eventfd the server rings for this side
+    int peer_doorbell;           // Eventfd this side rings for the server
+};
+
+enum class Protocol {
+    TEXT_1_0,                    // "OK\n", one task
+    TEXT_1_1,                    // Persistent, lockstep or with a window
+    BINARY                       // BINARY TCP 1.0, lockstep or with a window
+};
+
+/**
+ * One task as the client saw it.
+ */
+struct Assignment {
+    char line[64];               // Task as received (text)
+    size_t line_length;
+    char result[32];             // Reply, including the newline (text)
+    size_t result_length;
+    struct binary_frame frame;   // Reply (binary)
+    char verdict[64];            // Server's verdict line, "OK\n" or "ERROR\n" for binary
+    size_t verdict_length;
+    bool correct;
+};
+
+/**
+ * The client side of one connection to the server, one protocol step per call.
+ */
+class Session {
+public:
+    /**
+     * @param timeout_ms: Time each step may take, 0 to wait forever.
+     */
+    Session(Executor &executor, long long timeout_ms);
+
+    Task<Status> connect(const struct addrinfo *server);
+
+    /**
+     * Read the greeting up to its empty line and check that it offers TEXT TCP 1.0.
+     * Returns BUSY if the server sent "ERROR BUSY" instead, PROTOCOL for anything else.
+     */
+    Task<Status> greet();
+    size_t greeting_length() const { return greeting_size; }
+
+    /**
+     * After the greeting, before request(): move to the shared-memory transport if the
+     * server agrees (see Connection::share_memory()).
+     */
+    Task<Status> share_memory(bool *granted);
+
+    /**
+     * Answer the greeting; window > 0 asks for a pipelined session.
+     */
+    Task<Status> request(Protocol protocol, unsigned window = 0);
+
+    /**
+     * Lockstep: read the next task and solve it. If the server sends an error instead, see
+     * error().
+     */
+    Task<Status> next_task(Assignment &task);
+
+    /**
+     * Lockstep: send the result of task and read the verdict.
+     */
+    Task<Status> answer(Assignment &task);
+
+    Task<Status> quit();
+
+    /**
+     * Pipelined: answer tasks as they arrive until task_count verdicts are in. Results for
+     * tasks that arrive together go out together. The timeout applies to each wait for
+     * more data.
+     */
+    Task<Status> run_window(unsigned task_count, unsigned *verdicts, unsigned *correct);
+
+    /**
+     * Error line the server sent ("ERROR TO\n", ...), empty if none. TIMEOUT, BUSY or
+     * PROTOCOL was returned with it.
+     */
+    const char *error() const { return error_text; }
+    size_t error_length() const { return error_size; }
+
+    Connection &connection() { return conn; }
+
+private:
+    Task<Status> run_text_window(unsigned task_count, unsigned *verdicts, unsigned *correct);
+    Task<Status> run_binary_window(unsigned task_count, unsigned *verdicts, unsigned *correct);
+    void start_step();
+    Status server_error(const char *line, size_t length);
+
+    Executor &executor;
+    Connection conn;
+    long long timeout;
+    Protocol protocol;
+    size_t greeting_size;
+    char error_text[64];
+    size_t error_size;
+};
+
+/**
+ * Solve a text task ("fadd 1.5 2.25\n") into result, including the newline. result needs
+ * 32 bytes.
+ *
+ * @return: Length of the result.
+ */
+size_t solve_assignment(const char *assignment, size_t length, char *result);
+
+/**
+ * Solve a binary task frame into its result frame.
+ */
+void solve_frame(const struct binary_frame *task, struct binary_frame *result);
+
+/**
+ * Answer a TEXT UDP 1.0 task datagram: the task echoed with its result. reply needs
+ * UDP_MAX_DATAGRAM bytes.
+ *
+ * @return: Length of the reply, 0 if the datagram is not a task.
+ */
+size_t solve_udp_task(const char *task, size_t length, char *reply);
+
+}
+
+#endif
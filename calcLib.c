@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 
 /* Here we use " as the calcLib.c and calcLib.h files are in the same folder, and are to be BUILT
@@ -14,13 +15,196 @@
 /* array of char* that points to char arrays.  */ 
 char *arith[]={"add","div","mul","sub","fadd","fdiv","fmul","fsub"};
 
-/* Used for random number */
+/* Reference computations for calcOps[]. Integer results wrap around instead of being 
+   undefined, and division by zero gives 0, see calcBatch.c. */
+static calc_value_t compute_add(calc_value_t a, calc_value_t b){ calc_value_t r; r.i=calcIntAdd(a.i, b.i); return r; }
+static calc_value_t compute_div(calc_value_t a, calc_value_t b){ calc_value_t r; r.i=calcIntDiv(a.i, b.i); return r; }
+static calc_value_t compute_mul(calc_value_t a, calc_value_t b){ calc_value_t r; r.i=calcIntMul(a.i, b.i); return r; }
+static calc_value_t compute_sub(calc_value_t a, calc_value_t b){ calc_value_t r; r.i=calcIntSub(a.i, b.i); return r; }
+static calc_value_t compute_fadd(calc_value_t a, calc_value_t b){ calc_value_t r; r.f=a.f+b.f; return r; }
+static calc_value_t compute_fdiv(calc_value_t a, calc_value_t b){ calc_value_t r; r.f=a.f/b.f; return r; }
+static calc_value_t compute_fmul(calc_value_t a, calc_value_t b){ calc_value_t r; r.f=a.f*b.f; return r; }
+static calc_value_t compute_fsub(calc_value_t a, calc_value_t b){ calc_value_t r; r.f=a.f-b.f; return r; }
+
+/* One entry per calc_op_t, in the same order as arith[]. */
+const calc_op_info_t calcOps[CALC_OP_COUNT]={
+  {"add",  3, 2, 0, compute_add},
+  {"div",  3, 2, 0, compute_div},
+  {"mul",  3, 2, 0, compute_mul},
+  {"sub",  3, 2, 0, compute_sub},
+  {"fadd", 4, 2, 1, compute_fadd},
+  {"fdiv", 4, 2, 1, compute_fdiv},
+  {"fmul", 4, 2, 1, compute_fmul},
+  {"fsub", 4, 2, 1, compute_fsub},
+};
+
+/* Base seed of the generators, from the current time or initCalcLib_seed(). */
 time_t myData_seedValue;
 
+/* Implicit streams handed out so far. Explicit stream n (initCalcLib_stream()) is the base 
+   generator jumped n times by 2^128; implicit stream n is it long-jumped n times by 2^192, 
+   past the 2^160 draws any explicit stream starts within, so the two kinds never overlap. */
+static unsigned int nextImplicitStream=1;
+
+/* Each thread draws from its own generator, so workers neither share nor lock any state. 
+   A thread that never called initCalcLib*() gets the next implicit stream on its first draw. */
+static _Thread_local calc_rng_t threadRng;
+static _Thread_local int threadRngSeeded;
+
+static uint64_t rotl(uint64_t x, int k){
+  return (x << k) | (x >> (64 - k));
+}
+
+/* splitmix64, spreads a small seed over the 256 bits of state. */
+static uint64_t splitmix64(uint64_t *x){
+  uint64_t z=(*x += 0x9e3779b97f4a7c15ULL);
+  z=(z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z=(z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void calcRngSeed(calc_rng_t *rng, uint64_t seed){
+  for(int i=0;i<4;i++){
+    rng->s[i]=splitmix64(&seed);
+  }
+}
+
+uint64_t calcRngNext(calc_rng_t *rng){
+  /* xoshiro256** by Blackman and Vigna, see https://prng.di.unimi.it/ */
+  uint64_t *s=rng->s;
+  uint64_t result=rotl(s[1] * 5, 7) * 9;
+  uint64_t t=s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3]=rotl(s[3], 45);
+
+  return result;
+}
+
+void calcRngJump(calc_rng_t *rng){
+  /* Equivalent to 2^128 calls to calcRngNext(); gives 2^128 non-overlapping streams. */
+  static const uint64_t JUMP[]={ 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+  uint64_t s[4]={0, 0, 0, 0};
+
+  for(int i=0;i<4;i++){
+    for(int b=0;b<64;b++){
+      if(JUMP[i] & (1ULL << b)){
+        s[0] ^= rng->s[0];
+        s[1] ^= rng->s[1];
+        s[2] ^= rng->s[2];
+        s[3] ^= rng->s[3];
+      }
+      calcRngNext(rng);
+    }
+  }
+  rng->s[0]=s[0];
+  rng->s[1]=s[1];
+  rng->s[2]=s[2];
+  rng->s[3]=s[3];
+}
+
+/* Advance by 2^192 draws, the long jump of xoshiro256**. */
+static void calcRngLongJump(calc_rng_t *rng){
+  static const uint64_t LONG_JUMP[]={ 0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL, 0x77710069854ee241ULL, 0x39109bb02acbe635ULL };
+  uint64_t s[4]={0, 0, 0, 0};
+
+  for(int i=0;i<4;i++){
+    for(int b=0;b<64;b++){
+      if(LONG_JUMP[i] & (1ULL << b)){
+        s[0] ^= rng->s[0];
+        s[1] ^= rng->s[1];
+        s[2] ^= rng->s[2];
+        s[3] ^= rng->s[3];
+      }
+      calcRngNext(rng);
+    }
+  }
+  rng->s[0]=s[0];
+  rng->s[1]=s[1];
+  rng->s[2]=s[2];
+  rng->s[3]=s[3];
+}
+
+uint32_t calcRngBounded(calc_rng_t *rng, uint32_t bound){
+  /* Lemire's multiply-shift: the high half of x * bound is in [0, bound). The few low halves 
+     that would make some results more likely than others are rejected, so there is no modulo bias. */
+  uint64_t m=(calcRngNext(rng) >> 32) * bound;
+  uint32_t low=(uint32_t)m;
+  if(low < bound){
+    uint32_t threshold=-bound % bound;
+    while(low < threshold){
+      m=(calcRngNext(rng) >> 32) * bound;
+      low=(uint32_t)m;
+    }
+  }
+  return (uint32_t)(m >> 32);
+}
+
+calc_op_t calcRngOp(calc_rng_t *rng){
+  return (calc_op_t)calcRngBounded(rng, CALC_OP_COUNT);
+}
+
+int calcRngInt(calc_rng_t *rng){
+  return (int)calcRngBounded(rng, 100);
+}
+
+double calcRngFloat(calc_rng_t *rng){
+  /* 53 random bits make a double in [0, 1), scale it to [0, 100). */
+  return (double)(calcRngNext(rng) >> 11) * 0x1.0p-53 * 100.0;
+}
+
+void calcRngTaskBatch(calc_rng_t *rng, calc_task_batch_t *tasks, size_t n){
+  /* Draw the whole batch first, in the same order as randomOp(), randomInt() and randomFloat() 
+     would, then compute the reference results in one vectorized pass. */
+  for(size_t i=0;i<n;i++){
+    calc_op_t op=calcRngOp(rng);
+    tasks->op[i]=op;
+    if(calcOpIsFloat(op)){
+      tasks->a[i].f=calcRngFloat(rng);
+      tasks->b[i].f=calcRngFloat(rng);
+    } else {
+      tasks->a[i].i=calcRngInt(rng);
+      tasks->b[i].i=calcRngInt(rng);
+    }
+  }
+  calcComputeBatch(tasks, n);
+}
+
+void calcRngStream(calc_rng_t *rng, unsigned int stream){
+  /* Stream <stream> of the current base seed. Generators on different streams never see 
+     each other's numbers. */
+  calcRngSeed(rng, (uint64_t)myData_seedValue);
+  for(unsigned int i=0;i<stream;i++){
+    calcRngJump(rng);
+  }
+}
+
+int initCalcLib_stream(unsigned int stream){
+  calcRngStream(&threadRng, stream);
+  threadRngSeeded=1;
+  return(0);
+}
+
+calc_rng_t *calcThreadRng(void){
+  if(!threadRngSeeded){
+    unsigned int stream=__atomic_fetch_add(&nextImplicitStream, 1, __ATOMIC_RELAXED);
+    calcRngSeed(&threadRng, (uint64_t)myData_seedValue);
+    for(unsigned int i=0;i<stream;i++){
+      calcRngLongJump(&threadRng);
+    }
+    threadRngSeeded=1;
+  }
+  return &threadRng;
+}
+
 int initCalcLib(void){
   /* Init the random number generator with a seed, based on the current time--> should be randomish each time called */
-  srand((unsigned) time(&myData_seedValue));
-  return(0);
+  time(&myData_seedValue);
+  return initCalcLib_stream(0);
 }
 
 int initCalcLib_seed(unsigned int seed){
@@ -28,46 +212,40 @@ int initCalcLib_seed(unsigned int seed){
      Init the random number generator with a FIXED seed, will allow us to grab random numbers 
      in the same sequence all the time. Good when debugging, bad when running live. 
 
-     This is 'messy' for more details see https://en.wikipedia.org/wiki/Pseudorandom_number_generator. 
-
-     DO NOT USE rand() for production, wher you NEED good random numbers. 
+     For more details see https://en.wikipedia.org/wiki/Pseudorandom_number_generator. 
+     The generator is xoshiro256**, it is fast and statistically good, but it is NOT a 
+     cryptographic generator. 
   */
   
   myData_seedValue=seed;
-  srand(seed);
-  return(0);
+  return initCalcLib_stream(0);
+}
+
+calc_op_t randomOp(void){
+  return calcRngOp(calcThreadRng());
 }
   
 char *randomType(void){
-  int Listitems=sizeof(arith)/(sizeof(char*)); 
-  /* Figure out HOW many entries there are in the list.
-     First we get the total size that the array of pointers use, sizeof(arith). Then we divide with 
-     the size of a pointer (sizeof(char*)), this gives us the number of pointers in the list. 
-  */
-  int itemPos=rand() % Listitems;
-  /* As we know the number of items, we can just draw a random number and modulo it with the number 
-     of items in the list, then we will get a random number between 0 and the number of items in the list 
-     
-     Using that information, we just return the string found at that position arith[itemPos];
-  */
-  return(arith[itemPos]);
-  
+  /* Draw a random operator and return its name. randomOp() draws the same way, so with the 
+     same seed both give the same operators. */
+  return(arith[randomOp()]);
 };
 
 
 int randomInt(void){
-  /* Draw a random interger between o and RAND_MAX, then modulo this with 100 to get a random 
-     number between 0 and 100. */
+  /* Draw a random interger between 0 and 99, every value equally likely. */
   
-  return( rand()%100 );
+  return(calcRngInt(calcThreadRng()));
 };
 
 
 double randomFloat(void){
-  /* The same as for the interber, but for a double, and without the modulo. We cant use 
-     the module approach as it would generate integers, which we do not want. */
-  double x = (double)rand()/(double)(RAND_MAX/100.0);
-  return(x);
+  /* A random double between 0.0 and 100.0. We cant use the integer approach as it would 
+     generate integers, which we do not want. */
+  return(calcRngFloat(calcThreadRng()));
 };
 
 
+void randomTaskBatch(calc_task_batch_t *tasks, size_t n){
+  calcRngTaskBatch(calcThreadRng(), tasks, n);
+}
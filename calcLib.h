@@ -20,12 +20,113 @@ Implementation in calcLib.c
 */
   
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+  /* The operators, in the same order as the names returned by randomType(), so 
+     randomType() and calcOps[randomOp()].name always agree. Integer operators come first, 
+     CALC_FIRST_FLOAT and up take doubles. */
+  typedef enum {
+    CALC_ADD, CALC_DIV, CALC_MUL, CALC_SUB,
+    CALC_FADD, CALC_FDIV, CALC_FMUL, CALC_FSUB,
+    CALC_OP_COUNT,
+    CALC_FIRST_FLOAT = CALC_FADD
+  } calc_op_t;
+
+  /* An operand or result; i for the integer operators, f for the float ones. */
+  typedef union {
+    int i;
+    double f;
+  } calc_value_t;
+
+  /* Everything needed to print, parse and evaluate one operator. */
+  typedef struct {
+    char name[5];           // Wire name, NUL padded so it can be compared as 4 bytes
+    unsigned char length;   // strlen(name)
+    unsigned char arity;    // Number of operands
+    unsigned char is_float; // Operands and result use calc_value_t.f
+    calc_value_t (*compute)(calc_value_t a, calc_value_t b); // Reference result
+  } calc_op_info_t;
+
+  extern const calc_op_info_t calcOps[CALC_OP_COUNT]; // Indexed by calc_op_t
+
+  /* State of a xoshiro256** generator. Not shared: keep one per thread or per session. */
+  typedef struct {
+    uint64_t s[4];
+  } calc_rng_t;
+
+  void calcRngSeed(calc_rng_t *rng, uint64_t seed); // Expand <seed> into a full state
+  void calcRngJump(calc_rng_t *rng); // Advance by 2^128 draws, to split off an independent stream
+  void calcRngStream(calc_rng_t *rng, unsigned int stream); // Stream <stream> of the seed set by initCalcLib*()
+  uint64_t calcRngNext(calc_rng_t *rng); // 64 random bits
+  uint32_t calcRngBounded(calc_rng_t *rng, uint32_t bound); // Unbiased integer in [0, bound)
+  calc_op_t calcRngOp(calc_rng_t *rng); // The draws behind randomOp(), randomInt() and randomFloat()
+  int calcRngInt(calc_rng_t *rng);
+  double calcRngFloat(calc_rng_t *rng);
+  calc_rng_t *calcThreadRng(void); // Generator of the calling thread, used by the random*() functions; an implicit stream, apart from every initCalcLib_stream() one, if the thread never chose one
+
+  /* A batch of tasks as a struct of arrays: operators, operands and the reference results, 
+     ready to be sent and checked without computing anything per task. */
+  #define CALC_BATCH_SIZE 64
+  typedef struct {
+    calc_op_t op[CALC_BATCH_SIZE];
+    calc_value_t a[CALC_BATCH_SIZE];
+    calc_value_t b[CALC_BATCH_SIZE];
+    calc_value_t expected[CALC_BATCH_SIZE];
+  } calc_task_batch_t;
+
+  void calcRngTaskBatch(calc_rng_t *rng, calc_task_batch_t *tasks, size_t n); // Fill the first <n> (<= CALC_BATCH_SIZE) tasks
+
+  /* Batch kernels, vectorized where the CPU allows (implementation in calcBatch.c). Integer 
+     results wrap around: add, sub and mul modulo 2^32, INT_MIN / -1 is INT_MIN, x / 0 is 0. */
+  void calcComputeBatch(calc_task_batch_t *tasks, size_t n); // Fill expected[] of the first <n> tasks
+  size_t calcCheckBatch(const calc_op_t *op, const calc_value_t *expected, const calc_value_t *result, 
+                        unsigned char *correct, size_t n, double tolerance); // Set correct[i] for <n> results, return how many are
+  const char *calcSimdName(void); // Kernels in use: "scalar", "sse2" or "avx2"
+  int calcIntAdd(int a, int b);
+  int calcIntSub(int a, int b);
+  int calcIntMul(int a, int b);
+  int calcIntDiv(int a, int b);
+
   int initCalcLib(void); // Init internal variables to the library, if needed. 
   int initCalcLib_seed(unsigned int seed); // Init internal variables to the library, use <seed> for specific variable. 
+  int initCalcLib_stream(unsigned int stream); // Give the calling thread its own stream <stream> of the seed, 0 is the main one
 
   char* randomType(void); // Return a string to an mathematical operator
-  int randomInt(void);// Return a random integer, between 0 and 100. 
+  calc_op_t randomOp(void); // Return a random operator, drawn like randomType()
+  int randomInt(void);// Return a random integer, between 0 and 99. 
   double randomFloat(void);// Return a random float between 0.0 and 100.0
+  void randomTaskBatch(calc_task_batch_t *tasks, size_t n); // <n> random tasks, drawn like randomOp() and two random*() calls each
+
+  /* Operator with the wire name name[0..length), or CALC_OP_COUNT if there is none. 
+     The last three characters pick the only candidate ("add" and "fadd" differ in length), 
+     a single compare then confirms it. */
+  static inline calc_op_t calcOpLookup(const char *name, size_t length){
+    // Index by the bits that set 'a', 'd', 'm' and 's' apart: 1, 4, 13 and 19
+    static const signed char candidate[32]={
+      -1, CALC_ADD, -1, -1, CALC_DIV, -1, -1, -1, -1, -1, -1, -1, -1, CALC_MUL, -1, -1,
+      -1, -1, -1, CALC_SUB, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+    };
+    if (length < 3 || length > 4){
+      return CALC_OP_COUNT;
+    }
+    int op=candidate[name[length-3] & 31];
+    if (op < 0){
+      return CALC_OP_COUNT;
+    }
+    if (length == 4){
+      op+=CALC_FIRST_FLOAT;
+    }
+    if (memcmp(name, calcOps[op].name, length) != 0){
+      return CALC_OP_COUNT;
+    }
+    return (calc_op_t)op;
+  }
+
+  static inline int calcOpIsFloat(calc_op_t op){
+    return op >= CALC_FIRST_FLOAT;
+  }
 
 
 #endif
@@ -1,188 +1,691 @@
 #include <iostream>
+#include <string>
 #include <cstring>
 #include <cstdlib>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+#include <cstdio>
 #include <cerrno>
+#include <ctime>
 #include <netdb.h>
 #include <unistd.h>
-#include <calcLib.h> // Includes the calculation library
-
-#define SA struct sockaddr
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "calcClient.h" // Session logic, on top of the calculation library
+#include "histogram.h"
 
-// Uncomment the following line to enable debug mode
-//#define DEBUG
+#define LOAD_TIMEOUT_MS 10000    // Load generator gives up on a phase after 10 s
+#define UDP_TIMEOUT_MS 1000      // TEXT UDP 1.0: wait this long for an answer before sending again
+#define UDP_ATTEMPTS 3           // TEXT UDP 1.0: sends of a message before giving up
+#define UDP_LOSS_TIMEOUT_MS 200  // UDP load generator: exchanges unanswered this long are lost
 
 using namespace std;
+using calcclient::Assignment;
+using calcclient::Executor;
+using calcclient::Protocol;
+using calcclient::Session;
+using calcclient::Status;
+using calcclient::Task;
+using calcclient::solve_udp_task;
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        cout << "Usage: " << argv[0] << " <host:port>" << endl;
-        return -1;
+struct client_options {
+    unsigned task_count;         // 0 speaks TEXT TCP 1.0, anything else TEXT TCP 1.1
+    unsigned window;             // 0 for lockstep, anything else pipelines up to window tasks
+    bool binary;                 // Speak BINARY TCP 1.0
+    bool shm;                    // Ask for the shared-memory transport
+};
+
+/**
+ * Tell why a step failed: the server's error line if it sent one, the status otherwise.
+ */
+static void report(const Session &session, Status status, const char *step) {
+    if (session.error_length() > 0) {
+        cout << "Server Response: " << string(session.error(), session.error_length()) << endl;
+    } else {
+        cerr << step << ": " << calcclient::status_text(status) << endl;
     }
+}
 
-    // Parse host and port from input
-    char *host_port_str = strdup(argv[1]);
-    char *separator = strrchr(host_port_str, ':');
-    if (!separator) {
-        cout << "Error: Please use the format <host:port>." << endl;
-        free(host_port_str);
-        return -1;
+/**
+ * TEXT TCP 1.0: solve one task.
+ */
+static Task<int> run_single_task(Session &session) {
+    Assignment task;
+    Status status = co_await session.request(Protocol::TEXT_1_0);
+    if (status == Status::OK) {
+        status = co_await session.next_task(task);
+    }
+    if (status == Status::OK) {
+        status = co_await session.answer(task);
+    }
+    if (status != Status::OK) {
+        report(session, status, "Error solving the assignment");
+        co_return -1;
     }
 
-    *separator = '\0';
-    char *server_hostname = host_port_str;
-    int server_port = atoi(separator + 1);
+    cout << "Server Response: " << string(task.verdict, task.verdict_length) << endl;
+    cout << "Test Completed Successfully." << endl;
+    co_return 0;
+}
 
-    cout << "Connecting to Host: " << server_hostname << ", Port: " << server_port << "." << endl;
+/**
+ * TEXT TCP 1.1: solve up to task_count tasks on one connection, then quit.
+ */
+static Task<int> run_persistent_session(Session &session, unsigned task_count) {
+    Assignment task;
+    unsigned tasks_done = 0;
 
-    // Set up server address hints
-    struct addrinfo hints{}, *server_address_info;
-    hints.ai_family = AF_UNSPEC;     // Support both IPv4 and IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP connection
+    Status status = co_await session.request(Protocol::TEXT_1_1);
+    if (status != Status::OK) {
+        report(session, status, "Error sending protocol request");
+        co_return -1;
+    }
 
-    // Resolve the server address
-    int addr_status = getaddrinfo(server_hostname, separator + 1, &hints, &server_address_info);
-    if (addr_status != 0) {
-        cerr << "Address resolution error: " << gai_strerror(addr_status) << endl;
-        free(host_port_str);
-        return -1;
+    while (tasks_done < task_count) {
+        status = co_await session.next_task(task);
+        if (status == Status::CLOSED) {
+            if (tasks_done == 0) {
+                cout << "Server does not support TEXT TCP 1.1." << endl;
+                co_return -1;
+            }
+            break; // Server reached its task limit
+        }
+        if (status == Status::OK) {
+            status = co_await session.answer(task);
+        }
+        if (status != Status::OK) {
+            report(session, status, "Error solving the assignment");
+            co_return -1;
+        }
+        tasks_done++;
+
+        cout << "Task " << tasks_done << ": " << string(task.line, task.line_length - 1) << " = "
+             << string(task.result, task.result_length - 1) << ", Server Response: "
+             << string(task.verdict, task.verdict_length);
     }
 
-    // Create a socket
-    int socket_descriptor = socket(server_address_info->ai_family, server_address_info->ai_socktype, server_address_info->ai_protocol);
-    if (socket_descriptor < 0) {
-        #ifdef DEBUG
-        cerr << "Socket creation failed: " << strerror(errno) << endl;
-        #endif
-        freeaddrinfo(server_address_info);
-        free(host_port_str);
-        return -1;
+    if (tasks_done == task_count) {
+        co_await session.quit();
     }
+    cout << "Completed " << tasks_done << " tasks on one connection." << endl;
+    co_return 0;
+}
 
-    // Connect to the server
-    if (connect(socket_descriptor, server_address_info->ai_addr, server_address_info->ai_addrlen) < 0) {
-        #ifdef DEBUG
-        cerr << "Connection failed: " << strerror(errno) << endl;
-        #endif
-        freeaddrinfo(server_address_info);
-        close(socket_descriptor);
-        free(host_port_str);
-        return -1;
+/**
+ * Pipelined TEXT TCP 1.1 or BINARY TCP 1.0: the server keeps up to window tasks outstanding
+ * (one for a lockstep binary session), and the results go back as they are solved.
+ */
+static Task<int> run_windowed_session(Session &session, Protocol protocol, unsigned task_count, unsigned window) {
+    unsigned verdicts = 0, correct = 0;
+
+    Status status = co_await session.request(protocol, window);
+    if (status == Status::OK) {
+        status = co_await session.run_window(task_count, &verdicts, &correct);
+    }
+    if (status == Status::CLOSED && verdicts == 0) {
+        if (protocol == Protocol::BINARY) {
+            cout << "Server closed the session or does not support " << BINARY_REQUEST << "." << endl;
+        } else {
+            cout << "Server closed the session or does not support pipelining." << endl;
+        }
+        co_return -1;
+    }
+    if (status != Status::OK && status != Status::CLOSED) { // Closed after verdicts: the task limit
+        report(session, status, "Error running the session");
+        co_return -1;
     }
 
-    // Clean up
-    freeaddrinfo(server_address_info);
-    free(host_port_str);
+    if (verdicts == task_count) {
+        co_await session.quit();
+    }
+    cout << "Completed " << verdicts << (protocol == Protocol::BINARY ? " binary" : " pipelined")
+         << " tasks, " << correct << " correct." << endl;
+    co_return 0;
+}
 
-    char server_response_buffer[2000]; // Buffer for server responses
-    memset(server_response_buffer, 0, sizeof(server_response_buffer));
+/**
+ * One session with the server, as picked by the command line.
+ */
+static Task<void> run_client(Executor &executor, const struct addrinfo *server, client_options options, int *rv) {
+    Session session(executor, 0); // Wait for the server as long as it takes
 
-    // Receive initial response from the server
-    int received_bytes = recv(socket_descriptor, server_response_buffer, sizeof(server_response_buffer) - 1, 0);
-    if (received_bytes < 0) {
-        #ifdef DEBUG
-        cerr << "Error receiving initial response: " << strerror(errno) << endl;
-        #endif
-        close(socket_descriptor);
-        return -1;
+    Status status = co_await session.connect(server);
+    if (status != Status::OK) {
+        report(session, status, "Connection failed");
+        *rv = -1;
+        co_return;
     }
 
-    if (received_bytes > 100) {
+    // The greeting ends with an empty line
+    status = co_await session.greet();
+    if (session.greeting_length() > 100) {
         cout << "Error: Received unexpected or excessive data. Closing connection." << endl;
-        close(socket_descriptor);
-        return 0;
-    }
-
-    // Check for expected protocol
-    if (strstr(server_response_buffer, "TEXT TCP 1.0")) {
-        char client_ok_message[] = "OK\n";
-        if (send(socket_descriptor, client_ok_message, strlen(client_ok_message), 0) < 0) {
-            #ifdef DEBUG
-            cerr << "Error sending protocol confirmation: " << strerror(errno) << endl;
-            #endif
-            close(socket_descriptor);
-            return -1;
+        *rv = 0;
+        co_return;
+    }
+    if (status == Status::ERROR || status == Status::TIMEOUT || status == Status::BUSY) {
+        report(session, status, "Error receiving initial response");
+        *rv = -1;
+        co_return;
+    }
+    if (status != Status::OK) {
+        cout << "Unexpected protocol or data received. Test failed." << endl;
+        *rv = 0;
+        co_return;
+    }
+
+    if (options.shm) {
+        bool granted;
+        status = co_await session.share_memory(&granted);
+        if (status != Status::OK) {
+            report(session, status, "Error asking for shared memory");
+            *rv = -1;
+            co_return;
+        }
+        cout << (granted ? "Using shared memory." : "Server declined shared memory, staying on the socket.") << endl;
+    }
+
+    if (options.binary) {
+        *rv = co_await run_windowed_session(session, Protocol::BINARY, options.task_count, options.window);
+    } else if (options.task_count > 0 && options.window > 0) {
+        *rv = co_await run_windowed_session(session, Protocol::TEXT_1_1, options.task_count, options.window);
+    } else if (options.task_count > 0) {
+        *rv = co_await run_persistent_session(session, options.task_count);
+    } else {
+        *rv = co_await run_single_task(session);
+    }
+}
+
+/**
+ * Latency phases of a load generator session.
+ */
+enum load_phase {
+    PHASE_CONNECT,  // connect() until the connection is established
+    PHASE_GREETING, // Established until the server's greeting is complete (and shared memory set up)
+    PHASE_TASK,     // Protocol reply or previous verdict until the next task
+    PHASE_VERDICT,  // Result sent until its verdict
+    PHASE_COUNT
+};
+
+static const char *const phase_names[PHASE_COUNT] = {"connect", "greeting", "task", "verdict"};
+
+struct load_config {
+    const struct addrinfo *server;
+    unsigned connections;
+    double duration;             // Seconds
+    double rate;                 // Tasks started per second in total, 0 for no limit
+    unsigned tasks_per_session;
+    Protocol protocol;           // Lockstep only
+    bool udp;                    // TEXT UDP 1.0, connections is then the number of exchanges in flight
+    bool shm;                    // Sessions ask for the shared-memory transport
+};
+
+struct load_generator {
+    const struct load_config *config;
+    Executor *executor;
+    long long end;
+    long long next_slot;         // Next free start time under --rate
+    long long interval;          // Time between two starts under --rate (ns)
+
+    struct histogram latency[PHASE_COUNT];
+    uint64_t tasks, incorrect, sessions, errors, timeouts_seen;
+    uint64_t busy;               // Connections the server turned away with "ERROR BUSY"
+};
+
+/**
+ * Wait for the next start slot under --rate. Waiting is not the server's time, so callers
+ * start their phase clock after this.
+ */
+static Task<void> load_pace(struct load_generator *g) {
+    if (g->interval == 0) {
+        co_return;
+    }
+    long long now = g->executor->now_ns();
+    long long slot = g->next_slot > now - g->interval ? g->next_slot : now - g->interval;
+    g->next_slot = slot + g->interval;
+    co_await g->executor->sleep_until(slot);
+}
+
+/**
+ * Time from phase_start to now into the phase's histogram, and restart the clock.
+ */
+static void load_record(struct load_generator *g, enum load_phase phase, long long *phase_start) {
+    long long now = g->executor->now_ns();
+    histogram_record(&g->latency[phase], (uint64_t)(now - *phase_start));
+    *phase_start = now;
+}
+
+/**
+ * One of the concurrent sessions of the load generator. It reconnects as soon as a session
+ * ends, so the number of sessions in flight stays at --connections.
+ */
+static Task<void> load_connection(struct load_generator *g) {
+    const struct load_config *config = g->config;
+    Executor &executor = *g->executor;
+
+    while (executor.now_ns() < g->end) {
+        if (config->protocol == Protocol::TEXT_1_0) {
+            co_await load_pace(g); // A TEXT TCP 1.0 task starts with its connection
+        }
+
+        Session session(executor, LOAD_TIMEOUT_MS);
+        Assignment task;
+        long long phase_start = executor.now_ns();
+        Status status = co_await session.connect(config->server);
+        if (status == Status::OK) {
+            load_record(g, PHASE_CONNECT, &phase_start);
+            status = co_await session.greet();
+        }
+        if (status == Status::OK && config->shm) {
+            bool granted;
+            status = co_await session.share_memory(&granted);
+        }
+        if (status == Status::OK) {
+            load_record(g, PHASE_GREETING, &phase_start);
+            status = co_await session.request(config->protocol);
+        }
+
+        unsigned tasks_done = 0;
+        while (status == Status::OK) {
+            status = co_await session.next_task(task);
+            if (status != Status::OK) {
+                break;
+            }
+            load_record(g, PHASE_TASK, &phase_start);
+            if (config->protocol != Protocol::TEXT_1_0) {
+                co_await load_pace(g);
+                phase_start = executor.now_ns();
+            }
+            status = co_await session.answer(task);
+            if (status != Status::OK) {
+                break;
+            }
+            load_record(g, PHASE_VERDICT, &phase_start);
+            g->tasks++;
+            g->incorrect += !task.correct;
+
+            if (config->protocol == Protocol::TEXT_1_0 || ++tasks_done == config->tasks_per_session) {
+                co_await session.quit(); // A short message, it goes out at once
+                g->sessions++;
+                break;
+            }
         }
 
-        // Receive assignment from the server
-        memset(server_response_buffer, 0, sizeof(server_response_buffer));
-        received_bytes = recv(socket_descriptor, server_response_buffer, sizeof(server_response_buffer) - 1, 0);
-        if (received_bytes < 0) {
-            #ifdef DEBUG
-            cerr << "Error receiving assignment: " << strerror(errno) << endl;
-            #endif
-            close(socket_descriptor);
+        if (status == Status::TIMEOUT) {
+            g->timeouts_seen++;
+        } else if (status == Status::BUSY) {
+            g->busy++;
+        } else if (status != Status::OK) {
+            g->errors++; // The server never closes a lockstep session that is still going
+        }
+    }
+}
+
+static void load_print_latency(const struct load_generator *g) {
+    printf("Latency (us)        p50        p90        p99      p99.9        max      count\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        const struct histogram *h = &g->latency[phase];
+        printf("  %-10s %10.1f %10.1f %10.1f %10.1f %10.1f %10llu\n", phase_names[phase],
+               histogram_percentile(h, 50.0) / 1000.0, histogram_percentile(h, 90.0) / 1000.0,
+               histogram_percentile(h, 99.0) / 1000.0, histogram_percentile(h, 99.9) / 1000.0,
+               h->total > 0 ? h->max / 1000.0 : 0.0, (unsigned long long)h->total);
+    }
+}
+
+/**
+ * Run config->connections sessions at once against the server for config->duration seconds,
+ * then print throughput, failures and latency percentiles.
+ *
+ * @return: 0 if every session went through without an error or timeout, -1 otherwise.
+ */
+static int run_load(const struct load_config *config) {
+    static struct load_generator g; // The histograms are too large for the stack
+    Executor executor;
+
+    memset(&g, 0, sizeof(g));
+    g.config = config;
+    g.executor = &executor;
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        histogram_init(&g.latency[phase]);
+    }
+
+    long long start = executor.now_ns();
+    g.end = start + (long long)(config->duration * 1e9);
+    g.next_slot = start;
+    g.interval = config->rate > 0 ? (long long)(1e9 / config->rate) : 0;
+    for (unsigned i = 0; i < config->connections; i++) {
+        executor.spawn(load_connection(&g));
+    }
+    executor.run(g.end); // Sessions still going at the end are dropped
+
+    double elapsed = (executor.now_ns() - start) / 1e9;
+    printf("Completed %llu tasks in %.2f s: %.1f tasks/s, %llu incorrect\n", (unsigned long long)g.tasks, elapsed,
+           g.tasks / elapsed, (unsigned long long)g.incorrect);
+    printf("Sessions: %llu completed, %llu errors, %llu timeouts, %llu turned away busy\n", (unsigned long long)g.sessions,
+           (unsigned long long)g.errors, (unsigned long long)g.timeouts_seen, (unsigned long long)g.busy);
+    load_print_latency(&g);
+    return g.errors == 0 && g.timeouts_seen == 0 && g.busy == 0 ? 0 : -1;
+}
+
+static long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * A UDP socket connected to the server, with receives timing out after timeout_ms.
+ *
+ * @return: The socket, or -1 on failure.
+ */
+static int udp_connect(const struct addrinfo *server, int timeout_ms) {
+    int fd = socket(server->ai_family, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+        || connect(fd, server->ai_addr, server->ai_addrlen) == -1) {
+        perror("Connection failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Send a message and wait for its answer, sending again after every UDP_TIMEOUT_MS without
+ * one. With a token, only an answer starting with it counts (older answers are skipped).
+ *
+ * @return: Length of the answer, -1 if none came.
+ */
+static ssize_t udp_exchange(int fd, const char *message, size_t length, const char *token, char *answer) {
+    for (int attempt = 0; attempt < UDP_ATTEMPTS; attempt++) {
+        if (send(fd, message, length, 0) == -1) {
+            return -1; // Refused: nothing listens on the port
+        }
+        while (1) {
+            ssize_t received = recv(fd, answer, UDP_MAX_DATAGRAM, 0);
+            if (received == -1) {
+                break; // Timed out: send again
+            }
+            if (token == NULL || (received > UDP_TOKEN_LENGTH && memcmp(answer, token, UDP_TOKEN_LENGTH) == 0)) {
+                return received;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * TEXT UDP 1.0: solve task_count tasks, one exchange at a time.
+ */
+static int run_udp_tasks(const struct addrinfo *server, unsigned task_count) {
+    int fd = udp_connect(server, UDP_TIMEOUT_MS);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char task[UDP_MAX_DATAGRAM], reply[UDP_MAX_DATAGRAM], verdict[UDP_MAX_DATAGRAM];
+    unsigned tasks_done = 0;
+    while (tasks_done < task_count) {
+        ssize_t task_length = udp_exchange(fd, UDP_REQUEST, strlen(UDP_REQUEST), NULL, task);
+        size_t reply_length = task_length > 0 ? solve_udp_task(task, task_length, reply) : 0;
+        ssize_t verdict_length = reply_length > 0 ? udp_exchange(fd, reply, reply_length, task, verdict) : -1;
+        if (verdict_length == -1) {
+            cout << "No answer from the server over UDP." << endl;
+            close(fd);
             return -1;
         }
+        tasks_done++;
 
-        int operand1, operand2, integer_result = 0;
-        double double_operand1, double_operand2, double_result = 0.0;
-        char operation_type[10];
+        const char *text = task + UDP_TOKEN_LENGTH + 1;
+        size_t text_length = task_length - UDP_TOKEN_LENGTH - 2;
+        cout << "Task " << tasks_done << ": " << string(text, text_length) << " = "
+             << string(reply + task_length, reply_length - task_length - 1) << ", Server Response: "
+             << string(verdict + UDP_TOKEN_LENGTH + 1, verdict_length - UDP_TOKEN_LENGTH - 1);
+    }
 
-        // Parse the received assignment
-        sscanf(server_response_buffer, "%s %lf %lf", operation_type, &double_operand1, &double_operand2);
+    cout << "Completed " << tasks_done << " tasks over UDP." << endl;
+    close(fd);
+    return 0;
+}
 
-        // Perform the operation
-        if (strcmp(operation_type, "fadd") == 0) {
-            double_result = double_operand1 + double_operand2;
-        } else if (strcmp(operation_type, "fsub") == 0) {
-            double_result = double_operand1 - double_operand2;
-        } else if (strcmp(operation_type, "fmul") == 0) {
-            double_result = double_operand1 * double_operand2;
-        } else if (strcmp(operation_type, "fdiv") == 0) {
-            double_result = double_operand1 / double_operand2;
-        } else {
-            operand1 = (int)double_operand1;
-            operand2 = (int)double_operand2;
-
-            if (strcmp(operation_type, "add") == 0) {
-                integer_result = operand1 + operand2;
-            } else if (strcmp(operation_type, "sub") == 0) {
-                integer_result = operand1 - operand2;
-            } else if (strcmp(operation_type, "mul") == 0) {
-                integer_result = operand1 * operand2;
-            } else if (strcmp(operation_type, "div") == 0) {
-                integer_result = operand1 / operand2;
+/**
+ * UDP version of run_load(): keep config->connections exchanges in flight on one socket,
+ * sending and receiving in batches. An exchange starts with a request and ends with its
+ * verdict; whenever nothing arrives for UDP_LOSS_TIMEOUT_MS the exchanges in flight count
+ * as lost and are started again.
+ *
+ * @return: 0 if nothing was lost or timed out, -1 otherwise.
+ */
+static int run_udp_load(const struct load_config *config) {
+    int fd = udp_connect(config->server, UDP_LOSS_TIMEOUT_MS);
+    if (fd == -1) {
+        return -1;
+    }
+
+    static char in_data[UDP_BATCH_SIZE][UDP_MAX_DATAGRAM], out_data[UDP_BATCH_SIZE][UDP_MAX_DATAGRAM];
+    struct mmsghdr in[UDP_BATCH_SIZE], out[UDP_BATCH_SIZE];
+    struct iovec in_iov[UDP_BATCH_SIZE], out_iov[UDP_BATCH_SIZE];
+    memset(in, 0, sizeof(in));
+    memset(out, 0, sizeof(out));
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+        in_iov[i] = {in_data[i], UDP_MAX_DATAGRAM};
+        in[i].msg_hdr.msg_iov = &in_iov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        out_iov[i].iov_base = out_data[i];
+        out[i].msg_hdr.msg_iov = &out_iov[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t tasks = 0, incorrect = 0, lost = 0, timeouts_seen = 0;
+    unsigned in_flight = 0;
+    unsigned out_count = 0;
+    long long start = monotonic_ns();
+    long long end = start + (long long)(config->duration * 1e9);
+
+    // Queue a message; a full batch goes out at once
+    auto queue = [&](const char *message, size_t length) {
+        memcpy(out_data[out_count], message, length);
+        out_iov[out_count].iov_len = length;
+        if (++out_count == UDP_BATCH_SIZE) {
+            sendmmsg(fd, out, out_count, 0);
+            out_count = 0;
+        }
+    };
+
+    while (monotonic_ns() < end) {
+        while (in_flight < config->connections) {
+            queue(UDP_REQUEST, strlen(UDP_REQUEST));
+            in_flight++;
+        }
+        if (out_count > 0) {
+            sendmmsg(fd, out, out_count, 0);
+            out_count = 0;
+        }
+
+        int count = recvmmsg(fd, in, UDP_BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (count == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                lost += in_flight; // Nothing for UDP_LOSS_TIMEOUT_MS: start over
+                in_flight = 0;
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recvmmsg failed");
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const char *data = in_data[i];
+            size_t length = in[i].msg_len;
+            if (length <= UDP_TOKEN_LENGTH + 1) {
+                continue;
+            }
+            const char *rest = data + UDP_TOKEN_LENGTH + 1;
+            size_t rest_length = length - UDP_TOKEN_LENGTH - 1;
+            if (rest_length == 3 && memcmp(rest, "OK\n", 3) == 0) {
+                tasks++;
+            } else if (rest_length == 6 && memcmp(rest, "ERROR\n", 6) == 0) {
+                tasks++;
+                incorrect++;
+            } else if (rest_length == 9 && memcmp(rest, "ERROR TO\n", 9) == 0) {
+                timeouts_seen++;
+            } else {
+                char reply[UDP_MAX_DATAGRAM];
+                size_t reply_length = solve_udp_task(data, length, reply);
+                if (reply_length > 0) {
+                    queue(reply, reply_length);
+                }
+                continue; // The exchange goes on
+            }
+            if (in_flight > 0) {
+                in_flight--; // Verdict: the exchange is done
             }
         }
+    }
+    close(fd);
+
+    double elapsed = (monotonic_ns() - start) / 1e9;
+    printf("Completed %llu tasks in %.2f s: %.1f tasks/s, %llu incorrect\n", (unsigned long long)tasks, elapsed,
+           tasks / elapsed, (unsigned long long)incorrect);
+    printf("Exchanges: %llu lost, %llu timeouts\n", (unsigned long long)lost, (unsigned long long)timeouts_seen);
+    return lost == 0 && timeouts_seen == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned task_count = 0; // 0 speaks TEXT TCP 1.0, anything else TEXT TCP 1.1
+    unsigned window = 0;     // 0 for lockstep, anything else pipelines up to window tasks
+    bool binary = false;     // Speak BINARY TCP 1.0
+    bool udp = false;        // Speak TEXT UDP 1.0
+    bool shm = false;        // Ask for the shared-memory transport
+    unsigned connections = 0; // Above 0 runs the load generator with that many sessions at once
+    double duration = 10.0;  // Load generator run time in seconds
+    double rate = 0.0;       // Load generator tasks per second, 0 for no limit
+    const char *address = NULL;
 
-        char result_message[50];
-        if (operation_type[0] == 'f') {
-            sprintf(result_message, "%8.8g\n", double_result);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tasks") == 0 && i + 1 < argc) {
+            task_count = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            window = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            binary = true;
+        } else if (strcmp(argv[i], "--udp") == 0) {
+            udp = true;
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            shm = true;
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connections = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = strtod(argv[++i], NULL);
+        } else if (address == NULL && argv[i][0] != '-') {
+            address = argv[i];
         } else {
-            sprintf(result_message, "%d\n", integer_result);
+            address = NULL;
+            break;
         }
+    }
+    bool local = address != NULL && strncmp(address, "unix:", 5) == 0;
+    if (address == NULL || duration <= 0 || rate < 0 || (connections > 0 && window > 0)
+        || (udp && (binary || window > 0 || rate > 0 || local)) || (shm && !local)) {
+        cout << "Usage: " << argv[0] << " <host:port | unix:path> [--tasks N] [--window W] [--binary] [--shm]" << endl;
+        cout << "       " << argv[0] << " <host:port> --connections C [--duration S] [--rate R] [--tasks N] [--binary]" << endl;
+        cout << "       " << argv[0] << " <host:port> --udp [--tasks N | --connections C [--duration S]]" << endl;
+        cout << "  --tasks N        Solve N tasks on one TEXT TCP 1.1 connection" << endl;
+        cout << "  --window W       Pipeline up to W outstanding tasks (needs --tasks or --binary)" << endl;
+        cout << "  --binary         Speak BINARY TCP 1.0 instead of text" << endl;
+        cout << "  --connections C  Generate load: keep C lockstep sessions running, reconnecting as each ends" << endl;
+        cout << "  --duration S     Generate load for S seconds (default 10)" << endl;
+        cout << "  --rate R         Start at most R tasks per second in total (default no limit)" << endl;
+        cout << "  --udp            Speak TEXT UDP 1.0; with --connections, keep C exchanges in flight" << endl;
+        cout << "  --shm            Move each session to shared memory after the greeting (unix:path only)" << endl;
+        return -1;
+    }
+    if (binary && task_count == 0) {
+        task_count = 1;
+    }
 
-        // Send the result back to the server
-        if (send(socket_descriptor, result_message, strlen(result_message), 0) < 0) {
-            #ifdef DEBUG
-            cerr << "Error sending the result: " << strerror(errno) << endl;
-            #endif
-            close(socket_descriptor);
+    char *host_port_str = NULL;
+    struct addrinfo *server_address_info = NULL;
+    struct sockaddr_un unix_address{};
+    struct addrinfo unix_info{};
+    if (local) {
+        // A Unix socket needs no resolving
+        const char *path = address + 5;
+        if (strlen(path) >= sizeof(unix_address.sun_path)) {
+            cout << "Error: Socket path too long." << endl;
             return -1;
         }
+        unix_address.sun_family = AF_UNIX;
+        strcpy(unix_address.sun_path, path);
+        unix_info.ai_family = AF_UNIX;
+        unix_info.ai_socktype = SOCK_STREAM;
+        unix_info.ai_addr = (struct sockaddr*)&unix_address;
+        unix_info.ai_addrlen = sizeof(unix_address);
+        server_address_info = &unix_info;
 
-        // Receive final server response
-        memset(server_response_buffer, 0, sizeof(server_response_buffer));
-        received_bytes = recv(socket_descriptor, server_response_buffer, sizeof(server_response_buffer) - 1, 0);
-        if (received_bytes < 0) {
-            #ifdef DEBUG
-            cerr << "Error receiving final server response: " << strerror(errno) << endl;
-            #endif
-            close(socket_descriptor);
+        cout << "Connecting to Socket: " << path << "." << endl;
+    } else {
+        // Parse host and port from input
+        host_port_str = strdup(address);
+        char *separator = strrchr(host_port_str, ':');
+        if (!separator) {
+            cout << "Error: Please use the format <host:port>." << endl;
+            free(host_port_str);
             return -1;
         }
 
-        cout << "Server Response: " << server_response_buffer << endl;
-        cout << "Test Completed Successfully." << endl;
+        *separator = '\0';
+        char *server_hostname = host_port_str;
+        int server_port = atoi(separator + 1);
+
+        cout << "Connecting to Host: " << server_hostname << ", Port: " << server_port << "." << endl;
+
+        // Set up server address hints
+        struct addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;     // Support both IPv4 and IPv6
+        hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+
+        // Resolve the server address
+        int addr_status = getaddrinfo(server_hostname, separator + 1, &hints, &server_address_info);
+        if (addr_status != 0) {
+            cerr << "Address resolution error: " << gai_strerror(addr_status) << endl;
+            free(host_port_str);
+            return -1;
+        }
+    }
+
+    int rv;
+    if (udp && connections == 0) {
+        rv = run_udp_tasks(server_address_info, task_count > 0 ? task_count : 1);
+    } else if (connections > 0) {
+        struct load_config load;
+        load.server = server_address_info;
+        load.connections = connections;
+        load.duration = duration;
+        load.rate = rate;
+        load.tasks_per_session = task_count;
+        load.protocol = binary ? Protocol::BINARY : task_count > 0 ? Protocol::TEXT_1_1 : Protocol::TEXT_1_0;
+        load.udp = udp;
+        load.shm = shm;
+        rv = udp ? run_udp_load(&load) : run_load(&load);
     } else {
-        cout << "Unexpected protocol or data received. Test failed." << endl;
-        close(socket_descriptor);
-        return 0;
+        client_options options = { task_count, window, binary, shm };
+        Executor executor;
+        rv = -1;
+        executor.spawn(run_client(executor, server_address_info, options, &rv));
+        executor.run();
     }
 
-    // Close the socket before exiting
-    close(socket_descriptor);
-    return 0;
+    if (!local) {
+        freeaddrinfo(server_address_info);
+    }
+    free(host_port_str);
+    return rv;
 }
@@ -0,0 +1,119 @@
+#ifndef __HISTOGRAM
+#define __HISTOGRAM
+
+/*
+
+Latency histogram with HDR-style log-linear buckets, shared by the load generator and the
+server's metrics.
+
+Values below 2 * HISTOGRAM_SUB_BUCKETS are counted exactly. Above that, every power of two
+is split into HISTOGRAM_SUB_BUCKETS equal buckets, so a percentile read back is within
+1 / HISTOGRAM_SUB_BUCKETS (under 1%) of the true value over the whole range, while recording
+is a count-leading-zeros and an increment. Values are plain integers; callers pick the unit
+(the users here record nanoseconds).
+
+Histograms of different threads can be merged by adding their counts. histogram_record()
+stores every field atomically (relaxed, a plain store on x86), so another thread can read
+a histogram with relaxed atomic loads while its thread records into it. Each field it reads
+is at most a few values old, but the fields need not be from the same instant.
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 7     // 128 buckets per power of two
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40    // Values up to 2^40 (about 18 minutes in ns), larger ones are clamped
+#define HISTOGRAM_SIZE ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t counts[HISTOGRAM_SIZE];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+};
+
+static inline void histogram_init(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline unsigned histogram_index(uint64_t value) {
+    if (value >= (1ULL << HISTOGRAM_MAX_BITS)) {
+        value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+    }
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (unsigned)value;
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (unsigned)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/**
+ * Largest value that falls into bucket index.
+ */
+static inline uint64_t histogram_bucket_max(unsigned index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    unsigned shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t base = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((base + 1) << shift) - 1;
+}
+
+/**
+ * Record one value. Only one thread may record into a histogram.
+ */
+static inline void histogram_record(struct histogram *h, uint64_t value) {
+    uint64_t *count = &h->counts[histogram_index(value)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    double sum = h->sum + (double)value;
+    __atomic_store(&h->sum, &sum, __ATOMIC_RELAXED);
+    if (value < h->min) {
+        __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+    }
+    if (value > h->max) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void histogram_merge(struct histogram *into, const struct histogram *from) {
+    for (unsigned i = 0; i < HISTOGRAM_SIZE; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+/**
+ * Value below which percentile percent of the recorded values fall, 0 if there are none.
+ */
+static inline uint64_t histogram_percentile(const struct histogram *h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)h->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif
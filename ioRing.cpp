@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "ioRing.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+/**
+ * Queue the provision of count buffers from id on.
+ */
+static struct io_uring_sqe *provide_buffers(struct io_ring *ring, unsigned id, unsigned count) {
+    struct io_uring_sqe *sqe = io_ring_get_sqe(ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = (int)count;
+        sqe->addr = (uint64_t)(uintptr_t)io_ring_buffer(ring, id);
+        sqe->len = IO_RING_BUFFER_SIZE;
+        sqe->off = id;
+        sqe->buf_group = IO_RING_BUFFER_GROUP;
+        sqe->user_data = IO_RING_USER_DATA_BUFFERS;
+    }
+    return sqe;
+}
+
+/**
+ * Map the receive buffers and provide all of them to the kernel.
+ */
+static int setup_buffers(struct io_ring *ring) {
+    void *map = mmap(NULL, (size_t)IO_RING_BUFFERS * IO_RING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        ring->buffers = NULL;
+        return -1;
+    }
+    ring->buffers = (char*)map;
+
+    // Wait for this one, so a failure shows up here rather than as ENOBUFS later
+    if (provide_buffers(ring, 0, IO_RING_BUFFERS) == NULL || io_ring_submit_and_wait(ring, -1) == -1) {
+        return -1;
+    }
+    struct io_uring_cqe *cqe = io_ring_peek_cqe(ring);
+    int rv = cqe != NULL ? cqe->res : -EIO;
+    if (cqe != NULL) {
+        io_ring_cqe_seen(ring);
+    }
+    if (rv < 0) {
+        errno = -rv;
+        return -1;
+    }
+    return 0;
+}
+
+int io_ring_init(struct io_ring *ring) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    params.cq_entries = IO_RING_ENTRIES * 4;
+
+    // Kernels before 6.1 refuse DEFER_TASKRUN; multishot recv and accept and skipped
+    // completions are older than that
+    ring->fd = sys_io_uring_setup(IO_RING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP)
+        || !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring->sq_map_size) {
+        ring->sq_map_size = cq_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_map = ring->sq_map; // IORING_FEAT_SINGLE_MMAP: one mapping for both queues
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = (char*)ring->sq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = ring->sq_submitted = *ring->sq_tail;
+    unsigned *array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i; // Entry i of the queue is always sqes[i]
+    }
+
+    char *cq = (char*)ring->cq_map;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if (setup_buffers(ring) == -1) {
+        int saved_errno = errno;
+        io_ring_exit(ring);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+void io_ring_exit(struct io_ring *ring) {
+    if (ring->buffers != NULL) {
+        munmap(ring->buffers, (size_t)IO_RING_BUFFERS * IO_RING_BUFFER_SIZE);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/**
+ * Publish the entries filled in so far and hand them to the kernel.
+ */
+static int submit(struct io_ring *ring, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - ring->sq_submitted;
+    int rv = sys_io_uring_enter(ring->fd, to_submit, min_complete, flags, arg, arg_size);
+    if (rv > 0) {
+        ring->sq_submitted += rv;
+    }
+    return rv;
+}
+
+struct io_uring_sqe *io_ring_get_sqe(struct io_ring *ring) {
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (submit(ring, 0, 0, NULL, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter failed");
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+int io_ring_submit_and_wait(struct io_ring *ring, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    unsigned min_complete = timeout_ms == 0 ? 0 : 1;
+    if (submit(ring, min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1
+        && errno != ETIME && errno != EINTR && errno != EBUSY) {
+        return -1;
+    }
+    return 0;
+}
+
+void io_ring_recycle_buffer(struct io_ring *ring, unsigned id) {
+    struct io_uring_sqe *sqe = provide_buffers(ring, id, 1);
+    if (sqe != NULL) {
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+}
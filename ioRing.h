@@ -0,0 +1,115 @@
+#ifndef __IO_RING
+#define __IO_RING
+
+/*
+
+Minimal io_uring wrapper for the server's event loop, on the raw system calls (no liburing).
+
+The ring is set up for one thread (IORING_SETUP_SINGLE_ISSUER, DEFER_TASKRUN): submission
+queue entries are filled in with io_ring_get_sqe() and go to the kernel together with the
+next io_ring_submit_and_wait(), so a whole loop iteration costs one system call however many
+sends, receives and closes it started. Completions are read back with io_ring_peek_cqe() /
+io_ring_cqe_seen().
+
+Receives use a group of buffers provided to the kernel up front (IORING_OP_PROVIDE_BUFFERS):
+a multishot recv picks a free buffer for every chunk it completes, and the owner hands the
+buffer back with io_ring_recycle_buffer() once it has copied the data out.
+
+io_ring_init() fails on kernels without the features used here (6.1 or later), so callers
+can fall back to epoll.
+
+Implementation in ioRing.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define IO_RING_ENTRIES 4096     // Submission queue size; the completion queue is four times that
+#define IO_RING_BUFFERS 1024     // Provided receive buffers, a power of two
+#define IO_RING_BUFFER_SIZE 1024 // Bytes per provided buffer
+#define IO_RING_BUFFER_GROUP 0
+#define IO_RING_USER_DATA_BUFFERS UINT64_MAX // user_data of the ring's own entries; these only complete on failure
+
+struct io_ring {
+    int fd;
+
+    // Submission queue, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;      // Entries filled in so far
+    unsigned sq_submitted;       // Entries handed to the kernel so far
+
+    // Completion queue, shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided receive buffers
+    char *buffers;
+
+    // Mappings, for io_ring_exit()
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+/**
+ * Set up a ring and its provided buffers.
+ *
+ * @return: 0 on success, -1 if io_uring or one of the features used is not available
+ *          (errno tells why).
+ */
+int io_ring_init(struct io_ring *ring);
+
+void io_ring_exit(struct io_ring *ring);
+
+/**
+ * A cleared submission queue entry to fill in. Submits what is queued first if the queue
+ * is full.
+ */
+struct io_uring_sqe *io_ring_get_sqe(struct io_ring *ring);
+
+/**
+ * Submit the queued entries and wait for at least one completion, or until timeout_ms
+ * passes (-1 to wait without a timeout, 0 not to wait).
+ *
+ * @return: 0 on success or timeout, -1 on failure.
+ */
+int io_ring_submit_and_wait(struct io_ring *ring, int timeout_ms);
+
+/**
+ * Next completion, or NULL if there is none. Release it with io_ring_cqe_seen().
+ */
+static inline struct io_uring_cqe *io_ring_peek_cqe(struct io_ring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void io_ring_cqe_seen(struct io_ring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Start of provided buffer id.
+ */
+static inline char *io_ring_buffer(struct io_ring *ring, unsigned id) {
+    return ring->buffers + (size_t)id * IO_RING_BUFFER_SIZE;
+}
+
+/**
+ * Give provided buffer id back to the kernel, with the next submission.
+ */
+void io_ring_recycle_buffer(struct io_ring *ring, unsigned id);
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef __LINE_FRAMER
+#define __LINE_FRAMER
+
+/*
+
+Incremental framer for the byte stream of one connection, shared by the server and the client.
+
+TCP delivers a byte stream, not messages: one recv() may return half a line, or a verdict and
+the next task together. The framer keeps received bytes in a fixed ring buffer supplied by its
+owner, and hands them out again as complete lines (text protocols) or fixed-size records
+(binary_frame). Lines are returned as views into the ring, so nothing is copied or allocated;
+the rare line that wraps around the end of the ring is made contiguous in place. An owner
+that starts with a small ring can move the framer to a larger one when it fills up.
+
+The parse_* and format_* helpers convert numbers with std::from_chars/std::to_chars, which
+neither allocate nor look at the locale, and produce the same text as the %d and %8.8g
+printf formats used on the wire.
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <charconv>
+
+struct line_framer {
+    char *buffer;
+    uint32_t mask;               // Capacity - 1, the capacity is a power of two
+    uint32_t head;               // Free-running index of the first unread byte
+    uint32_t tail;               // Free-running index one past the last received byte
+    uint32_t scanned;            // No newline between head and this index
+};
+
+/**
+ * Set up a framer over storage. capacity must be a power of two.
+ */
+static inline void framer_init(struct line_framer *f, char *storage, size_t capacity) {
+    f->buffer = storage;
+    f->mask = (uint32_t)capacity - 1;
+    f->head = f->tail = f->scanned = 0;
+}
+
+/**
+ * Move the unread bytes of the framer to other storage, which becomes its ring. capacity
+ * must be a power of two and at least framer_length().
+ */
+static inline void framer_move(struct line_framer *f, char *storage, size_t capacity) {
+    size_t length = f->tail - f->head;
+    size_t offset = f->head & f->mask;
+    size_t to_end = (size_t)f->mask + 1 - offset;
+    size_t first = length < to_end ? length : to_end;
+    memcpy(storage, f->buffer + offset, first);
+    memcpy(storage + first, f->buffer, length - first);
+    f->scanned -= f->head;
+    f->head = 0;
+    f->tail = (uint32_t)length;
+    f->buffer = storage;
+    f->mask = (uint32_t)capacity - 1;
+}
+
+static inline size_t framer_length(const struct line_framer *f) {
+    return f->tail - f->head;
+}
+
+static inline size_t framer_space(const struct line_framer *f) {
+    return (size_t)f->mask + 1 - framer_length(f);
+}
+
+/**
+ * Contiguous free space to recv() into. It may be shorter than framer_space() where the
+ * ring wraps; the next call returns the rest.
+ *
+ * @param length: Receives the size of the free region.
+ * @return: Start of the free region.
+ */
+static inline char *framer_write_ptr(struct line_framer *f, size_t *length) {
+    if (f->head == f->tail) {
+        f->head = f->tail = f->scanned = 0; // Empty, start over for the largest region
+    }
+    size_t offset = f->tail & f->mask;
+    size_t to_end = (size_t)f->mask + 1 - offset;
+    size_t space = framer_space(f);
+    *length = space < to_end ? space : to_end;
+    return f->buffer + offset;
+}
+
+/**
+ * Account for length bytes written at framer_write_ptr().
+ */
+static inline void framer_commit(struct line_framer *f, size_t length) {
+    f->tail += (uint32_t)length;
+}
+
+/**
+ * Take the next complete line off the framer.
+ *
+ * @param line: Receives the start of the line, valid until the next call on the framer.
+ * @param length: Receives the length of the line, including the newline.
+ * @return: true if a line was available.
+ */
+static inline bool framer_next_line(struct line_framer *f, const char **line, size_t *length) {
+    while (f->scanned != f->tail) {
+        size_t offset = f->scanned & f->mask;
+        size_t to_end = (size_t)f->mask + 1 - offset;
+        size_t pending = f->tail - f->scanned;
+        size_t count = pending < to_end ? pending : to_end;
+
+        const char *newline = (const char*)memchr(f->buffer + offset, '\n', count);
+        if (newline == NULL) {
+            f->scanned += (uint32_t)count;
+            continue;
+        }
+
+        uint32_t end = f->scanned + (uint32_t)(newline - (f->buffer + offset)) + 1;
+        if ((f->head & f->mask) > ((end - 1) & f->mask)) {
+            // The line wraps: rotate the ring so the unread bytes start at offset 0
+            std::rotate(f->buffer, f->buffer + (f->head & f->mask), f->buffer + f->mask + 1);
+            end -= f->head;
+            f->tail -= f->head;
+            f->head = 0;
+        }
+
+        *line = f->buffer + (f->head & f->mask);
+        *length = end - f->head;
+        f->head = f->scanned = end;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Take every unread byte off the framer as one view, whether it ends in a newline or not.
+ *
+ * @param data: Receives the start of the bytes, valid until the next call on the framer.
+ * @param length: Receives their number.
+ * @return: true if any bytes were unread.
+ */
+static inline bool framer_take_rest(struct line_framer *f, const char **data, size_t *length) {
+    if (f->head == f->tail) {
+        return false;
+    }
+    if ((f->head & f->mask) + (f->tail - f->head) > f->mask + 1) {
+        // The bytes wrap: rotate the ring so they start at offset 0
+        std::rotate(f->buffer, f->buffer + (f->head & f->mask), f->buffer + f->mask + 1);
+        f->tail -= f->head;
+        f->head = 0;
+    }
+    *data = f->buffer + (f->head & f->mask);
+    *length = f->tail - f->head;
+    f->head = f->scanned = f->tail;
+    return true;
+}
+
+/**
+ * Take length raw bytes off the framer, for fixed-size binary records.
+ *
+ * @return: true if enough bytes were available.
+ */
+static inline bool framer_read(struct line_framer *f, void *out, size_t length) {
+    if (framer_length(f) < length) {
+        return false;
+    }
+    size_t offset = f->head & f->mask;
+    size_t to_end = (size_t)f->mask + 1 - offset;
+    size_t first = length < to_end ? length : to_end;
+    memcpy(out, f->buffer + offset, first);
+    memcpy((char*)out + first, f->buffer, length - first);
+    f->head += (uint32_t)length;
+    if (f->scanned - f->head > f->tail - f->head) {
+        f->scanned = f->head;
+    }
+    return true;
+}
+
+static inline const char *skip_spaces(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Parse a decimal integer after optional blanks and an optional sign, advancing *p.
+ */
+static inline bool parse_int(const char **p, const char *end, int *value) {
+    const char *s = skip_spaces(*p, end);
+    if (s < end && *s == '+') {
+        s++;
+    }
+    std::from_chars_result r = std::from_chars(s, end, *value);
+    if (r.ec != std::errc()) {
+        return false;
+    }
+    *p = r.ptr;
+    return true;
+}
+
+static inline bool parse_uint32(const char **p, const char *end, uint32_t *value) {
+    const char *s = skip_spaces(*p, end);
+    std::from_chars_result r = std::from_chars(s, end, *value);
+    if (r.ec != std::errc()) {
+        return false;
+    }
+    *p = r.ptr;
+    return true;
+}
+
+/**
+ * Parse a floating-point number after optional blanks and an optional sign, advancing *p.
+ */
+static inline bool parse_double(const char **p, const char *end, double *value) {
+    const char *s = skip_spaces(*p, end);
+    if (s < end && *s == '+') {
+        s++;
+    }
+    std::from_chars_result r = std::from_chars(s, end, *value);
+    if (r.ec != std::errc()) {
+        return false;
+    }
+    *p = r.ptr;
+    return true;
+}
+
+/**
+ * Parse the next blank-separated word, advancing *p.
+ */
+static inline bool parse_word(const char **p, const char *end, const char **word, size_t *length) {
+    const char *s = skip_spaces(*p, end);
+    const char *e = s;
+    while (e < end && *e != ' ' && *e != '\t' && *e != '\n') {
+        e++;
+    }
+    if (e == s) {
+        return false;
+    }
+    *word = s;
+    *length = e - s;
+    *p = e;
+    return true;
+}
+
+/**
+ * Write value as printf("%d") would. out needs room for 11 characters.
+ *
+ * @return: Number of characters written.
+ */
+static inline size_t format_int(char *out, int value) {
+    return std::to_chars(out, out + 11, value).ptr - out;
+}
+
+static inline size_t format_uint32(char *out, uint32_t value) {
+    return std::to_chars(out, out + 10, value).ptr - out;
+}
+
+/**
+ * Write value as printf("%8.8g") would. out needs room for 24 characters.
+ *
+ * @return: Number of characters written.
+ */
+static inline size_t format_float8(char *out, double value) {
+    char digits[24];
+    size_t length = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::general, 8).ptr - digits;
+    size_t padding = length < 8 ? 8 - length : 0;
+    memset(out, ' ', padding);
+    memcpy(out + padding, digits, length);
+    return padding + length;
+}
+
+#endif
@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "calcClient.h" // Session logic, on top of the calculation library
+#include "histogram.h"
+
+/*
+
+End-to-end load test: starts the server on an ephemeral loopback port and runs a matrix of
+scenarios against it, every combination of a connection count, a task mix and a fraction of
+slow clients.
+
+A task mix is a '+'-separated list of session kinds, which the connections take turns on:
+
+  text1.0      TEXT TCP 1.0, one task per connection
+  text1.1:N    TEXT TCP 1.1, N lockstep tasks per connection (default 8)
+  binary:N     BINARY TCP 1.0, N lockstep tasks per connection (default 8)
+
+Like the client's load generator, every connection reconnects as soon as its session ends.
+The connections start LOADTEST_RAMP_MS apart, so the first burst of connects does not
+overflow the server's small listen backlog (a dropped SYN is only sent again after a second).
+A slow client waits --slow-delay before its protocol reply and before every result; give it
+more than RESPONSE_TIMEOUT to make the server time it out.
+
+Per scenario it reports sessions/s, the share of sessions the server timed out, server CPU
+time per session (utime + stime of the server process from /proc) and session latency
+percentiles. Latency runs from connect() to the last verdict, less the slow clients' waits.
+
+Sessions/s of every scenario is checked against a baseline file of "<scenario> <sessions/s>"
+lines that --record writes once per machine (make loadtest-baseline). The run fails without
+a baseline for every scenario, if a scenario falls more than --tolerance below its baseline,
+or if any session ended in an error. Incorrect verdicts are only reported: a
+"%8.8g" float result of 10000 or more can be off by more than the server's tolerance.
+
+*/
+
+#define LOADTEST_TIMEOUT_MS 10000 // A session step taking longer than this is an error
+#define LOADTEST_RAMP_MS 1       // Delay between the starts of two connections
+#define MAX_SCENARIOS 64
+#define MAX_KINDS 8              // Session kinds per task mix
+#define DEFAULT_TASKS 8          // Tasks per TEXT TCP 1.1 or binary session
+
+using calcclient::Assignment;
+using calcclient::Executor;
+using calcclient::Protocol;
+using calcclient::Session;
+using calcclient::Status;
+using calcclient::Task;
+
+struct session_kind {
+    Protocol protocol;
+    unsigned tasks;              // Tasks per session, 1 for TEXT TCP 1.0
+};
+
+struct task_mix {
+    char name[64];
+    struct session_kind kinds[MAX_KINDS];
+    unsigned count;
+};
+
+struct scenario {
+    char name[96];               // "c<connections>/<mix>/slow<fraction>", the baseline key
+    unsigned connections;
+    const struct task_mix *mix;
+    double slow_fraction;
+};
+
+struct scenario_run {
+    const struct scenario *scenario;
+    const struct addrinfo *server;
+    Executor *executor;
+    long long start, end;
+    long long slow_delay;        // ns
+
+    struct histogram latency;
+    uint64_t sessions, tasks, incorrect, timeouts, errors;
+};
+
+static long long slow_delay_ms = 100;
+static double duration = 2.0;    // Seconds per scenario
+static double tolerance = 0.2;   // Allowed drop below the baseline
+
+/**
+ * Parse one session kind, "text1.0", "text1.1[:N]" or "binary[:N]".
+ *
+ * @return: 0 on success, -1 if kind is none of these.
+ */
+static int parse_kind(const char *kind, size_t length, struct session_kind *out) {
+    const char *colon = (const char*)memchr(kind, ':', length);
+    size_t name_length = colon != NULL ? (size_t)(colon - kind) : length;
+    out->tasks = DEFAULT_TASKS;
+    if (colon != NULL) {
+        char *end;
+        out->tasks = strtoul(colon + 1, &end, 10);
+        if (end != kind + length || out->tasks == 0) {
+            return -1;
+        }
+    }
+
+    if (name_length == 7 && memcmp(kind, "text1.0", 7) == 0 && colon == NULL) {
+        out->protocol = Protocol::TEXT_1_0;
+        out->tasks = 1;
+    } else if (name_length == 7 && memcmp(kind, "text1.1", 7) == 0) {
+        out->protocol = Protocol::TEXT_1_1;
+    } else if (name_length == 6 && memcmp(kind, "binary", 6) == 0) {
+        out->protocol = Protocol::BINARY;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parse a task mix, session kinds separated by '+'.
+ *
+ * @return: 0 on success, -1 on a bad kind or too many of them.
+ */
+static int parse_mix(const char *text, size_t length, struct task_mix *mix) {
+    if (length == 0 || length >= sizeof(mix->name)) {
+        return -1;
+    }
+    memcpy(mix->name, text, length);
+    mix->name[length] = '\0';
+    mix->count = 0;
+
+    const char *end = text + length;
+    while (text < end) {
+        const char *plus = (const char*)memchr(text, '+', end - text);
+        const char *kind_end = plus != NULL ? plus : end;
+        if (mix->count == MAX_KINDS || parse_kind(text, kind_end - text, &mix->kinds[mix->count]) == -1) {
+            return -1;
+        }
+        mix->count++;
+        text = kind_end + (plus != NULL);
+    }
+    return 0;
+}
+
+/**
+ * Split a comma-separated list, calling item(text, length) for every element.
+ *
+ * @return: 0 on success, -1 as soon as item() fails or an element is empty.
+ */
+template <typename Item>
+static int split_list(const char *list, Item item) {
+    while (1) {
+        const char *comma = strchr(list, ',');
+        size_t length = comma != NULL ? (size_t)(comma - list) : strlen(list);
+        if (length == 0 || item(list, length) == -1) {
+            return -1;
+        }
+        if (comma == NULL) {
+            return 0;
+        }
+        list = comma + 1;
+    }
+}
+
+/**
+ * One connection of a scenario, reconnecting until the scenario ends.
+ */
+static Task<void> load_connection(struct scenario_run *r, unsigned index, bool slow) {
+    Executor &executor = *r->executor;
+    const struct task_mix *mix = r->scenario->mix;
+    const struct session_kind *kind = &mix->kinds[index % mix->count];
+
+    co_await executor.sleep_until(r->start + index * LOADTEST_RAMP_MS * 1000000LL);
+    while (executor.now_ns() < r->end) {
+        Session session(executor, LOADTEST_TIMEOUT_MS);
+        Assignment task;
+        long long start = executor.now_ns();
+        long long waited = 0;
+
+        Status status = co_await session.connect(r->server);
+        if (status == Status::OK) {
+            status = co_await session.greet();
+        }
+        if (status == Status::OK && slow) {
+            co_await executor.sleep_until(executor.now_ns() + r->slow_delay);
+            waited += r->slow_delay;
+        }
+        if (status == Status::OK) {
+            status = co_await session.request(kind->protocol);
+        }
+
+        unsigned tasks_done = 0;
+        while (status == Status::OK) {
+            status = co_await session.next_task(task);
+            if (status != Status::OK) {
+                break;
+            }
+            if (slow) {
+                long long wait_start = executor.now_ns();
+                co_await executor.sleep_until(wait_start + r->slow_delay);
+                waited += executor.now_ns() - wait_start;
+            }
+            status = co_await session.answer(task);
+            if (status != Status::OK) {
+                break;
+            }
+            r->tasks++;
+            r->incorrect += !task.correct;
+
+            if (++tasks_done == kind->tasks) {
+                co_await session.quit();
+                r->sessions++;
+                histogram_record(&r->latency, (uint64_t)(executor.now_ns() - start - waited));
+                break;
+            }
+        }
+
+        if (status == Status::TIMEOUT) {
+            r->timeouts++;
+        } else if (status != Status::OK) {
+            r->errors++;
+        }
+    }
+}
+
+/**
+ * CPU time (user + system) the process has used so far, in seconds.
+ *
+ * @return: The time, or -1.0 if /proc cannot be read.
+ */
+static double process_cpu_seconds(pid_t pid) {
+    char path[64], line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1.0;
+    }
+    bool read = fgets(line, sizeof(line), file) != NULL;
+    fclose(file);
+
+    // The command name may hold spaces; the fields counted from 3 start after its ')'
+    char *fields = read ? strrchr(line, ')') : NULL;
+    unsigned long long utime, stime;
+    if (fields == NULL
+        || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return -1.0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * Start the server on 127.0.0.1 with the kernel picking the port, logging off.
+ *
+ * @param extra: Further server arguments, NULL-terminated.
+ * @param port: Receives the port the server listens on.
+ * @return: The server's pid, or -1 on failure.
+ */
+static pid_t start_server(const char *path, char *const extra[], char *port, size_t port_size) {
+    int out[2];
+    if (pipe(out) == -1) {
+        perror("pipe failed");
+        return -1;
+    }
+
+    const char *args[64] = {path, "127.0.0.1:0", "--log-level", "off"};
+    int arg_count = 4;
+    for (int i = 0; extra[i] != NULL && arg_count < 63; i++) {
+        args[arg_count++] = extra[i];
+    }
+    args[arg_count] = NULL;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        execv(path, (char *const*)args);
+        perror("Failed to start the server");
+        _exit(127);
+    }
+    close(out[1]);
+
+    // The server prints its address once it listens; the pipe stays open for whatever
+    // it prints afterwards (nothing with logging off)
+    FILE *server_out = fdopen(out[0], "r");
+    char line[256];
+    while (fgets(line, sizeof(line), server_out) != NULL) {
+        char *colon = strrchr(line, ':');
+        if (strncmp(line, "Server running on ", 18) == 0 && colon != NULL) {
+            snprintf(port, port_size, "%.*s", (int)strcspn(colon + 1, "\n"), colon + 1);
+            return pid;
+        }
+    }
+
+    fprintf(stderr, "The server exited before listening\n");
+    waitpid(pid, NULL, 0);
+    fclose(server_out);
+    return -1;
+}
+
+/**
+ * Sessions/s recorded for name in the baseline file, 0.0 if there is none.
+ */
+static double baseline_rate(FILE *baseline, const char *name) {
+    if (baseline == NULL) {
+        return 0.0;
+    }
+    rewind(baseline);
+    char line[256], key[128];
+    double rate;
+    while (fgets(line, sizeof(line), baseline) != NULL) {
+        if (line[0] != '#' && sscanf(line, "%127s %lf", key, &rate) == 2 && strcmp(key, name) == 0) {
+            return rate;
+        }
+    }
+    return 0.0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] [-- server arguments]\n", program);
+    fprintf(stderr, "  --server PATH         Server binary to test (default ./server)\n");
+    fprintf(stderr, "  --connections LIST    Concurrent connections, e.g. 1,32 (default 1,32)\n");
+    fprintf(stderr, "  --mix LIST            Task mixes, e.g. text1.0,text1.1:8+binary:8 (default that)\n");
+    fprintf(stderr, "  --slow LIST           Fractions of slow clients, e.g. 0,0.25 (default that)\n");
+    fprintf(stderr, "  --slow-delay MS       Wait of a slow client before each reply (default %lld)\n", slow_delay_ms);
+    fprintf(stderr, "  --duration S          Seconds per scenario (default %.0f)\n", duration);
+    fprintf(stderr, "  --baseline FILE       Baseline sessions/s per scenario (default loadtest.baseline)\n");
+    fprintf(stderr, "  --tolerance PERCENT   Allowed drop below the baseline (default %.0f)\n", tolerance * 100);
+    fprintf(stderr, "  --record              Write the results to the baseline file instead of checking them\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_path = "./server";
+    const char *connection_list = "1,32";
+    const char *mix_list = "text1.0,text1.1:8+binary:8";
+    const char *slow_list = "0,0.25";
+    const char *baseline_path = "loadtest.baseline";
+    bool record = false;
+    char *const *server_args = argv + argc; // The NULL after the last argument
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_path = argv[++i];
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connection_list = argv[++i];
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            mix_list = argv[++i];
+        } else if (strcmp(argv[i], "--slow") == 0 && i + 1 < argc) {
+            slow_list = argv[++i];
+        } else if (strcmp(argv[i], "--slow-delay") == 0 && i + 1 < argc) {
+            slow_delay_ms = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = strtod(argv[++i], NULL) / 100.0;
+        } else if (strcmp(argv[i], "--record") == 0) {
+            record = true;
+        } else if (strcmp(argv[i], "--") == 0) {
+            server_args = argv + i + 1;
+            break;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (duration <= 0 || slow_delay_ms < 0 || tolerance < 0 || tolerance >= 1) {
+        usage(argv[0]);
+    }
+
+    // The matrix
+    static unsigned connection_counts[MAX_SCENARIOS];
+    static struct task_mix mixes[MAX_SCENARIOS];
+    static double slow_fractions[MAX_SCENARIOS];
+    unsigned connection_count = 0, mix_count = 0, slow_count = 0;
+    if (split_list(connection_list, [&](const char *text, size_t) {
+            unsigned long connections = strtoul(text, NULL, 10);
+            if (connection_count == MAX_SCENARIOS || connections == 0 || connections > 10000) {
+                return -1;
+            }
+            connection_counts[connection_count++] = (unsigned)connections;
+            return 0;
+        }) == -1
+        || split_list(mix_list, [&](const char *text, size_t length) {
+            return mix_count == MAX_SCENARIOS ? -1 : parse_mix(text, length, &mixes[mix_count++]);
+        }) == -1
+        || split_list(slow_list, [&](const char *text, size_t) {
+            double fraction = strtod(text, NULL);
+            if (slow_count == MAX_SCENARIOS || fraction < 0 || fraction > 1) {
+                return -1;
+            }
+            slow_fractions[slow_count++] = fraction;
+            return 0;
+        }) == -1
+        || connection_count * mix_count * slow_count > MAX_SCENARIOS) {
+        fprintf(stderr, "Error: Bad or too large scenario matrix.\n");
+        usage(argv[0]);
+    }
+
+    static struct scenario scenarios[MAX_SCENARIOS];
+    unsigned scenario_count = 0;
+    for (unsigned c = 0; c < connection_count; c++) {
+        for (unsigned m = 0; m < mix_count; m++) {
+            for (unsigned s = 0; s < slow_count; s++) {
+                struct scenario *sc = &scenarios[scenario_count++];
+                sc->connections = connection_counts[c];
+                sc->mix = &mixes[m];
+                sc->slow_fraction = slow_fractions[s];
+                snprintf(sc->name, sizeof(sc->name), "c%u/%s/slow%g", sc->connections, sc->mix->name, sc->slow_fraction);
+            }
+        }
+    }
+
+    FILE *baseline = NULL;
+    if (record) {
+        baseline = fopen(baseline_path, "w");
+        if (baseline == NULL) {
+            perror("Failed to open the baseline file");
+            return EXIT_FAILURE;
+        }
+        fprintf(baseline, "# Sessions/s per scenario, written by calcload --record\n");
+    } else {
+        baseline = fopen(baseline_path, "r");
+        if (baseline == NULL) {
+            fprintf(stderr, "No baseline in %s: record one on this machine with calcload --record "
+                    "(make loadtest-baseline)\n", baseline_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char port[NI_MAXSERV];
+    pid_t server = start_server(server_path, server_args, port, sizeof(port));
+    if (server == -1) {
+        return EXIT_FAILURE;
+    }
+    struct addrinfo hints{}, *address;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", port, &hints, &address) != 0) {
+        fprintf(stderr, "Address resolution failed\n");
+        kill(server, SIGTERM);
+        return EXIT_FAILURE;
+    }
+    printf("Server %s on 127.0.0.1:%s, %.1f s per scenario, slow clients wait %lld ms\n\n", server_path, port,
+           duration, slow_delay_ms);
+
+    printf("%-36s %10s %10s %9s %8s %11s %8s %8s %8s %8s  %s\n", "Scenario", "sessions/s", "tasks/s", "incorrect",
+           "timeout%", "cpu us/sess", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "baseline");
+    int failures = 0;
+    static struct scenario_run run; // The histogram is too large for the stack
+    for (unsigned i = 0; i < scenario_count; i++) {
+        const struct scenario *sc = &scenarios[i];
+        Executor executor;
+        memset(&run, 0, sizeof(run));
+        run.scenario = sc;
+        run.server = address;
+        run.executor = &executor;
+        run.slow_delay = slow_delay_ms * 1000000;
+        histogram_init(&run.latency);
+
+        unsigned slow_connections = (unsigned)(sc->slow_fraction * sc->connections + 0.5);
+        double cpu_start = process_cpu_seconds(server);
+        long long start = executor.now_ns();
+        run.start = start;
+        run.end = start + (long long)(duration * 1e9);
+        for (unsigned c = 0; c < sc->connections; c++) {
+            executor.spawn(load_connection(&run, c, c < slow_connections));
+        }
+        executor.run(run.end); // Sessions still going at the end are dropped
+        double elapsed = (executor.now_ns() - start) / 1e9;
+        double cpu = process_cpu_seconds(server) - cpu_start;
+
+        if (waitpid(server, NULL, WNOHANG) != 0) {
+            fprintf(stderr, "The server died during %s\n", sc->name);
+            return EXIT_FAILURE;
+        }
+
+        uint64_t ended = run.sessions + run.timeouts + run.errors;
+        double rate = run.sessions / elapsed;
+        printf("%-36s %10.1f %10.1f %9llu %8.3f %11.1f %8.3f %8.3f %8.3f %8.3f  ", sc->name, rate, run.tasks / elapsed,
+               (unsigned long long)run.incorrect, ended > 0 ? 100.0 * run.timeouts / ended : 0.0, run.sessions > 0 && cpu_start >= 0 ? cpu * 1e6 / run.sessions : 0.0,
+               histogram_percentile(&run.latency, 50.0) / 1e6, histogram_percentile(&run.latency, 90.0) / 1e6,
+               histogram_percentile(&run.latency, 99.0) / 1e6, histogram_percentile(&run.latency, 99.9) / 1e6);
+
+        if (record) {
+            fprintf(baseline, "%s %.1f\n", sc->name, rate);
+            printf("recorded\n");
+        } else {
+            double expected = baseline_rate(baseline, sc->name);
+            if (expected <= 0.0) {
+                printf("none: FAIL\n");
+                failures++;
+            } else if (rate < expected * (1.0 - tolerance)) {
+                printf("%.1f, %.0f%% below: FAIL\n", expected, 100.0 * (1.0 - rate / expected));
+                failures++;
+            } else {
+                printf("%.1f, ok\n", expected);
+            }
+        }
+        if (run.errors > 0) {
+            printf("  %llu sessions failed: FAIL\n", (unsigned long long)run.errors);
+            failures++;
+        }
+        fflush(stdout);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    freeaddrinfo(address);
+    if (baseline != NULL) {
+        fclose(baseline);
+    }
+
+    if (failures > 0) {
+        printf("\n%d check%s failed\n", failures, failures == 1 ? "" : "s");
+        return EXIT_FAILURE;
+    }
+    if (record) {
+        printf("\nBaseline written to %s\n", baseline_path);
+    } else {
+        printf("\nAll scenarios passed\n");
+    }
+    return 0;
+}
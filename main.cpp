@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 /* Include the calcLib header file, using <> as its a library and not just a object file we link.  */
 #include <calcLib.h>
+#include "batchEval.h"
 
 
 
@@ -24,13 +27,53 @@
 */
 int main(int argc, char *argv[]){
 
+  /* Batch mode: evaluate a whole file of "op a b" lines, one result per line (see batchEval.h). 
+     Usage: test --batch <file> [--threads N] [--output <file>] */
+  if(argc >= 3 && strcmp(argv[1],"--batch") == 0){
+    unsigned threads=0; // One per CPU
+    const char *output=NULL; // stdout
+    for(int i=3;i<argc;i++){
+      if(strcmp(argv[i],"--threads") == 0 && i+1 < argc){
+        threads=strtoul(argv[++i],NULL,10);
+      } else if(strcmp(argv[i],"--output") == 0 && i+1 < argc){
+        output=argv[++i];
+      } else {
+        fprintf(stderr,"Usage: %s --batch <file> [--threads N] [--output <file>]\n",argv[0]);
+        exit(1);
+      }
+    }
+
+    int fd=STDOUT_FILENO;
+    if(output != NULL){
+      fd=open(output,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+      if(fd == -1){
+        perror("Failed to open the output file");
+        exit(1);
+      }
+    }
+
+    struct batch_stats stats;
+    int rv=batch_evaluate(argv[2],fd,threads,&stats);
+    if(output != NULL && close(fd) == -1){
+      perror("Failed to write the output file");
+      rv=-1;
+    }
+    fprintf(stderr,"Evaluated %llu lines (%llu not tasks) in %.2f s: %.0f lines/s\n",
+            (unsigned long long)stats.lines,(unsigned long long)stats.errors,stats.seconds,
+            stats.seconds > 0 ? stats.lines/stats.seconds : 0.0);
+    return rv == 0 ? 0 : 1;
+  }
+
   /* Initialize the library, this is needed for this library. */
   initCalcLib();
-  char *ptr;
-  ptr=randomType(); // Get a random arithemtic operator. 
-
-  double f1,f2,fresult;
-  int i1,i2,iresult;
+  calc_op_t op;
+  const char *ptr;
+  op=randomOp(); // Get a random arithemtic operator. 
+  ptr=calcOps[op].name; // and its name, as randomType() would have returned it.
+
+  double f1,f2;
+  int i1,i2;
+  calc_value_t a,b,result;
   /*
   printf("ptr = %p, \t", ptr );
   printf("string = %s, \n", ptr );
@@ -46,33 +89,20 @@ int main(int argc, char *argv[]){
   printf("Float Values: %8.8g %8.8g \n",f1,f2);
 
   
-  /* Act differently depending on what operator you got, judge type by first char in string. If 'f' then a float */
+  /* Act differently depending on the type of the operator. calcOps[op] knows if it works on floats, 
+     and has the function that determines the reference result, so no string compares are needed. */
   
-  if(ptr[0]=='f'){
-    /* At this point, ptr holds operator, f1 and f2 the operands. Now we work to determine the reference result. */
-   
-    if(strcmp(ptr,"fadd")==0){
-      fresult=f1+f2;
-    } else if (strcmp(ptr, "fsub")==0){
-      fresult=f1-f2;
-    } else if (strcmp(ptr, "fmul")==0){
-      fresult=f1*f2;
-    } else if (strcmp(ptr, "fdiv")==0){
-      fresult=f1/f2;
-    }
-    printf("%s %8.8g %8.8g = %8.8g\n",ptr,f1,f2,fresult);
+  if(calcOps[op].is_float){
+    /* At this point, op holds operator, f1 and f2 the operands. Now we work to determine the reference result. */
+    a.f=f1;
+    b.f=f2;
+    result=calcOps[op].compute(a,b);
+    printf("%s %8.8g %8.8g = %8.8g\n",ptr,f1,f2,result.f);
   } else {
-    if(strcmp(ptr,"add")==0){
-      iresult=i1+i2;
-    } else if (strcmp(ptr, "sub")==0){
-      iresult=i1-i2;
-    } else if (strcmp(ptr, "mul")==0){
-      iresult=i1*i2;
-    } else if (strcmp(ptr, "div")==0){
-      iresult=i1/i2;
-    }
-
-    printf("%s %d %d = %d \n",ptr,i1,i2,iresult);
+    a.i=i1;
+    b.i=i2;
+    result=calcOps[op].compute(a,b);
+    printf("%s %d %d = %d \n",ptr,i1,i2,result.i);
   }
 
   /* This section shows how to read a line from stdin, process and do a similar operation as above. */
@@ -102,8 +132,11 @@ int main(int argc, char *argv[]){
   }
   
   printf("Command: |%s|\n",command);
+
+  /* Look the command up in the operator table, a perfect hash on its name. */
+  op=calcOpLookup(command,strlen(command));
   
-  if(command[0]=='f'){
+  if(op!=CALC_OP_COUNT && calcOps[op].is_float){
     printf("Float\t");
     rv=sscanf(lineBuffer,"%s %lg %lg",command,&f1,&f2);
     if (rv == EOF ) {
@@ -111,16 +144,10 @@ int main(int argc, char *argv[]){
       free(lineBuffer); // This is needed for the getline() as it will allocate memory (if the provided buffer is NUL).
       exit(1);
     }
-    if(strcmp(command,"fadd")==0){
-      fresult=f1+f2;
-    } else if (strcmp(command, "fsub")==0){
-      fresult=f1-f2;
-    } else if (strcmp(command, "fmul")==0){
-      fresult=f1*f2;
-    } else if (strcmp(command, "fdiv")==0){
-      fresult=f1/f2;
-    }
-    printf("%s %8.8g %8.8g = %8.8g\n",command,f1,f2,fresult);
+    a.f=f1;
+    b.f=f2;
+    result=calcOps[op].compute(a,b);
+    printf("%s %8.8g %8.8g = %8.8g\n",command,f1,f2,result.f);
   } else {
     printf("Int\t");
     rv=sscanf(lineBuffer,"%s %d %d",command,&i1,&i2);
@@ -129,20 +156,16 @@ int main(int argc, char *argv[]){
       free(lineBuffer); // This is needed for the getline() as it will allocate memory (if the provided buffer is NUL).
       exit(1);
     }
-    if(strcmp(command,"add")==0){
-      iresult=i1+i2;
-    } else if (strcmp(command, "sub")==0){
-      iresult=i1-i2;
-      printf("[%s %d %d = %d ]\n",command,i1,i2,iresult);
-    } else if (strcmp(command, "mul")==0){
-      iresult=i1*i2;
-    } else if (strcmp(command, "div")==0){     
-      iresult=i1/i2;
+    result.i=0;
+    if(op!=CALC_OP_COUNT){
+      a.i=i1;
+      b.i=i2;
+      result=calcOps[op].compute(a,b);
     } else {
       printf("No match\n");
     }
 
-    printf("%s %d %d = %d \n",command,i1,i2,iresult);
+    printf("%s %d %d = %d \n",command,i1,i2,result.i);
   }
    
 
@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "calcClient.h" // Session logic, on top of the calculation library
+#include "histogram.h"
+#include "sessionTrace.h"
+
+/*
+
+Replayer of a session journal written by the server's --record: every recorded session is
+played against a server again, starting at its original offset from the first one and
+keeping its recorded pacing, or all of it N times faster with --speed N.
+
+A session connects, greets, sends its protocol reply at the recorded time (moving to shared
+memory first if it did and the target is a Unix socket), and then:
+
+  lockstep      answers its recorded number of tasks, spreading the results evenly between
+                the recorded first and last result, and answers as many of them wrongly as
+                the server counted. The first task gets the recorded verdict; which of the
+                others are wrong is drawn from stream <session> of the journal's seed
+                (initCalcLib_seed()), so two replays of a journal send the same answers.
+  windowed      answers its recorded number of tasks as fast as they come, all correctly.
+
+and ends the way it was recorded: QUIT at the recorded time, waiting for the server to close
+(the last verdict, or "ERROR TO" for a timed-out session: the server's timeout does not scale
+with --speed), or closing the connection itself. A session the server closed on a protocol
+error is replayed up to its close, the error itself is not reproduced.
+
+The server draws its tasks from the time unless started with --seed; with the journal's seed
+and the same worker count, the first task of a session is the recorded one as long as the
+sessions reach the server in the recorded order. The report counts those.
+
+Sessions that start more than REPLAY_LATE_MS behind their schedule are counted: a replay
+that cannot keep up starts them in bursts, and those are not the recorded traffic.
+
+At the end it reports how many sessions ended as recorded (same verdicts, same correct
+count, same end) and the percentiles of the recorded and the replayed session durations,
+the latter multiplied by --speed so the two compare directly.
+
+*/
+
+#define REPLAY_TIMEOUT_MS 30000  // A session step taking longer than this is an error
+#define REPLAY_LATE_MS 1         // A session starting later than this behind its schedule counts as late
+#define FLOAT_MATCH 1e-6         // Relative difference of a float operand still taken as the recorded one
+
+using calcclient::Assignment;
+using calcclient::Executor;
+using calcclient::Protocol;
+using calcclient::Session;
+using calcclient::Status;
+using calcclient::Task;
+
+struct replay_run {
+    Executor *executor;
+    const struct addrinfo *server;
+    bool local;                  // The server is a Unix socket, shared memory is possible
+    double speed;
+    long long start;             // Executor time the first session starts at
+    uint64_t first_accepted_ns;  // accepted_ns of the first session
+    unsigned seed;
+
+    struct histogram recorded, replayed;
+    uint64_t sessions, matched, errors;
+    uint64_t verdict_mismatches, correct_mismatches, end_mismatches;
+    uint64_t tasks_compared, tasks_identical;
+    uint64_t late;               // Sessions started more than REPLAY_LATE_MS behind schedule
+    long long max_lag;           // ns
+};
+
+/**
+ * Executor time of a point us microseconds into a session that started at start.
+ */
+static long long replay_time(const struct replay_run *r, long long start, uint32_t us) {
+    return start + (long long)(us * 1000.0 / r->speed);
+}
+
+/**
+ * Whether the task the server sent is the first task of record t.
+ */
+static bool same_task(const Assignment &task, Protocol protocol, const struct trace_record *t) {
+    calc_value_t a, b;
+    calc_op_t op;
+    if (protocol == Protocol::BINARY) {
+        op = (calc_op_t)task.frame.opcode; // Binary opcodes are the calc_op_t values
+        a.f = b.f = 0;
+        if (calcOpIsFloat(op)) {
+            a.f = task.frame.a.f;
+            b.f = task.frame.b.f;
+        } else {
+            a.i = task.frame.a.i;
+            b.i = task.frame.b.i;
+        }
+    } else {
+        const char *p = task.line, *end = task.line + task.line_length;
+        const char *name;
+        size_t name_length;
+        if (!parse_word(&p, end, &name, &name_length)) {
+            return false;
+        }
+        op = calcOpLookup(name, name_length);
+        if (op == CALC_OP_COUNT) {
+            return false;
+        }
+        if (calcOpIsFloat(op) ? !parse_double(&p, end, &a.f) || !parse_double(&p, end, &b.f)
+                              : !parse_int(&p, end, &a.i) || !parse_int(&p, end, &b.i)) {
+            return false;
+        }
+    }
+
+    if (op != t->op) {
+        return false;
+    }
+    if (calcOpIsFloat(op)) {
+        // The text protocol sends the operands as "%8.8g"
+        return fabs(a.f - t->a.f) <= FLOAT_MATCH * fabs(t->a.f) && fabs(b.f - t->b.f) <= FLOAT_MATCH * fabs(t->b.f);
+    }
+    return a.i == t->a.i && b.i == t->b.i;
+}
+
+/**
+ * Turn the solved result of task into a wrong one, off by at least 1.
+ */
+static void corrupt_answer(Assignment &task, Protocol protocol) {
+    if (protocol == Protocol::BINARY) {
+        if (calcOpIsFloat((calc_op_t)task.frame.opcode)) {
+            task.frame.a.f += 1.0 + fabs(task.frame.a.f);
+        } else {
+            task.frame.a.i += 1;
+        }
+        return;
+    }
+    bool is_float = task.line_length > 0 && task.line[0] == 'f'; // fadd, fsub, fmul, fdiv
+    double value = strtod(task.result, NULL);
+    if (is_float) {
+        task.result_length = snprintf(task.result, sizeof(task.result), "%8.8g\n", value + 1.0 + fabs(value));
+    } else {
+        task.result_length = snprintf(task.result, sizeof(task.result), "%lld\n", (long long)value + 1);
+    }
+}
+
+/**
+ * Read and drop whatever the server still sends until it closes the connection.
+ */
+static Task<Status> wait_for_close(Session &session) {
+    const char *line;
+    size_t length;
+    Status status;
+    do {
+        status = co_await session.connection().read_line(&line, &length);
+    } while (status == Status::OK);
+    co_return status;
+}
+
+/**
+ * Replay one recorded session.
+ */
+static Task<void> replay_session(struct replay_run *r, const struct trace_record *t, unsigned index) {
+    Executor &executor = *r->executor;
+    Session session(executor, REPLAY_TIMEOUT_MS);
+    long long start = executor.now_ns();
+    // t->protocol is the server's session_protocol: TEXT TCP 1.0, TEXT TCP 1.1, BINARY TCP 1.0
+    Protocol protocol = t->protocol == 0 ? Protocol::TEXT_1_0 : t->protocol == 1 ? Protocol::TEXT_1_1 : Protocol::BINARY;
+    bool windowed = t->window > 1;
+    unsigned verdicts = 0, correct = 0;
+    bool ended_as_recorded = false;
+
+    Status status = co_await session.connect(r->server);
+    if (status == Status::OK) {
+        status = co_await session.greet();
+    }
+    if (status == Status::OK && t->negotiated_us == TRACE_NEVER) {
+        // Never answered the greeting
+        if (t->end == TRACE_END_TIMEOUT) {
+            status = co_await wait_for_close(session);
+            ended_as_recorded = status != Status::ERROR;
+        } else {
+            co_await executor.sleep_until(replay_time(r, start, t->closed_us));
+            ended_as_recorded = true;
+        }
+        goto done;
+    }
+    if (status == Status::OK && t->shm && r->local) {
+        bool granted;
+        status = co_await session.share_memory(&granted);
+    }
+    if (status == Status::OK) {
+        co_await executor.sleep_until(replay_time(r, start, t->negotiated_us));
+        status = co_await session.request(protocol, protocol == Protocol::TEXT_1_0 || !t->tagged ? 0 : t->window);
+    }
+
+    if (status == Status::OK && windowed) {
+        if (t->tasks > 0) {
+            status = co_await session.run_window(t->tasks, &verdicts, &correct);
+        }
+    } else if (status == Status::OK) {
+        // Which tasks to answer wrongly: the first as recorded, the others drawn
+        calc_rng_t rng;
+        calcRngStream(&rng, index + 1);
+        unsigned wrong = t->tasks - t->correct;
+        bool first_wrong = t->verdict == 0 || (t->verdict == TRACE_NO_VERDICT && wrong > 0);
+        wrong -= first_wrong && wrong > 0;
+
+        for (unsigned i = 0; i < t->tasks && status == Status::OK; i++) {
+            Assignment task;
+            status = co_await session.next_task(task);
+            if (status != Status::OK) {
+                break;
+            }
+            bool answer_wrong = i == 0 ? first_wrong : calcRngBounded(&rng, t->tasks - i) < wrong;
+            if (i == 0) {
+                r->tasks_compared++;
+                r->tasks_identical += same_task(task, protocol, t);
+            } else {
+                wrong -= answer_wrong;
+            }
+            if (answer_wrong) {
+                corrupt_answer(task, protocol);
+            }
+
+            uint32_t at = t->first_result_us;
+            if (t->tasks > 1 && t->last_result_us != TRACE_NEVER) {
+                at += (uint32_t)((uint64_t)(t->last_result_us - t->first_result_us) * i / (t->tasks - 1));
+            }
+            co_await executor.sleep_until(replay_time(r, start, at));
+            status = co_await session.answer(task);
+            if (status == Status::OK) {
+                verdicts++;
+                correct += task.correct;
+            }
+        }
+    }
+
+    if (status == Status::OK) {
+        switch (t->end) {
+        case TRACE_END_QUIT:
+            co_await executor.sleep_until(replay_time(r, start, t->closed_us));
+            co_await session.quit();
+            ended_as_recorded = true;
+            break;
+        case TRACE_END_DONE:
+        case TRACE_END_TIMEOUT:
+            status = co_await wait_for_close(session);
+            ended_as_recorded = status == Status::CLOSED || status == Status::TIMEOUT;
+            break;
+        default: // The client closed, or the server on an error
+            co_await executor.sleep_until(replay_time(r, start, t->closed_us));
+            ended_as_recorded = true;
+            break;
+        }
+    } else if (status == Status::TIMEOUT && t->end == TRACE_END_TIMEOUT) {
+        ended_as_recorded = true;
+    } else if (status == Status::CLOSED && (t->end == TRACE_END_DONE || t->end == TRACE_END_ERROR)) {
+        ended_as_recorded = true;
+    } else if (status == Status::ERROR || status == Status::PROTOCOL) {
+        r->errors++;
+    }
+
+done:
+    r->sessions++;
+    histogram_record(&r->recorded, (uint64_t)t->closed_us * 1000);
+    histogram_record(&r->replayed, (uint64_t)((executor.now_ns() - start) * r->speed));
+    bool verdicts_match = verdicts == t->tasks;
+    bool correct_match = windowed || correct == t->correct;
+    r->verdict_mismatches += !verdicts_match;
+    r->correct_mismatches += !correct_match;
+    r->end_mismatches += !ended_as_recorded;
+    r->matched += verdicts_match && correct_match && ended_as_recorded;
+}
+
+/**
+ * Start every session at its recorded offset, scaled by the speed.
+ */
+static Task<void> dispatch(struct replay_run *r, const struct trace_record *const *records, uint64_t count) {
+    Executor &executor = *r->executor;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t offset = records[i]->accepted_ns - r->first_accepted_ns;
+        long long when = r->start + (long long)(offset / r->speed);
+        co_await executor.sleep_until(when);
+        long long lag = executor.now_ns() - when;
+        r->late += lag > REPLAY_LATE_MS * 1000000LL;
+        r->max_lag = lag > r->max_lag ? lag : r->max_lag;
+        executor.spawn(replay_session(r, records[i], (unsigned)i));
+    }
+}
+
+static int compare_accepted(const void *a, const void *b) {
+    uint64_t x = (*(const struct trace_record *const*)a)->accepted_ns;
+    uint64_t y = (*(const struct trace_record *const*)b)->accepted_ns;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s <journal> <host:port | unix:path> [--speed N]\n", program);
+    fprintf(stderr, "  --speed N   Replay N times faster than recorded (default 1)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+    }
+    const char *journal_path = argv[1];
+    const char *address = argv[2];
+    double speed = 1.0;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = strtod(argv[++i], NULL);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!(speed > 0)) {
+        usage(argv[0]);
+    }
+
+    uint64_t claimed;
+    size_t journal_size;
+    const struct trace_header *header = trace_map(journal_path, &claimed, &journal_size);
+    if (header == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // Slots a killed server claimed but never filled are skipped
+    const struct trace_record *slots = trace_records(header);
+    const struct trace_record **records = (const struct trace_record**)malloc((claimed + 1) * sizeof(*records));
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < claimed; i++) {
+        if (slots[i].committed.load(std::memory_order_acquire)) {
+            records[count++] = &slots[i];
+        }
+    }
+    qsort(records, count, sizeof(*records), compare_accepted);
+    printf("Journal %s: %llu sessions, %llu not recorded (journal full), %u worker%s, ", journal_path,
+           (unsigned long long)count, (unsigned long long)header->dropped.load(), header->workers,
+           header->workers == 1 ? "" : "s");
+    if (header->seeded) {
+        printf("seed %u\n", header->seed);
+    } else {
+        printf("tasks drawn from the time\n");
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    struct addrinfo *resolved = NULL;
+    struct sockaddr_un unix_address{};
+    struct addrinfo unix_info{};
+    bool local = strncmp(address, "unix:", 5) == 0;
+    if (local) {
+        if (strlen(address + 5) >= sizeof(unix_address.sun_path)) {
+            fprintf(stderr, "Socket path too long\n");
+            return EXIT_FAILURE;
+        }
+        unix_address.sun_family = AF_UNIX;
+        strcpy(unix_address.sun_path, address + 5);
+        unix_info.ai_family = AF_UNIX;
+        unix_info.ai_socktype = SOCK_STREAM;
+        unix_info.ai_addr = (struct sockaddr*)&unix_address;
+        unix_info.ai_addrlen = sizeof(unix_address);
+    } else {
+        char host[256];
+        const char *colon = strrchr(address, ':');
+        if (colon == NULL || (size_t)(colon - address) >= sizeof(host)) {
+            usage(argv[0]);
+        }
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        struct addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int rv = getaddrinfo(host, colon + 1, &hints, &resolved);
+        if (rv != 0) {
+            fprintf(stderr, "Address resolution error: %s\n", gai_strerror(rv));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Which answers are wrong follows the journal's seed, the same on every replay
+    initCalcLib_seed(header->seed);
+    printf("Replaying against %s at %gx speed", address, speed);
+    if (header->seeded) {
+        printf(" (start the server with --seed %u --workers %u for the recorded tasks)", header->seed, header->workers);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    static struct replay_run run; // The histograms are too large for the stack
+    Executor executor;
+    run.executor = &executor;
+    run.server = local ? &unix_info : resolved;
+    run.local = local;
+    run.speed = speed;
+    run.start = executor.now_ns();
+    run.first_accepted_ns = records[0]->accepted_ns;
+    run.seed = header->seed;
+    histogram_init(&run.recorded);
+    histogram_init(&run.replayed);
+    executor.spawn(dispatch(&run, records, count));
+    executor.run();
+    double elapsed = (executor.now_ns() - run.start) / 1e9;
+
+    printf("\n%llu sessions in %.2f s, %.1f sessions/s\n", (unsigned long long)run.sessions, elapsed,
+           run.sessions / elapsed);
+    printf("Ended as recorded: %llu, differed: %llu (verdicts %llu, correct count %llu, end %llu), failed: %llu\n",
+           (unsigned long long)run.matched, (unsigned long long)(run.sessions - run.matched),
+           (unsigned long long)run.verdict_mismatches, (unsigned long long)run.correct_mismatches,
+           (unsigned long long)run.end_mismatches, (unsigned long long)run.errors);
+    if (run.late > 0) {
+        // Sessions then start in bursts, which the server's listen backlog may not hold
+        printf("Started late: %llu sessions, by up to %.1f ms: the replayer could not keep up\n",
+               (unsigned long long)run.late, run.max_lag / 1e6);
+    }
+    printf("First task as recorded: %llu of %llu lockstep sessions\n", (unsigned long long)run.tasks_identical,
+           (unsigned long long)run.tasks_compared);
+    printf("\n%-10s %10s %10s %10s %10s\n", "Duration", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms");
+    const struct histogram *histograms[2] = {&run.recorded, &run.replayed};
+    const char *names[2] = {"recorded", "replayed"};
+    for (int i = 0; i < 2; i++) {
+        printf("%-10s %10.3f %10.3f %10.3f %10.3f\n", names[i], histogram_percentile(histograms[i], 50.0) / 1e6,
+               histogram_percentile(histograms[i], 90.0) / 1e6, histogram_percentile(histograms[i], 99.0) / 1e6,
+               histogram_percentile(histograms[i], 99.9) / 1e6);
+    }
+
+    if (resolved != NULL) {
+        freeaddrinfo(resolved);
+    }
+    free(records);
+    munmap((void*)header, journal_size);
+    return run.errors > 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,1842 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <atomic>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include "calcLib.h"
+#include "binaryProtocol.h"
+#include "taskPool.h"
+#include "ioRing.h"
+#include "serverLog.h"
+#include "serverMetrics.h"
+#include "shmTransport.h"
+#include "serverEngine.h"
+
+// What an io_uring completion is for; kept in the low bits of the session pointer in user_data
+enum ring_op {
+    OP_ACCEPT,     // Multishot accept on the listener, no session
+    OP_RECV,       // Multishot recv of a session
+    OP_SEND,       // Send of a session's pending output
+    OP_NOTICE,     // Send of a session's closing notice
+    OP_IGNORE      // Cancel and close at the end of a session, nothing to do
+};
+#define RING_OP_MASK 7
+
+// Set in the epoll data of a session's shared-memory doorbell, to tell it from the socket
+#define DOORBELL_TAG 1
+
+// Sessions open over all event loops, counted while server_config.max_sessions is set
+static std::atomic<unsigned> open_sessions;
+
+/**
+ * State shared by all sessions of one event loop.
+ */
+struct event_loop {
+    int epoll_fd;
+    struct io_ring *ring;        // Non-NULL when the loop runs on io_uring instead of epoll
+    int listen_socket;
+    const struct server_config *config;
+
+    // Clock read once per loop iteration, and the session deadlines
+    long long now_ms;
+    long long now_ns;
+    struct timer_wheel timers;
+
+    // Prepared tasks, NULL if tasks are drawn on the loop itself; then they come in
+    // batches from local_tasks
+    struct task_pool *pool;
+    calc_task_batch_t local_tasks;
+    size_t local_next;
+
+    // Results received in this iteration, checked together in check_results()
+    calc_op_t check_op[CHECK_BATCH_SIZE];
+    calc_value_t check_expected[CHECK_BATCH_SIZE];
+    calc_value_t check_client[CHECK_BATCH_SIZE];
+    unsigned char check_correct[CHECK_BATCH_SIZE];
+    struct pending_task *check_task[CHECK_BATCH_SIZE];
+    size_t check_count;
+
+    struct session *dirty;       // Sessions to pump and flush after the check
+    struct session *closed;      // Sessions to free at the end of the iteration
+
+    struct session *shm_sessions; // Sessions on the shared-memory transport
+    unsigned shm_idle;           // Loop iterations since one of them made progress
+    unsigned shm_spin_rounds;    // Idle iterations before sleeping, SHM_SPIN_ROUNDS with more than one CPU
+
+    // Sessions, their cold parts and the buffers they grow into (see slabPool.h)
+    struct slab_pool sessions;
+    struct slab_pool colds;
+    struct buffer_pool buffers;
+
+    // Sessions with a deadline, the one idle the longest first
+    struct session *idle_head;
+    struct session *idle_tail;
+
+    // Timeout of every stage (metric_timeout), and with adaptive timeouts the latencies seen
+    // since they were last adapted
+    unsigned timeout_ms[TIMEOUT_COUNT];
+    struct histogram recent_handshakes;
+    struct histogram recent_tasks;
+    long long adapted_ms;
+
+    struct server_metrics metrics;
+};
+
+/**
+ * Get the readable IP address from a sockaddr structure (IPv4 or IPv6).
+ */
+static void *extract_ip_address(struct sockaddr *addr) {
+    if (addr->sa_family == AF_INET) { // IPv4
+        return &(((struct sockaddr_in*)addr)->sin_addr);
+    } else { // IPv6
+        return &(((struct sockaddr_in6*)addr)->sin6_addr);
+    }
+}
+
+/**
+ * Current time in nanoseconds from a monotonic clock.
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long long now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+/**
+ * Read the clock for a new loop iteration.
+ */
+static void loop_clock(struct event_loop *loop) {
+    loop->now_ns = now_ns();
+    loop->now_ms = loop->now_ns / 1000000;
+}
+
+/**
+ * Take one of the server_config.max_sessions places for a new session.
+ *
+ * @return: true if the session may start, false if the server is full.
+ */
+static bool session_admit(struct event_loop *loop) {
+    unsigned limit = loop->config->max_sessions;
+    if (limit == 0) {
+        return true;
+    }
+    if (open_sessions.fetch_add(1, std::memory_order_relaxed) < limit) {
+        return true;
+    }
+    open_sessions.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+}
+
+/**
+ * Give back the place session_admit() took.
+ */
+static void session_leave(struct event_loop *loop) {
+    if (loop->config->max_sessions != 0) {
+        open_sessions.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Stage of a session's current state, for its timeout.
+ */
+static enum metric_timeout session_stage(const struct session *s) {
+    if (s->state == SENT_PROTOCOL || s->state == WAIT_OK) {
+        return TIMEOUT_HANDSHAKE;
+    }
+    return s->state == WAIT_RESULT ? TIMEOUT_RESULT : TIMEOUT_SEND;
+}
+
+static void idle_remove(struct event_loop *loop, struct session *s) {
+    if (!s->idle) {
+        return;
+    }
+    if (s->idle_prev != NULL) {
+        s->idle_prev->idle_next = s->idle_next;
+    } else {
+        loop->idle_head = s->idle_next;
+    }
+    if (s->idle_next != NULL) {
+        s->idle_next->idle_prev = s->idle_prev;
+    } else {
+        loop->idle_tail = s->idle_prev;
+    }
+    s->idle = 0;
+}
+
+/**
+ * Disarm the deadline of a session, if it has one.
+ */
+static void timer_cancel(struct event_loop *loop, struct session *s) {
+    timer_wheel_cancel(&loop->timers, &s->timer);
+    idle_remove(loop, s);
+}
+
+/**
+ * (Re)start the countdown of a session for the stage of its current state, and move it to
+ * the end of the idle list.
+ */
+static void timer_arm(struct event_loop *loop, struct session *s) {
+    timer_wheel_arm(&loop->timers, &s->timer, loop->now_ms + loop->timeout_ms[session_stage(s)]);
+    idle_remove(loop, s);
+    s->idle_prev = loop->idle_tail;
+    s->idle_next = NULL;
+    if (loop->idle_tail != NULL) {
+        loop->idle_tail->idle_next = s;
+    } else {
+        loop->idle_head = s;
+    }
+    loop->idle_tail = s;
+    s->idle = 1;
+    s->idle_since_ms = (uint32_t)loop->now_ms;
+}
+
+/**
+ * Set the timeout of a stage from the latencies seen since it was last set: ADAPT_FACTOR
+ * times their ADAPT_PERCENTILE, within ADAPT_MIN_MS and limit_ms. A stage with fewer than
+ * ADAPT_MIN_SAMPLES new latencies keeps its timeout and goes on collecting.
+ */
+static void adapt_timeout(struct event_loop *loop, enum metric_timeout stage, struct histogram *recent, unsigned limit_ms) {
+    if (recent->total < ADAPT_MIN_SAMPLES) {
+        return;
+    }
+    uint64_t timeout_ms = histogram_percentile(recent, ADAPT_PERCENTILE) * ADAPT_FACTOR / 1000000;
+    if (timeout_ms < ADAPT_MIN_MS) {
+        timeout_ms = ADAPT_MIN_MS;
+    }
+    if (timeout_ms > limit_ms) {
+        timeout_ms = limit_ms;
+    }
+    loop->timeout_ms[stage] = (unsigned)timeout_ms;
+    metrics_set(&loop->metrics.timeout_ms[stage], timeout_ms);
+    histogram_init(recent);
+}
+
+/**
+ * Adapt the handshake and result timeouts once every ADAPT_INTERVAL_MS, if enabled.
+ */
+static void adapt_timeouts(struct event_loop *loop) {
+    const struct server_config *config = loop->config;
+    if (!config->adaptive_timeouts || loop->now_ms - loop->adapted_ms < ADAPT_INTERVAL_MS) {
+        return;
+    }
+    loop->adapted_ms = loop->now_ms;
+    adapt_timeout(loop, TIMEOUT_HANDSHAKE, &loop->recent_handshakes, config->handshake_timeout_ms);
+    adapt_timeout(loop, TIMEOUT_RESULT, &loop->recent_tasks, config->result_timeout_ms);
+}
+
+/**
+ * Log an event of a session, if the session is sampled and the level enabled.
+ */
+static inline void session_log(const struct session *s, enum log_level level, enum log_event event,
+                               uint32_t arg0, uint32_t arg1, const char *text, size_t text_length) {
+    if (s->logged && log_enabled(level)) {
+        log_write(level, event, arg0, arg1, text, text_length);
+    }
+}
+
+/**
+ * Log an event with the client's address as its text, if the session is sampled and
+ * LOG_INFO enabled. Such sessions have their address in their cold part.
+ */
+static inline void session_log_peer(const struct session *s, enum log_event event, uint32_t arg0, uint32_t arg1) {
+    if (s->logged && log_enabled(LOG_INFO) && s->cold != NULL) {
+        log_write(LOG_INFO, event, arg0, arg1, s->cold->client_ip, strlen(s->cold->client_ip));
+    }
+}
+
+/**
+ * Microseconds since the session was accepted, for its trace record.
+ */
+static inline uint32_t trace_time(const struct event_loop *loop, const struct session *s) {
+    return (uint32_t)((loop->now_ns - s->started_ns) / 1000);
+}
+
+/**
+ * Start the trace record of a new session.
+ */
+static void trace_start(struct session *s, const struct sockaddr_storage *client_addr) {
+    struct trace_record *t = &s->cold->trace;
+    t->accepted_ns = s->started_ns;
+    t->negotiated_us = t->first_task_us = t->first_result_us = t->last_result_us = TRACE_NEVER;
+    t->verdict = TRACE_NO_VERDICT;
+    t->family = (uint8_t)client_addr->ss_family;
+    if (client_addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in*)client_addr;
+        memcpy(t->address, &in->sin_addr, sizeof(in->sin_addr));
+        t->port = ntohs(in->sin_port);
+    } else if (client_addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*)client_addr;
+        memcpy(t->address, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        t->port = ntohs(in6->sin6_port);
+    }
+}
+
+/**
+ * Record how the session ends, if it is traced.
+ */
+static inline void trace_set_end(struct session *s, enum trace_end end) {
+    if (trace_active) {
+        s->cold->trace.end = (uint8_t)end;
+    }
+}
+
+/**
+ * Queue an io_uring operation on behalf of a session.
+ */
+static struct io_uring_sqe *ring_sqe(struct event_loop *loop, struct session *s, enum ring_op op) {
+    struct io_uring_sqe *sqe = io_ring_get_sqe(loop->ring);
+    if (sqe != NULL) {
+        sqe->user_data = (uint64_t)(uintptr_t)s | op;
+    }
+    return sqe;
+}
+
+/**
+ * Turn a queued operation into a no-op that keeps its user data and link.
+ */
+static void ring_make_nop(struct io_uring_sqe *sqe) {
+    uint64_t user_data = sqe->user_data;
+    uint8_t flags = sqe->flags;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    sqe->flags = flags;
+    sqe->user_data = user_data;
+}
+
+/**
+ * Send the session's notice (if any), cancel whatever the session still has in flight and
+ * close the socket, as one chain of linked operations. Hard links keep the chain going
+ * when a step fails, e.g. when there was nothing to cancel.
+ */
+static void ring_close_session(struct event_loop *loop, struct session *s, size_t notice_length) {
+    struct io_uring_sqe *notice = NULL;
+    if (notice_length > 0 && (notice = ring_sqe(loop, s, OP_NOTICE)) != NULL) {
+        notice->opcode = IORING_OP_SEND;
+        notice->fd = s->fd;
+        notice->addr = (uint64_t)(uintptr_t)s->cold->notice;
+        notice->len = (uint32_t)notice_length;
+        notice->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT; // Like the epoll path: no waiting for a stuck client
+        notice->flags = IOSQE_IO_HARDLINK;
+        s->notifying = 1;
+    }
+    struct io_uring_sqe *cancel = ring_sqe(loop, NULL, OP_IGNORE);
+    if (cancel != NULL) {
+        cancel->opcode = IORING_OP_ASYNC_CANCEL;
+        cancel->fd = s->fd;
+        cancel->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        cancel->flags = IOSQE_IO_HARDLINK;
+    }
+    struct io_uring_sqe *sqe;
+    if (cancel != NULL && (sqe = ring_sqe(loop, NULL, OP_IGNORE)) != NULL) {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = s->fd;
+        return;
+    }
+    // The ring is unusable: close right here. What was queued of the chain becomes a no-op, as
+    // the descriptor may belong to a new connection by the time it runs. The shutdown ends the
+    // receive and send still in flight, and their completions free the session.
+    if (notice != NULL) {
+        ring_make_nop(notice);
+    }
+    if (cancel != NULL) {
+        ring_make_nop(cancel);
+    }
+    shutdown(s->fd, SHUT_RDWR);
+    close(s->fd);
+}
+
+/**
+ * Tell the client the session is over and give up the shared memory of a session.
+ */
+static void session_shm_release(struct event_loop *loop, struct session *s) {
+    s->shm->server_closed.store(1, std::memory_order_release);
+    struct session_cold *c = s->cold;
+    shm_ring_doorbell(c->shm_peer_doorbell);
+    shm_channel_unmap(s->shm);
+    s->shm = NULL;
+    // The client still holds the doorbell, so closing ours would not take it out of the epoll
+    // set: its later rings would reach this session after it is freed. Shared memory is only
+    // offered on epoll, there is no io_uring poll to cancel.
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, c->shm_doorbell, NULL);
+    close(c->shm_doorbell);
+    close(c->shm_peer_doorbell);
+
+    if (c->shm_prev != NULL) {
+        c->shm_prev->cold->shm_next = c->shm_next;
+    } else {
+        loop->shm_sessions = c->shm_next;
+    }
+    if (c->shm_next != NULL) {
+        c->shm_next->cold->shm_prev = c->shm_prev;
+    }
+}
+
+/**
+ * Close the client connection. The session itself is released at the end of the loop
+ * iteration, as results of it may still be waiting in the check batch.
+ *
+ * @param notice_length: Bytes of the cold part's notice to send first, on io_uring.
+ */
+static void session_close_with(struct event_loop *loop, struct session *s, size_t notice_length) {
+    if (s->closed) {
+        return;
+    }
+    timer_cancel(loop, s);
+    if (trace_active) {
+        s->cold->trace.closed_us = trace_time(loop, s);
+        s->cold->trace.tasks = s->tasks_done;
+        trace_append(&s->cold->trace);
+    }
+    metrics_add(&loop->metrics.sessions_closed, 1);
+    metrics_latency(&loop->metrics, PHASE_SESSION, loop->now_ns - s->started_ns);
+    session_leave(loop);
+    if (s->shm != NULL) {
+        session_shm_release(loop, s);
+    }
+    if (loop->ring != NULL) {
+        ring_close_session(loop, s, notice_length);
+    } else {
+        close(s->fd); // Also removes the socket from the epoll set
+    }
+    s->closed = 1;
+    s->next_closed = loop->closed;
+    loop->closed = s;
+}
+
+static void session_close(struct event_loop *loop, struct session *s) {
+    session_close_with(loop, s, 0);
+}
+
+/**
+ * Wait for input unless the session is finishing, and for writability while output is pending.
+ * Only talks to epoll when the wanted set changes.
+ */
+static int session_update_events(struct event_loop *loop, struct session *s) {
+    uint32_t wanted = (s->state == DONE) ? 0 : EPOLLIN;
+    if (s->out_sent < s->out_len && s->shm == NULL) { // The loop polls for room in a shared-memory ring
+        wanted |= EPOLLOUT;
+    }
+    if (wanted == s->events) {
+        return 0;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = wanted;
+    ev.data.ptr = s;
+    s->events = wanted;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+/**
+ * Append a message to the pending output of a session.
+ */
+static void session_queue(struct session *s, const char *message, size_t length) {
+    memcpy(s->out + s->out_len, message, length);
+    s->out_len += length;
+}
+
+/**
+ * Bytes that can still be appended to the pending output. Moves the output from the inline
+ * buffer to a pooled one when less than MAX_LINE is left.
+ */
+static size_t session_room(struct event_loop *loop, struct session *s) {
+    if (s->out_sent > 0 && !s->sending) {
+        // Move the unsent tail to the front to make room at the end
+        memmove(s->out, s->out + s->out_sent, s->out_len - s->out_sent);
+        s->out_len -= s->out_sent;
+        s->out_sent = 0;
+    }
+    if (OUT_INLINE_SIZE - s->out_len < MAX_LINE && s->out == s->out_inline && !s->sending) {
+        char *out = (char*)buffer_alloc(&loop->buffers, OUT_BUFFER_SIZE);
+        if (out != NULL) {
+            memcpy(out, s->out, s->out_len);
+            s->out = out;
+        }
+    }
+    return (s->out == s->out_inline ? OUT_INLINE_SIZE : OUT_BUFFER_SIZE) - s->out_len;
+}
+
+/**
+ * Give a drained pooled output buffer back, the next output starts inline again.
+ */
+static void session_shrink_output(struct event_loop *loop, struct session *s) {
+    if (s->out != s->out_inline && s->out_len == s->out_sent && !s->sending) {
+        buffer_free(&loop->buffers, s->out, OUT_BUFFER_SIZE);
+        s->out = s->out_inline;
+    }
+}
+
+/**
+ * Append a binary frame to the pending output of a session.
+ */
+static void session_queue_frame(struct session *s, uint8_t opcode, uint8_t width, uint16_t flags, uint32_t seq,
+                                 union binary_value a, union binary_value b) {
+    struct binary_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.opcode = opcode;
+    frame.width = width;
+    frame.flags = flags;
+    frame.seq = seq;
+    frame.a = a;
+    frame.b = b;
+    session_queue(s, (const char*)&frame, sizeof(frame));
+}
+
+/**
+ * Take the next prepared task: from the pool if it has one, else from a batch drawn here.
+ */
+static const struct prepared_task *next_task(struct event_loop *loop, struct prepared_task *local) {
+    if (loop->pool != NULL) {
+        const struct prepared_task *task = task_pool_front(loop->pool);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    if (loop->local_next == CALC_BATCH_SIZE) {
+        randomTaskBatch(&loop->local_tasks, CALC_BATCH_SIZE);
+        loop->local_next = 0;
+    }
+    task_prepare(local, &loop->local_tasks, loop->local_next++);
+    return local;
+}
+
+/**
+ * Hand the next prepared task to the client.
+ */
+static void session_queue_task(struct event_loop *loop, struct session *s) {
+    struct pending_task *t = &s->tasks[s->next_seq & s->task_mask];
+    struct prepared_task local;
+    const struct prepared_task *task = next_task(loop, &local);
+
+    t->op = task->op;
+    t->expected = task->expected;
+    t->answered = 0;
+    t->checked = 0;
+    t->logged = s->logged;
+    t->sent_ns = loop->now_ns;
+    if (trace_active && s->tasks_issued == 0) {
+        struct trace_record *trace = &s->cold->trace;
+        trace->first_task_us = trace_time(loop, s);
+        trace->op = (uint8_t)task->op;
+        trace->a = task->a;
+        trace->b = task->b;
+    }
+
+    if (s->protocol == BINARY_TCP_1_0) {
+        struct binary_frame frame = task->frame;
+        frame.seq = s->next_seq;
+        session_queue(s, (const char*)&frame, sizeof(frame));
+        session_log(s, LOG_DEBUG, LOG_TASK_SENT, s->next_seq, 1, task->text, task->text_length);
+    } else {
+        // "[seq ]op a b\n"
+        char *line = s->out + s->out_len;
+        size_t length = 0;
+        if (s->tagged) {
+            length += format_uint32(line, s->next_seq);
+            line[length++] = ' ';
+        }
+        memcpy(line + length, task->text, task->text_length);
+        length += task->text_length;
+        session_log(s, LOG_DEBUG, LOG_TASK_SENT, 0, 0, line, length);
+        s->out_len += length;
+    }
+
+    if (task != &local) {
+        task_pool_pop(loop->pool);
+    }
+    s->next_seq++;
+    s->tasks_issued++;
+    s->state = SENT_TASK;
+}
+
+/**
+ * Check every result in the batch, and remember the verdicts until it is their turn.
+ */
+static void check_results(struct event_loop *loop) {
+    calcCheckBatch(loop->check_op, loop->check_expected, loop->check_client, loop->check_correct,
+                   loop->check_count, FLOAT_PRECISION);
+
+    for (size_t i = 0; i < loop->check_count; i++) {
+        struct pending_task *t = loop->check_task[i];
+        t->correct = loop->check_correct[i];
+        t->checked = 1;
+        metrics_add(&loop->metrics.results[t->op][t->correct], 1);
+        if (t->logged && log_enabled(LOG_DEBUG)) {
+            log_write(LOG_DEBUG, LOG_RESULT, t->correct, calcOpIsFloat(t->op), NULL, 0);
+        }
+    }
+    loop->check_count = 0;
+}
+
+/**
+ * Add the client's result for task seq to the batch checked at the end of the loop iteration.
+ */
+static void session_check_result(struct event_loop *loop, struct session *s, uint32_t seq, struct pending_task *t,
+                                 calc_value_t client_result) {
+    if (loop->check_count == CHECK_BATCH_SIZE) {
+        check_results(loop);
+    }
+    size_t i = loop->check_count++;
+    loop->check_op[i] = t->op;
+    loop->check_expected[i] = t->expected;
+    loop->check_client[i] = client_result;
+    loop->check_task[i] = t;
+    t->answered = 1;
+    metrics_latency(&loop->metrics, PHASE_TASK, loop->now_ns - t->sent_ns);
+    if (loop->config->adaptive_timeouts) {
+        histogram_record(&loop->recent_tasks, loop->now_ns - t->sent_ns);
+    }
+    if (trace_active) {
+        struct trace_record *trace = &s->cold->trace;
+        trace->last_result_us = trace_time(loop, s);
+        if (seq == 0) {
+            trace->first_result_us = trace->last_result_us;
+            trace->answer = client_result;
+        }
+    }
+}
+
+/**
+ * Queue the verdicts that are ready, in task order, then top the window up with new tasks.
+ * Stops early when the output buffer is full; it is called again once the buffer drains.
+ */
+static void session_pump(struct event_loop *loop, struct session *s) {
+    while (s->head_seq != s->next_seq && session_room(loop, s) >= MAX_LINE) {
+        struct pending_task *t = &s->tasks[s->head_seq & s->task_mask];
+        if (!t->checked) {
+            break;
+        }
+        if (trace_active) {
+            s->cold->trace.correct += t->correct;
+            if (s->head_seq == 0) {
+                s->cold->trace.verdict = t->correct;
+            }
+        }
+        if (s->protocol == BINARY_TCP_1_0) {
+            union binary_value none;
+            memset(&none, 0, sizeof(none));
+            session_queue_frame(s, BINARY_VERDICT, 0, t->correct ? BINARY_CORRECT : 0, s->head_seq, none, none);
+        } else {
+            // "[seq ]OK\n" or "[seq ]ERROR\n", within the MAX_LINE of room the loop checked for
+            static_assert(MAX_LINE >= 10 + 1 + 6, "a tagged verdict must fit in MAX_LINE");
+            if (s->tagged) {
+                s->out_len += format_uint32(s->out + s->out_len, s->head_seq);
+                session_queue(s, " ", 1);
+            }
+            if (t->correct) {
+                session_queue(s, "OK\n", 3);
+            } else {
+                session_queue(s, "ERROR\n", 6);
+            }
+        }
+        s->head_seq++;
+        s->tasks_done++;
+    }
+
+    while (s->next_seq - s->head_seq < s->window
+           && (s->max_tasks == 0 || s->tasks_issued < s->max_tasks)
+           && session_room(loop, s) >= MAX_LINE) {
+        session_queue_task(loop, s);
+    }
+
+    if (s->head_seq == s->next_seq && s->max_tasks != 0 && s->tasks_issued >= s->max_tasks) {
+        s->state = DONE; // Every task has its verdict queued
+    }
+}
+
+/**
+ * Advance the state machine once all pending output is sent.
+ *
+ * @return: 1 if the pump queued more output, 0 if the session waits for the client, -1 if
+ *          it was closed.
+ */
+static int session_sent(struct event_loop *loop, struct session *s) {
+    s->out_len = s->out_sent = 0;
+    session_shrink_output(loop, s);
+    if (s->state == SENT_PROTOCOL) {
+        s->state = WAIT_OK;
+    } else if (s->state == SENT_TASK) {
+        s->state = WAIT_RESULT;
+        session_pump(loop, s); // The drained buffer may have room for more of the window
+        if (s->out_len > 0) {
+            return 1;
+        }
+    } else if (s->state == DONE) {
+        trace_set_end(s, TRACE_END_DONE);
+        session_close(loop, s); // Close client connection
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * io_uring version of session_flush(): start a send of the pending output unless one is in
+ * flight already. Its completion (ring_on_sent()) goes on from there.
+ */
+static int session_flush_ring(struct event_loop *loop, struct session *s) {
+    while (!s->sending) {
+        if (s->out_sent < s->out_len) {
+            struct io_uring_sqe *sqe = ring_sqe(loop, s, OP_SEND);
+            if (sqe == NULL) {
+                session_close(loop, s);
+                return -1;
+            }
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = s->fd;
+            sqe->addr = (uint64_t)(uintptr_t)(s->out + s->out_sent);
+            sqe->len = (uint32_t)(s->out_len - s->out_sent);
+            sqe->msg_flags = MSG_NOSIGNAL;
+            s->sending = 1;
+            break;
+        }
+        int rv = session_sent(loop, s);
+        if (rv == -1) {
+            return -1;
+        }
+        if (rv == 0) {
+            timer_arm(loop, s);
+            return 0;
+        }
+    }
+    if (!timer_wheel_armed(&s->timer)) {
+        timer_arm(loop, s); // A client that stops reading is dropped like a silent one
+    }
+    return 0;
+}
+
+/**
+ * send() to the client, or into its ring on the shared-memory transport.
+ */
+static ssize_t session_send(struct session *s, const char *data, size_t length) {
+    if (s->shm == NULL) {
+        return send(s->fd, data, length, MSG_NOSIGNAL);
+    }
+    size_t written = shm_ring_write(&s->shm->to_client, data, length);
+    if (written == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    shm_wake(&s->shm->client_sleeping, s->cold->shm_peer_doorbell);
+    return written;
+}
+
+/**
+ * Write as much pending output as the socket accepts, and advance the state machine once
+ * everything is sent.
+ *
+ * @return: 0 if the session is still alive, -1 if it was closed.
+ */
+static int session_flush(struct event_loop *loop, struct session *s) {
+    if (loop->ring != NULL) {
+        return session_flush_ring(loop, s);
+    }
+    while (1) {
+        while (s->out_sent < s->out_len) {
+            ssize_t sent = session_send(s, s->out + s->out_sent, s->out_len - s->out_sent);
+            if (sent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break; // Socket buffer full, continue once it is writable
+                }
+                perror(s->state == SENT_PROTOCOL ? "Failed to send protocol message" : "Failed to send to client");
+                session_close(loop, s);
+                return -1;
+            }
+            s->out_sent += sent;
+            metrics_add(&loop->metrics.bytes_sent, sent);
+        }
+
+        if (s->out_sent < s->out_len) {
+            if (!timer_wheel_armed(&s->timer)) {
+                timer_arm(loop, s); // A client that stops reading is dropped like a silent one
+            }
+            if (session_update_events(loop, s) == -1) {
+                session_close(loop, s);
+                return -1;
+            }
+            return 0;
+        }
+
+        int rv = session_sent(loop, s);
+        if (rv == -1) {
+            return -1;
+        }
+        if (rv == 0) {
+            break;
+        }
+    }
+
+    timer_arm(loop, s);
+    if (session_update_events(loop, s) == -1) {
+        session_close(loop, s);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compare a received line with a message such as "OK\n".
+ */
+static bool line_equals(const char *line, size_t length, const char *message) {
+    return length == strlen(message) && memcmp(line, message, length) == 0;
+}
+
+/**
+ * Check that a line starts with prefix, and point *rest just past it.
+ */
+static bool line_starts_with(const char *line, size_t length, const char *prefix, const char **rest) {
+    size_t prefix_length = strlen(prefix);
+    if (length < prefix_length || memcmp(line, prefix, prefix_length) != 0) {
+        return false;
+    }
+    *rest = line + prefix_length;
+    return true;
+}
+
+/**
+ * Give a session its cold part, if it has none yet.
+ *
+ * @return: 0 on success, -1 if the pool is out of memory.
+ */
+static int session_make_cold(struct event_loop *loop, struct session *s) {
+    if (s->cold == NULL) {
+        s->cold = (struct session_cold*)slab_alloc(&loop->colds);
+        if (s->cold == NULL) {
+            return -1;
+        }
+        memset((void*)s->cold, 0, sizeof(*s->cold));
+    }
+    return 0;
+}
+
+/**
+ * Answer SHM_REQUEST: move the session to the shared-memory transport if it came in on a
+ * Unix socket and the loop runs on epoll, decline otherwise.
+ *
+ * @return: 0 if the session is still alive, -1 if it was closed.
+ */
+static int session_share_memory(struct event_loop *loop, struct session *s) {
+    int fds[SHM_FD_COUNT];
+    struct shm_channel *channel = NULL;
+    if (s->local && loop->ring == NULL && s->shm == NULL && s->out_sent == s->out_len
+        && session_make_cold(loop, s) == 0) {
+        channel = shm_channel_create(fds);
+    }
+    if (channel == NULL) {
+        session_log_peer(s, LOG_SHARED_MEMORY, 0, 0);
+        session_queue(s, SHM_DECLINE, strlen(SHM_DECLINE));
+        return 0;
+    }
+
+    // Nothing else is pending on the socket, so the answer and its descriptors go straight out
+    struct session_cold *c = s->cold;
+    ssize_t sent = shm_send_fds(s->fd, SHM_ACCEPT, strlen(SHM_ACCEPT), fds);
+    close(fds[SHM_FD_MEMORY]); // The mapping keeps the memory
+    s->shm = channel;
+    c->shm_doorbell = fds[SHM_FD_SERVER_DOORBELL];
+    c->shm_peer_doorbell = fds[SHM_FD_CLIENT_DOORBELL];
+    c->shm_prev = NULL;
+    c->shm_next = loop->shm_sessions;
+    if (loop->shm_sessions != NULL) {
+        loop->shm_sessions->cold->shm_prev = s;
+    }
+    loop->shm_sessions = s;
+    loop->shm_idle = 0;
+    c->trace.shm = 1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = (void*)((uintptr_t)s | DOORBELL_TAG);
+    if (sent != (ssize_t)strlen(SHM_ACCEPT) || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, c->shm_doorbell, &ev) == -1) {
+        perror("Failed to hand shared memory to client");
+        session_close(loop, s);
+        return -1;
+    }
+    metrics_add(&loop->metrics.bytes_sent, sent);
+    session_log_peer(s, LOG_SHARED_MEMORY, 1, 0);
+    return 0;
+}
+
+/**
+ * Give the session its task window: a power of two of at least window entries.
+ *
+ * @return: 0 on success, -1 if the pool is out of memory.
+ */
+static int session_alloc_tasks(struct event_loop *loop, struct session *s) {
+    uint32_t size = 1;
+    while (size < s->window) {
+        size <<= 1;
+    }
+    s->tasks = (struct pending_task*)buffer_alloc(&loop->buffers, size * sizeof(struct pending_task));
+    if (s->tasks == NULL) {
+        return -1;
+    }
+    s->task_mask = size - 1;
+    return 0;
+}
+
+/**
+ * Handle the client's reply to PROTOCOL_MESSAGE, which picks the protocol.
+ *
+ * @return: 0 if the session is still alive, -1 if it was closed.
+ */
+static int session_negotiate(struct event_loop *loop, struct session *s, const char *line, size_t length) {
+    const char *end = line + length;
+    const char *rest;
+    uint32_t window = 0;
+
+    if (line_equals(line, length, SHM_REQUEST)) {
+        return session_share_memory(loop, s); // The protocol reply follows
+    }
+
+    s->window = 1;
+    if (line_equals(line, length, "OK\n")) {
+        s->protocol = TEXT_TCP_1_0;
+        s->max_tasks = 1;
+    } else if (line_equals(line, length, PERSISTENT_REQUEST)) {
+        s->protocol = TEXT_TCP_1_1;
+        s->max_tasks = loop->config->max_tasks;
+        session_log_peer(s, LOG_NEGOTIATED, TEXT_TCP_1_1, 0);
+    } else if (line_starts_with(line, length, BINARY_REQUEST, &rest)
+               && (rest == end - 1 || (*rest == ' ' && parse_uint32(&rest, end, &window) && rest == end - 1 && window > 0))) {
+        s->protocol = BINARY_TCP_1_0;
+        s->max_tasks = loop->config->max_tasks;
+        s->tagged = 1;
+        if (window > 0) {
+            s->window = window < loop->config->max_window ? window : loop->config->max_window;
+        }
+        session_log_peer(s, LOG_NEGOTIATED, BINARY_TCP_1_0, s->window);
+    } else if (line_starts_with(line, length, "TEXT TCP 1.1 ", &rest)
+               && parse_uint32(&rest, end, &window) && rest == end - 1 && window > 0) {
+        s->protocol = TEXT_TCP_1_1;
+        s->max_tasks = loop->config->max_tasks;
+        s->tagged = 1;
+        s->window = window < loop->config->max_window ? window : loop->config->max_window;
+        session_log_peer(s, LOG_NEGOTIATED, TEXT_TCP_1_1, s->window);
+    } else {
+        session_log(s, LOG_ERROR, LOG_INVALID_RESPONSE, 0, 0, line, length);
+        metrics_add(&loop->metrics.handshake_failures, 1);
+        session_close(loop, s);
+        return -1;
+    }
+
+    if (session_alloc_tasks(loop, s) == -1) {
+        fprintf(stderr, "Failed to allocate the task window of a session\n");
+        session_close(loop, s);
+        return -1;
+    }
+
+    metrics_latency(&loop->metrics, PHASE_HANDSHAKE, loop->now_ns - s->started_ns);
+    if (loop->config->adaptive_timeouts) {
+        histogram_record(&loop->recent_handshakes, loop->now_ns - s->started_ns);
+    }
+    if (trace_active) {
+        struct trace_record *trace = &s->cold->trace;
+        trace->negotiated_us = trace_time(loop, s);
+        trace->protocol = (uint8_t)s->protocol;
+        trace->tagged = s->tagged;
+        trace->window = (uint8_t)s->window;
+    }
+    session_pump(loop, s);
+    return 0;
+}
+
+/**
+ * Find the outstanding task a result refers to.
+ *
+ * @return: The task, or NULL if seq is not outstanding or already has a result.
+ */
+static struct pending_task *session_find_task(struct session *s, uint32_t seq) {
+    struct pending_task *t = &s->tasks[seq & s->task_mask];
+    if (seq - s->head_seq >= s->next_seq - s->head_seq || t->answered) {
+        return NULL;
+    }
+    return t;
+}
+
+/**
+ * Handle one result line, or QUIT_MESSAGE on a persistent session.
+ *
+ * @return: 0 if the session is still alive, -1 if it was closed.
+ */
+static int session_on_result(struct event_loop *loop, struct session *s, const char *line, size_t length) {
+    const char *end = line + length;
+
+    if (s->protocol == TEXT_TCP_1_1 && line_equals(line, length, QUIT_MESSAGE)) {
+        session_log(s, LOG_INFO, LOG_SESSION_ENDED, s->tasks_done, 0, NULL, 0);
+        trace_set_end(s, TRACE_END_QUIT);
+        session_close(loop, s);
+        return -1;
+    }
+
+    uint32_t seq = s->head_seq;
+    struct pending_task *t = NULL;
+    if (!s->tagged || parse_uint32(&line, end, &seq)) {
+        t = session_find_task(s, seq);
+    }
+    if (t == NULL) {
+        session_log(s, LOG_ERROR, LOG_UNEXPECTED_RESULT, 0, 0, line, end - line);
+        session_close(loop, s);
+        return -1;
+    }
+
+    // Like sscanf(), an unparsable result counts as 0
+    calc_value_t client_result;
+    if (calcOps[t->op].is_float) {
+        client_result.f = 0.0;
+        parse_double(&line, end, &client_result.f);
+    } else {
+        client_result.i = 0;
+        parse_int(&line, end, &client_result.i);
+    }
+    session_check_result(loop, s, seq, t, client_result);
+    return 0;
+}
+
+/**
+ * Handle one frame of a BINARY TCP 1.0 session.
+ *
+ * @return: 0 if the session is still alive, -1 if it was closed.
+ */
+static int session_on_frame(struct event_loop *loop, struct session *s, const struct binary_frame *frame) {
+    if (frame->opcode == BINARY_QUIT) {
+        session_log(s, LOG_INFO, LOG_SESSION_ENDED, s->tasks_done, 0, NULL, 0);
+        trace_set_end(s, TRACE_END_QUIT);
+        session_close(loop, s);
+        return -1;
+    }
+
+    struct pending_task *t = session_find_task(s, frame->seq);
+    if (frame->opcode != BINARY_RESULT || t == NULL) {
+        session_log(s, LOG_ERROR, LOG_UNEXPECTED_FRAME, frame->opcode, frame->seq, NULL, 0);
+        session_close(loop, s);
+        return -1;
+    }
+
+    calc_value_t client_result;
+    if (calcOps[t->op].is_float) {
+        client_result.f = frame->a.f;
+    } else {
+        client_result.i = frame->a.i;
+    }
+    session_check_result(loop, s, frame->seq, t, client_result);
+    return 0;
+}
+
+/**
+ * Verdicts and new tasks wait until the results of this iteration are checked.
+ */
+static void session_mark_dirty(struct event_loop *loop, struct session *s) {
+    if (!s->dirty) {
+        s->dirty = 1;
+        s->next_dirty = loop->dirty;
+        loop->dirty = s;
+    }
+}
+
+/**
+ * Take the unterminated rest of the input as the result of a TEXT TCP 1.0 session, once no
+ * more of it can come: the client shut down its side or the result timeout passed. Until
+ * then a result split over several segments waits for its newline.
+ *
+ * @return: 1 if a result was taken, 0 if there was none, -1 if the session was closed.
+ */
+static int session_take_partial_result(struct event_loop *loop, struct session *s) {
+    const char *rest;
+    size_t rest_length;
+    if (s->protocol != TEXT_TCP_1_0 || s->state != WAIT_RESULT || session_find_task(s, s->head_seq) == NULL
+        || !framer_take_rest(&s->in, &rest, &rest_length)) {
+        return 0;
+    }
+    if (session_on_result(loop, s, rest, rest_length) == -1) {
+        return -1;
+    }
+    session_mark_dirty(loop, s); // The verdict goes out before the session closes
+    return 1;
+}
+
+/**
+ * The client closed the connection (bytes_received 0) or it failed (-1).
+ */
+static void session_on_eof(struct event_loop *loop, struct session *s, int bytes_received) {
+    if (bytes_received == 0 && session_take_partial_result(loop, s) != 0) {
+        return;
+    }
+    if (s->state == SENT_PROTOCOL || s->state == WAIT_OK) {
+        // The reply never got its newline; log what there is of it
+        const char *reply = NULL;
+        size_t reply_length = 0;
+        framer_take_rest(&s->in, &reply, &reply_length);
+        session_log(s, LOG_ERROR, LOG_INVALID_RESPONSE, 0, 0, reply, reply_length);
+        metrics_add(&loop->metrics.handshake_failures, 1);
+    } else if (s->protocol == TEXT_TCP_1_1 && bytes_received == 0) {
+        session_log(s, LOG_INFO, LOG_SESSION_ENDED, s->tasks_done, 0, NULL, 0);
+    } else {
+        session_log(s, LOG_ERROR, LOG_DISCONNECTED, 0, 0, NULL, 0);
+    }
+    trace_set_end(s, TRACE_END_CLOSED);
+    session_close(loop, s);
+}
+
+/**
+ * Move the input of a session from its inline buffer to a pooled one of BUFFER_SIZE.
+ *
+ * @return: 0 on success, -1 if it has one already or the pool is out of memory.
+ */
+static int session_grow_input(struct event_loop *loop, struct session *s) {
+    if (s->in.buffer != s->in_inline) {
+        return -1;
+    }
+    char *buffer = (char*)buffer_alloc(&loop->buffers, BUFFER_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    framer_move(&s->in, buffer, BUFFER_SIZE);
+    return 0;
+}
+
+/**
+ * Handle every complete line or frame in the input framer.
+ *
+ * @return: 0 if the session is still alive, -1 if it was closed.
+ */
+static int session_process_input(struct event_loop *loop, struct session *s) {
+    while (s->state != DONE) {
+        int rv;
+        if (s->protocol == BINARY_TCP_1_0 && s->state != SENT_PROTOCOL && s->state != WAIT_OK) {
+            struct binary_frame frame;
+            if (!framer_read(&s->in, &frame, sizeof(frame))) {
+                break;
+            }
+            rv = session_on_frame(loop, s, &frame);
+        } else {
+            const char *line;
+            size_t length;
+            if (!framer_next_line(&s->in, &line, &length)) {
+                break;
+            }
+            rv = (s->state == SENT_PROTOCOL || s->state == WAIT_OK)
+                ? session_negotiate(loop, s, line, length)
+                : session_on_result(loop, s, line, length);
+        }
+        if (rv == -1) {
+            return -1; // Session closed
+        }
+    }
+
+    if (framer_space(&s->in) == 0 && session_grow_input(loop, s) == -1) {
+        session_log(s, LOG_ERROR, LOG_LINE_TOO_LONG, 0, 0, NULL, 0);
+        session_close(loop, s);
+        return -1;
+    }
+    if (framer_length(&s->in) == 0 && s->in.buffer != s->in_inline && s->window <= 1) {
+        // A lockstep session goes back to waiting with its input drained
+        buffer_free(&loop->buffers, s->in.buffer, BUFFER_SIZE);
+        framer_init(&s->in, s->in_inline, sizeof(s->in_inline));
+    }
+    return 0;
+}
+
+/**
+ * Take what the client put into its shared-memory ring, and move pending output into the
+ * other ring once it has room.
+ *
+ * @return: 1 if anything moved, 0 otherwise.
+ */
+static int session_poll_shm(struct event_loop *loop, struct session *s) {
+    int progress = 0;
+    while (s->state != DONE) {
+        size_t space;
+        char *free_space = framer_write_ptr(&s->in, &space);
+        size_t received = shm_ring_read(&s->shm->to_server, free_space, space);
+        if (received == 0) {
+            break;
+        }
+        framer_commit(&s->in, received);
+        metrics_add(&loop->metrics.bytes_received, received);
+        progress = 1;
+        if (session_process_input(loop, s) == -1) {
+            return 1; // Session closed
+        }
+    }
+
+    if (progress) {
+        shm_wake(&s->shm->client_sleeping, s->cold->shm_peer_doorbell); // It may be waiting for room
+        session_mark_dirty(loop, s);
+    } else if (s->out_sent < s->out_len && !s->dirty && shm_ring_room(&s->shm->to_client) > 0) {
+        session_flush(loop, s);
+        progress = 1;
+    }
+    return progress;
+}
+
+/**
+ * Poll the rings of every shared-memory session.
+ *
+ * @return: 1 if any of them moved data, 0 otherwise.
+ */
+static int poll_shm_sessions(struct event_loop *loop) {
+    int progress = 0;
+    struct session *next;
+    for (struct session *s = loop->shm_sessions; s != NULL; s = next) {
+        next = s->cold->shm_next;
+        progress |= session_poll_shm(loop, s);
+    }
+    return progress;
+}
+
+/**
+ * Ask the clients of the shared-memory sessions to ring their doorbells from now on, unless
+ * one of the rings turns out to have work after all.
+ *
+ * @return: true if the loop may block.
+ */
+static bool shm_sleep(struct event_loop *loop) {
+    for (struct session *s = loop->shm_sessions; s != NULL; s = s->cold->shm_next) {
+        s->shm->server_sleeping.store(1, std::memory_order_seq_cst);
+    }
+    for (struct session *s = loop->shm_sessions; s != NULL; s = s->cold->shm_next) {
+        if ((s->state != DONE && shm_ring_length(&s->shm->to_server) > 0)
+            || (s->out_sent < s->out_len && shm_ring_room(&s->shm->to_client) > 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The loop polls the rings again, the clients need not ring.
+ */
+static void shm_awake(struct event_loop *loop) {
+    for (struct session *s = loop->shm_sessions; s != NULL; s = s->cold->shm_next) {
+        s->shm->server_sleeping.store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Read what the client sent and handle every complete line in it.
+ */
+static void session_on_readable(struct event_loop *loop, struct session *s) {
+    if (s->shm != NULL) {
+        // Only the end of the session still comes over the socket. Whatever the client
+        // put into its ring before is handled first.
+        session_poll_shm(loop, s);
+        if (s->closed) {
+            return;
+        }
+        char byte;
+        ssize_t bytes_received = recv(s->fd, &byte, 1, 0);
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (bytes_received > 0) {
+            session_log(s, LOG_ERROR, LOG_UNEXPECTED_RESULT, 0, 0, &byte, 1);
+            session_close(loop, s);
+            return;
+        }
+        session_on_eof(loop, s, (int)bytes_received);
+        return;
+    }
+
+    size_t space;
+    char *free_space = framer_write_ptr(&s->in, &space);
+    int bytes_received = recv(s->fd, free_space, space, 0);
+    if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+
+    if (bytes_received <= 0) {
+        session_on_eof(loop, s, bytes_received);
+        return;
+    }
+    framer_commit(&s->in, bytes_received);
+    metrics_add(&loop->metrics.bytes_received, bytes_received);
+    if ((size_t)bytes_received == space && s->in.buffer == s->in_inline) {
+        session_grow_input(loop, s); // More is likely waiting, let the next recv() take it at once
+    }
+
+    if (session_process_input(loop, s) == 0) {
+        session_mark_dirty(loop, s);
+    }
+}
+
+/**
+ * Check the results received in this loop iteration, then send the verdicts and the next
+ * tasks of every session that got input.
+ */
+static void finish_reads(struct event_loop *loop) {
+    check_results(loop);
+
+    while (loop->dirty != NULL) {
+        struct session *s = loop->dirty;
+        loop->dirty = s->next_dirty;
+        s->dirty = 0;
+        if (s->closed) {
+            continue;
+        }
+        if (s->state != SENT_PROTOCOL && s->state != WAIT_OK) {
+            session_pump(loop, s);
+        }
+        timer_cancel(loop, s);
+        session_flush(loop, s);
+    }
+}
+
+/**
+ * Return a session and everything it grew to the loop's pools.
+ */
+static void session_free(struct event_loop *loop, struct session *s) {
+    if (s->in.buffer != s->in_inline) {
+        buffer_free(&loop->buffers, s->in.buffer, BUFFER_SIZE);
+    }
+    if (s->out != s->out_inline) {
+        buffer_free(&loop->buffers, s->out, OUT_BUFFER_SIZE);
+    }
+    if (s->tasks != NULL) {
+        buffer_free(&loop->buffers, s->tasks, (s->task_mask + 1) * sizeof(struct pending_task));
+    }
+    if (s->cold != NULL) {
+        slab_free(&loop->colds, s->cold);
+    }
+    slab_free(&loop->sessions, s);
+}
+
+/**
+ * Drop a session that failed to start. Its accept is counted already, so it counts as closed
+ * too, or calc_sessions_active would keep it.
+ */
+static void session_discard(struct event_loop *loop, struct session *s) {
+    metrics_add(&loop->metrics.sessions_closed, 1);
+    close(s->fd);
+    session_leave(loop);
+    session_free(loop, s);
+}
+
+/**
+ * Release the sessions closed in this loop iteration. On io_uring a session that still has
+ * operations in flight is freed by the completion of the last one.
+ */
+static void free_closed(struct event_loop *loop) {
+    while (loop->closed != NULL) {
+        struct session *s = loop->closed;
+        loop->closed = s->next_closed;
+        if (s->receiving || s->sending || s->notifying) {
+            s->released = 1;
+        } else {
+            session_free(loop, s);
+        }
+    }
+}
+
+/**
+ * Tell the client it was too slow and drop it.
+ */
+static void session_on_timeout(struct event_loop *loop, struct session *s) {
+    if (session_take_partial_result(loop, s) != 0) {
+        return;
+    }
+    session_log(s, LOG_ERROR, LOG_TIMEOUT, s->state, 0, NULL, 0);
+    trace_set_end(s, TRACE_END_TIMEOUT);
+    enum metric_timeout stage = session_stage(s);
+    metrics_add(&loop->metrics.timeouts[stage], 1);
+    if (stage == TIMEOUT_HANDSHAKE) {
+        metrics_add(&loop->metrics.handshake_failures, 1);
+    }
+    char notice[sizeof(struct binary_frame)];
+    size_t length;
+    if (s->protocol == BINARY_TCP_1_0 && s->state != SENT_PROTOCOL && s->state != WAIT_OK) {
+        struct binary_frame frame;
+        memset(&frame, 0, sizeof(frame));
+        frame.opcode = BINARY_ERROR;
+        frame.flags = BINARY_ERROR_TIMEOUT;
+        frame.seq = s->head_seq;
+        memcpy(notice, &frame, sizeof(frame)); // The binary "ERROR TO"
+        length = sizeof(frame);
+    } else {
+        memcpy(notice, "ERROR TO\n", 9);
+        length = 9;
+    }
+    if (loop->ring == NULL) {
+        if (session_send(s, notice, length) > 0) {
+            metrics_add(&loop->metrics.bytes_sent, length);
+        }
+    } else if (session_make_cold(loop, s) == 0) {
+        memcpy(s->cold->notice, notice, length); // Must live until the send completes
+    } else {
+        length = 0; // Closed without the notice
+    }
+    session_close_with(loop, s, length); // On io_uring the notice goes out in the closing chain
+}
+
+/**
+ * Under pressure, drop the session that has been idle the longest, if it has been for at
+ * least EVICT_MIN_IDLE_MS, like one that timed out.
+ *
+ * @return: true if a session was evicted.
+ */
+static bool evict_idle(struct event_loop *loop) {
+    struct session *s = loop->idle_head;
+    if (s == NULL || (uint32_t)loop->now_ms - s->idle_since_ms < EVICT_MIN_IDLE_MS) {
+        return false;
+    }
+    metrics_add(&loop->metrics.evictions, 1);
+    session_on_timeout(loop, s);
+    return true;
+}
+
+/**
+ * Arm the multishot recv that delivers everything a session receives into provided buffers.
+ */
+static int ring_arm_recv(struct event_loop *loop, struct session *s) {
+    struct io_uring_sqe *sqe = ring_sqe(loop, s, OP_RECV);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IO_RING_BUFFER_GROUP;
+    s->receiving = 1;
+    return 0;
+}
+
+/**
+ * Arm the multishot accept of the listener.
+ */
+static int ring_arm_accept(struct event_loop *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(loop, NULL, OP_ACCEPT);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return 0;
+}
+
+/**
+ * Turn an accepted connection away with BUSY_MESSAGE. A fresh socket has room for it, so
+ * one non-blocking send is enough.
+ */
+static void connection_shed(struct event_loop *loop, int client_socket) {
+    send(client_socket, BUSY_MESSAGE, strlen(BUSY_MESSAGE), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_socket);
+    metrics_add(&loop->metrics.accepts, 1);
+    metrics_add(&loop->metrics.shed, 1);
+}
+
+/**
+ * Set up a session for an accepted connection and greet the client. If the server is full,
+ * make room by evicting an idle session, or shed the connection.
+ */
+static void session_start(struct event_loop *loop, int client_socket, struct sockaddr_storage *client_addr) {
+    if (!session_admit(loop) && !(evict_idle(loop) && session_admit(loop))) {
+        connection_shed(loop, client_socket);
+        return;
+    }
+    struct session *s = (struct session*)slab_alloc(&loop->sessions);
+    if (s == NULL) {
+        // The evicted session's memory only comes back at the end of the iteration
+        evict_idle(loop);
+        session_leave(loop);
+        connection_shed(loop, client_socket);
+        return;
+    }
+    memset(s, 0, sizeof(*s));
+    s->fd = client_socket;
+    s->started_ns = loop->now_ns;
+    s->local = client_addr->ss_family == AF_UNIX;
+    s->logged = log_sample_session();
+    s->out = s->out_inline;
+    framer_init(&s->in, s->in_inline, sizeof(s->in_inline));
+    metrics_add(&loop->metrics.accepts, 1);
+
+    // Only sessions that log their address or are traced need the cold part from the start
+    if ((s->logged && log_enabled(LOG_INFO)) || trace_active) {
+        if (session_make_cold(loop, s) == -1) {
+            fprintf(stderr, "Failed to allocate session\n");
+            session_discard(loop, s);
+            return;
+        }
+        // Convert client IP to readable string; a Unix socket client has none
+        if (s->local) {
+            strcpy(s->cold->client_ip, "local");
+        } else {
+            inet_ntop(client_addr->ss_family, extract_ip_address((struct sockaddr*)client_addr), s->cold->client_ip,
+                      sizeof(s->cold->client_ip));
+        }
+        if (trace_active) {
+            trace_start(s, client_addr);
+        }
+    }
+    session_log_peer(s, LOG_CONNECTED, 0, 0);
+
+    if (loop->ring != NULL) {
+        // The greeting and the recv for the reply go to the kernel with the next submission
+        if (ring_arm_recv(loop, s) == -1) {
+            session_discard(loop, s);
+            return;
+        }
+        session_queue(s, PROTOCOL_MESSAGE, strlen(PROTOCOL_MESSAGE));
+        s->state = SENT_PROTOCOL;
+        timer_arm(loop, s);
+        session_flush(loop, s);
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = s->events = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) == -1) {
+        perror("Failed to watch client socket");
+        session_discard(loop, s);
+        return;
+    }
+
+    // Send protocol message
+    session_queue(s, PROTOCOL_MESSAGE, strlen(PROTOCOL_MESSAGE));
+    s->state = SENT_PROTOCOL;
+    timer_arm(loop, s);
+    session_flush(loop, s);
+}
+
+/**
+ * Accept every pending connection and greet it, until the listen queue is empty.
+ */
+static void accept_clients(struct event_loop *loop) {
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_socket = accept4(loop->listen_socket, (struct sockaddr*)&client_addr, &client_addr_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == -1) {
+            // Closing an evicted session on epoll frees its descriptor at once
+            if (errno == EINTR || errno == ECONNABORTED
+                || ((errno == EMFILE || errno == ENFILE) && evict_idle(loop))) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Failed to accept connection");
+            }
+            return;
+        }
+        session_start(loop, client_socket, &client_addr);
+    }
+}
+
+/**
+ * Timer wheel callback for a session whose deadline has passed.
+ */
+static void session_timer_expired(struct timer_node *node, void *context) {
+    struct session *s = (struct session*)((char*)node - offsetof(struct session, timer));
+    session_on_timeout((struct event_loop*)context, s);
+}
+
+/**
+ * A session has one operation fewer in flight; free it if it was only waiting for that.
+ */
+static void ring_release(struct event_loop *loop, struct session *s) {
+    if (s->released && !s->receiving && !s->sending && !s->notifying) {
+        session_free(loop, s);
+    }
+}
+
+static void ring_on_accept(struct event_loop *loop, const struct io_uring_cqe *cqe) {
+    if (cqe->res < 0) {
+        // Out of descriptors: the next accept finds the one of an evicted session. Its close
+        // is queued before the accept is armed again, so the accept does not run into EMFILE
+        // once more and evict a second session.
+        if ((cqe->res != -EMFILE && cqe->res != -ENFILE) || !evict_idle(loop)) {
+            fprintf(stderr, "Failed to accept connection: %s\n", strerror(-cqe->res));
+        }
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && ring_arm_accept(loop) == -1) {
+        fprintf(stderr, "Failed to accept connections\n");
+    }
+    if (cqe->res < 0) {
+        return;
+    }
+
+    // A multishot accept has no address buffer of its own per connection
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    if (getpeername(cqe->res, (struct sockaddr*)&client_addr, &client_addr_len) == -1) {
+        close(cqe->res); // Already gone again
+        return;
+    }
+    session_start(loop, cqe->res, &client_addr);
+}
+
+/**
+ * Copy received bytes into the session's framer and handle them, a framer-full at a time.
+ */
+static void ring_receive(struct event_loop *loop, struct session *s, const char *data, size_t length) {
+    while (length > 0) {
+        size_t space;
+        char *free_space = framer_write_ptr(&s->in, &space);
+        size_t count = length < space ? length : space;
+        memcpy(free_space, data, count);
+        framer_commit(&s->in, count);
+        data += count;
+        length -= count;
+        if (session_process_input(loop, s) == -1) {
+            return;
+        }
+    }
+    session_mark_dirty(loop, s);
+}
+
+static void ring_on_recv(struct event_loop *loop, struct session *s, const struct io_uring_cqe *cqe) {
+    const char *data = NULL;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        data = io_ring_buffer(loop->ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        s->receiving = 0;
+    }
+
+    // Like the epoll path, a finishing session no longer reads
+    if (!s->closed && s->state != DONE) {
+        if (cqe->res > 0) {
+            metrics_add(&loop->metrics.bytes_received, cqe->res);
+            ring_receive(loop, s, data, cqe->res);
+        } else if (cqe->res != -ENOBUFS) {
+            session_on_eof(loop, s, cqe->res == 0 ? 0 : -1);
+        }
+    }
+    if (data != NULL) {
+        io_ring_recycle_buffer(loop->ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+
+    // Out of provided buffers: the recv ended and is started again
+    if (!s->closed && !s->receiving && s->state != DONE && ring_arm_recv(loop, s) == -1) {
+        session_close(loop, s);
+    }
+    ring_release(loop, s);
+}
+
+static void ring_on_sent(struct event_loop *loop, struct session *s, const struct io_uring_cqe *cqe) {
+    s->sending = 0;
+    if (!s->closed) {
+        if (cqe->res < 0) {
+            fprintf(stderr, "%s: %s\n", s->state == SENT_PROTOCOL ? "Failed to send protocol message" : "Failed to send to client",
+                    strerror(-cqe->res));
+            session_close(loop, s);
+        } else {
+            s->out_sent += cqe->res;
+            metrics_add(&loop->metrics.bytes_sent, cqe->res);
+            session_flush_ring(loop, s);
+        }
+    }
+    ring_release(loop, s);
+}
+
+/**
+ * The io_uring version of the loop in run_event_loop().
+ */
+static int run_ring_loop(struct event_loop *loop) {
+    if (ring_arm_accept(loop) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        int wait_ms = timer_wheel_next_timeout(&loop->timers, now_ms());
+        if (io_ring_submit_and_wait(loop->ring, wait_ms) == -1) {
+            perror("io_uring_enter failed");
+            return -1;
+        }
+        loop_clock(loop);
+
+        struct io_uring_cqe *next;
+        while ((next = io_ring_peek_cqe(loop->ring)) != NULL) {
+            struct io_uring_cqe cqe = *next;
+            io_ring_cqe_seen(loop->ring);
+            if (cqe.user_data == IO_RING_USER_DATA_BUFFERS) {
+                fprintf(stderr, "Failed to recycle receive buffer: %s\n", strerror(-cqe.res));
+                continue;
+            }
+
+            struct session *s = (struct session*)(uintptr_t)(cqe.user_data & ~(uint64_t)RING_OP_MASK);
+            switch (cqe.user_data & RING_OP_MASK) {
+            case OP_ACCEPT:
+                ring_on_accept(loop, &cqe);
+                break;
+            case OP_RECV:
+                ring_on_recv(loop, s, &cqe);
+                break;
+            case OP_SEND:
+                ring_on_sent(loop, s, &cqe);
+                break;
+            case OP_NOTICE:
+                if (cqe.res > 0) {
+                    metrics_add(&loop->metrics.bytes_sent, cqe.res);
+                }
+                s->notifying = 0;
+                ring_release(loop, s);
+                break;
+            default:
+                break;
+            }
+        }
+
+        finish_reads(loop);
+        timer_wheel_advance(&loop->timers, loop->now_ms, session_timer_expired, loop);
+        if (loop->dirty != NULL) {
+            finish_reads(loop); // Results that were taken on their timeout
+        }
+        adapt_timeouts(loop);
+        free_closed(loop);
+    }
+}
+
+int run_event_loop(int listen_socket, const struct server_config *config, unsigned task_stream) {
+    static thread_local struct event_loop loop; // Too large for a worker's stack
+    memset(&loop, 0, sizeof(loop));
+    loop.listen_socket = listen_socket;
+    loop.config = config;
+    loop_clock(&loop);
+    timer_wheel_init(&loop.timers, loop.now_ms);
+    metrics_register(&loop.metrics);
+    slab_init(&loop.sessions, sizeof(struct session), &loop.metrics.pools[POOL_SESSIONS]);
+    slab_init(&loop.colds, sizeof(struct session_cold), &loop.metrics.pools[POOL_SESSION_COLD]);
+    buffer_pool_init(&loop.buffers, &loop.metrics.pools[POOL_BUFFERS]);
+    loop.timeout_ms[TIMEOUT_HANDSHAKE] = config->handshake_timeout_ms;
+    loop.timeout_ms[TIMEOUT_RESULT] = config->result_timeout_ms;
+    loop.timeout_ms[TIMEOUT_SEND] = config->send_timeout_ms;
+    for (int stage = 0; stage < TIMEOUT_COUNT; stage++) {
+        metrics_set(&loop.metrics.timeout_ms[stage], loop.timeout_ms[stage]);
+    }
+    histogram_init(&loop.recent_handshakes);
+    histogram_init(&loop.recent_tasks);
+    loop.adapted_ms = loop.now_ms;
+    loop.local_next = CALC_BATCH_SIZE;
+
+    if (config->task_pool > 0) {
+        static thread_local struct task_pool pool; // Shared with its refill thread for good
+        if (task_pool_start(&pool, config->task_pool, task_stream) == -1) {
+            return -1;
+        }
+        loop.pool = &pool;
+    }
+
+    if (config->io_uring) {
+        static thread_local struct io_ring ring;
+        if (io_ring_init(&ring) == 0) {
+            loop.ring = &ring;
+            return run_ring_loop(&loop);
+        }
+        fprintf(stderr, "io_uring is not available (%s), using epoll\n", strerror(errno));
+    }
+
+    if (fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("Failed to make server socket non-blocking");
+        return -1;
+    }
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd == -1) {
+        perror("Failed to create epoll instance");
+        return -1;
+    }
+
+    // The listening socket is the only entry without a session
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, listen_socket, &ev) == -1) {
+        perror("Failed to watch server socket");
+        close(loop.epoll_fd);
+        return -1;
+    }
+
+    // Spinning on the rings only pays if the clients run at the same time
+    loop.shm_spin_rounds = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_ROUNDS : 1;
+
+    struct epoll_event events[MAX_EVENTS];
+    unsigned polls = 0; // Iterations without epoll_wait() while the shared-memory rings are busy
+    while (1) {
+        int ready = 0;
+        if (loop.shm_sessions != NULL && loop.shm_idle == 0 && polls < SHM_POLL_BURST) {
+            polls++;
+        } else {
+            polls = 0;
+            int wait_ms = timer_wheel_next_timeout(&loop.timers, now_ms());
+            if (loop.shm_sessions != NULL
+                && (loop.shm_idle < loop.shm_spin_rounds || wait_ms == 0 || !shm_sleep(&loop))) {
+                wait_ms = 0; // Keep polling the rings
+            }
+            ready = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, wait_ms);
+            if (loop.shm_idle >= loop.shm_spin_rounds) {
+                shm_awake(&loop);
+            }
+        }
+        loop_clock(&loop);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            close(loop.epoll_fd);
+            return -1;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            uintptr_t data = (uintptr_t)events[i].data.ptr;
+            if (data & DOORBELL_TAG) {
+                struct session *s = (struct session*)(data & ~(uintptr_t)DOORBELL_TAG);
+                if (s->shm != NULL) {
+                    shm_drain_doorbell(s->cold->shm_doorbell); // Its rings are polled below
+                }
+                continue;
+            }
+            struct session *s = (struct session*)data;
+            if (s == NULL) {
+                accept_clients(&loop);
+                continue;
+            }
+            // Closed earlier in this batch, possibly evicted to make room for a connection.
+            // It stays allocated until free_closed(), so its pointer cannot belong to a
+            // session that got its descriptor since; the event is stale either way.
+            if (s->closed) {
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && session_flush(&loop, s) == -1) {
+                continue; // Session closed
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                session_on_readable(&loop, s);
+            }
+        }
+
+        if (loop.shm_sessions != NULL) {
+            loop.shm_idle = poll_shm_sessions(&loop) ? 0 : loop.shm_idle + (loop.shm_idle < loop.shm_spin_rounds);
+        }
+        finish_reads(&loop);
+        timer_wheel_advance(&loop.timers, loop.now_ms, session_timer_expired, &loop);
+        if (loop.dirty != NULL) {
+            finish_reads(&loop); // Results that were taken on their timeout
+        }
+        adapt_timeouts(&loop);
+        free_closed(&loop);
+    }
+}
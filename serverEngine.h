@@ -0,0 +1,232 @@
+#ifndef __SERVER_ENGINE
+#define __SERVER_ENGINE
+
+/*
+
+Event-driven session engine for the server.
+
+Every client connection is a small state machine (see session_state) driven by a single
+event loop, so one thread can serve many clients that are at different stages of the
+protocol at the same time. The bytes on the wire are exactly those of the original
+blocking server.
+
+The loop waits on epoll by default. With server_config.io_uring it submits its accepts,
+receives, sends and closes to an io_uring instead (see ioRing.h): the listener has one
+multishot accept, every session one multishot recv for its whole life, and all the sends
+and closes of a loop iteration go to the kernel in a single system call. Kernels without
+the io_uring features used fall back to epoll.
+
+Sessions accepted on a Unix socket may move to the shared-memory transport (see
+shmTransport.h), on the epoll loop. The loop then polls the rings of those sessions every
+iteration and, while they are busy, calls epoll_wait() only every SHM_POLL_BURST
+iterations; once they have been idle for SHM_SPIN_ROUNDS iterations (one on a single
+CPU, where spinning only keeps the clients from running) it arms their doorbells and
+blocks like it would without them.
+
+The loop takes every connection waiting in its listen queue at once. With
+server_config.max_sessions, connections beyond that many open sessions (over all loops) get
+BUSY_MESSAGE and are closed right away, instead of being greeted and left to time out.
+
+Every session stage has its own timeout: the handshake, the wait for a result, and the
+wait for the client to read what it was sent. With server_config.adaptive_timeouts the
+handshake and result timeouts follow the clients: every ADAPT_INTERVAL_MS, each loop sets
+them to ADAPT_FACTOR times the ADAPT_PERCENTILE of the latencies it saw since, between
+ADAPT_MIN_MS and the configured timeout. Under pressure (the server at max_sessions, or
+out of memory or file descriptors when a client connects) the loop evicts the session that
+has been idle the longest, with "ERROR TO" like a timeout, before it sheds the new one.
+
+With a session journal open (see sessionTrace.h) every session fills its trace record on
+the way and appends it to the journal when it closes.
+
+Sessions come from the loop's slab pools (see slabPool.h), so an idle or half-open
+connection costs one cache-line-aligned struct session of a few hundred bytes. The struct
+keeps what every event touches in its first cache line. Its small inline buffers hold a
+lockstep session's lines. The rest grows on demand:
+  - an input buffer of BUFFER_SIZE once a client sends more than fits inline, kept by
+    pipelined sessions and given back by lockstep ones once drained;
+  - an output buffer of OUT_BUFFER_SIZE while more output is pending than fits inline;
+  - the task window, sized to the negotiated window;
+  - a session_cold, holding what only a logged, traced or shared-memory session needs.
+
+Implementation in serverEngine.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "calcLib.h"
+#include "binaryProtocol.h"
+#include "timerWheel.h"
+#include "lineFramer.h"
+#include "sessionTrace.h"
+#include "slabPool.h"
+
+struct shm_channel;
+
+#define RESPONSE_TIMEOUT 5       // Default timeout (seconds) of every session stage
+#define PROTOCOL_MESSAGE "TEXT TCP 1.0\n\n" // Protocol initialization message
+#define PERSISTENT_REQUEST "TEXT TCP 1.1\n" // Client reply asking for a persistent session
+#define QUIT_MESSAGE "QUIT\n"   // Ends a persistent session instead of a result
+#define BUSY_MESSAGE "ERROR BUSY\n" // Sent instead of the greeting when max_sessions are open
+#define BUFFER_SIZE 1024         // Size for buffer, a power of two for the input framer
+#define OUT_BUFFER_SIZE 4096     // Pending output per session, room for a full window of tasks and verdicts
+#define IN_INLINE_SIZE 64        // Input held in the session itself, a power of two for the framer
+#define OUT_INLINE_SIZE 128      // Output held in the session itself: a verdict and the next task
+#define MAX_LINE 64              // Longest task or verdict line the server writes
+#define MAX_WINDOW 64            // Outstanding tasks per pipelined session, power of two
+#define FLOAT_PRECISION 0.0001   // Tolerance for floating-point comparison
+#define MAX_EVENTS 256           // Events handled per epoll_wait() call
+#define CHECK_BATCH_SIZE 1024    // Results checked together, at least once per loop iteration
+#define SHM_POLL_BURST 32        // Loop iterations between epoll_wait() calls while shared-memory sessions are busy
+#define SHM_SPIN_ROUNDS 64       // Idle loop iterations before the loop sleeps on the shared-memory doorbells
+#define ADAPT_INTERVAL_MS 1000   // Time between two adaptations of the timeouts
+#define ADAPT_MIN_SAMPLES 64     // Latencies needed before a timeout is adapted
+#define ADAPT_PERCENTILE 99.0    // Latency percentile an adaptive timeout is derived from
+#define ADAPT_FACTOR 4           // Adaptive timeout as a multiple of that percentile
+#define ADAPT_MIN_MS 250         // Shortest adaptive timeout
+#define EVICT_MIN_IDLE_MS 100    // Shortest idle time of a session evicted under pressure
+
+/**
+ * Stages of a client session, in the order they are visited.
+ */
+enum session_state : uint8_t {
+    SENT_PROTOCOL, // Protocol message queued, waiting for it to leave the socket
+    WAIT_OK,       // Waiting for the client to acknowledge with "OK\n"
+    SENT_TASK,     // Task(s) queued, waiting for them to leave the socket
+    WAIT_RESULT,   // Waiting for the client's result(s)
+    DONE           // Last verdict queued, close once it has been sent
+};
+
+/**
+ * Protocol a client negotiated in its reply to PROTOCOL_MESSAGE.
+ */
+enum session_protocol : uint8_t {
+    TEXT_TCP_1_0,  // "OK\n": one task, then close
+    TEXT_TCP_1_1,  // PERSISTENT_REQUEST: a new task after every verdict. With a window,
+                   // "TEXT TCP 1.1 <W>\n", up to W tasks are outstanding at once and tasks,
+                   // results and verdicts are prefixed with the task's sequence number
+    BINARY_TCP_1_0 // BINARY_REQUEST: pipelined like TEXT TCP 1.1, in binary_frame records
+};
+
+/**
+ * Server-wide settings shared by every event loop.
+ */
+struct server_config {
+    unsigned max_tasks;          // Tasks per TEXT TCP 1.1 session, 0 for no limit
+    unsigned max_window;         // Largest window granted to pipelined sessions, 1..MAX_WINDOW
+    unsigned task_pool;          // Prepared tasks per event loop, a power of two, 0 to draw them on the loop
+    bool io_uring;               // Use io_uring instead of epoll where the kernel supports it
+    unsigned max_sessions;       // Sessions open at once over all event loops, 0 for no limit
+    unsigned handshake_timeout_ms; // Greeting sent and answered
+    unsigned result_timeout_ms;  // Result of an outstanding task received
+    unsigned send_timeout_ms;    // Pending task or verdict read by the client
+    bool adaptive_timeouts;      // Shorten the handshake and result timeouts to what clients need
+};
+
+/**
+ * A task handed to the client that has not had its verdict sent yet.
+ */
+struct pending_task {
+    calc_op_t op;
+    calc_value_t expected;       // Reference result, prepared with the task
+    uint8_t answered;            // Result received
+    uint8_t checked;             // Result checked, verdict not sent yet
+    uint8_t correct;
+    uint8_t logged;              // Copy of the session's logged, for check_results()
+    long long sent_ns;           // When the task was queued, for its round trip time
+};
+
+/**
+ * The parts of a session only some sessions need, allocated when one of them does.
+ */
+struct session_cold {
+    char client_ip[INET6_ADDRSTRLEN]; // Filled for sessions that log at LOG_INFO or are traced
+
+    // Shared-memory transport; the session is on the loop's list of shared-memory
+    // sessions while it has one
+    int shm_doorbell;            // Eventfd the loop waits on, in the epoll set
+    int shm_peer_doorbell;       // Eventfd the client waits on
+    struct session *shm_prev;
+    struct session *shm_next;
+
+    char notice[sizeof(struct binary_frame)]; // "ERROR TO" sent while closing, on io_uring
+
+    // Filled while a session journal is open, appended to it when the session closes
+    struct trace_record trace;
+};
+
+/**
+ * Per-connection state. Owned by the event loop, allocated from its slab pool.
+ */
+struct alignas(CACHE_LINE) session {
+    // Hot: read or written on every event of the session
+    int fd;
+    enum session_state state;
+    enum session_protocol protocol;
+    uint8_t tagged;              // Lines carry sequence numbers (pipelined or binary session)
+    uint8_t logged;              // One of the sessions sampled for the log
+    uint8_t local;               // Accepted on a Unix socket, may use shared memory
+    uint8_t dirty;
+    uint8_t closed;
+    uint8_t receiving;           // io_uring: multishot recv armed
+    uint8_t sending;             // io_uring: send of out[out_sent..out_len) in flight, out must not move
+    uint8_t notifying;           // io_uring: send of the notice in flight
+    uint8_t released;            // io_uring: closed and past its loop iteration, free on the last completion
+    uint8_t idle;                // On the loop's idle list
+    uint32_t events;             // Events currently registered with epoll
+    unsigned window;             // Tasks that may be outstanding at once
+    unsigned max_tasks;          // Tasks this session gets, 0 for no limit
+    unsigned tasks_issued;       // Tasks sent so far
+    unsigned tasks_done;         // Verdicts sent so far
+    uint32_t idle_since_ms;      // Loop clock (truncated) when the deadline was last armed
+
+    // Outstanding tasks, indexed by sequence number & task_mask. head_seq is the oldest task
+    // without a verdict, next_seq the number of the next task to send. Allocated with the
+    // protocol, a power of two of at least window entries.
+    uint32_t head_seq;
+    uint32_t next_seq;
+    uint32_t task_mask;
+    struct pending_task *tasks;
+
+    // Pending output; out[out_sent..out_len) still has to be written. out is out_inline
+    // or a pooled OUT_BUFFER_SIZE buffer.
+    char *out;
+    uint32_t out_len;
+    uint32_t out_sent;
+
+    // Input not yet split into lines or frames, in in_inline or a pooled BUFFER_SIZE buffer
+    struct line_framer in;
+
+    // Deadline of the current state. A session with a deadline is also on the loop's idle
+    // list, which is kept in the order the deadlines were armed.
+    struct timer_node timer;
+    struct session *idle_prev;
+    struct session *idle_next;
+
+    // Sessions that read input in this loop iteration, and sessions closed in it. Both are
+    // handled once the iteration's results are checked.
+    struct session *next_dirty;
+    struct session *next_closed;
+
+    long long started_ns;        // Accept time
+    struct shm_channel *shm;     // Shared-memory transport, NULL while the session is on its socket
+    struct session_cold *cold;   // NULL until the session needs it
+
+    char in_inline[IN_INLINE_SIZE];
+    char out_inline[OUT_INLINE_SIZE];
+};
+
+static_assert(sizeof(struct session) <= 6 * CACHE_LINE, "struct session outgrew its size budget");
+
+/**
+ * Serve clients accepted on listen_socket until a fatal error occurs.
+ *
+ * @param listen_socket: A bound and listening TCP or Unix socket.
+ * @param config: Settings for the sessions, must outlive the loop.
+ * @param task_stream: Random stream of the task pool's refill thread.
+ * @return: -1 on failure, does not return otherwise.
+ */
+int run_event_loop(int listen_socket, const struct server_config *config, unsigned task_stream);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "serverEngine.h"
+#include "serverLog.h"
+
+#define LOG_IDLE_SLEEP_NS 1000000 // Drain thread pause when the ring is empty
+
+enum log_level log_threshold = LOG_DEBUG;
+
+static struct log_slot *slots;
+static unsigned sample_rate = 1;
+static std::atomic<uint64_t> write_position;  // Next slot to claim, shared by the producers
+static uint64_t read_position;                // Next slot to drain, drain thread only
+static std::atomic<uint64_t> dropped;
+static uint64_t dropped_reported;             // Drain thread only
+static std::atomic<int> stopping;
+static pthread_t thread;
+
+/**
+ * Print one record as the line the server used to printf().
+ */
+static void log_print(const struct log_record *r) {
+    int text_length = r->text_length;
+    switch (r->event) {
+    case LOG_CONNECTED:
+        printf("Connected to client: %.*s\n", text_length, r->text);
+        break;
+    case LOG_NEGOTIATED:
+        if (r->args[0] == BINARY_TCP_1_0) {
+            printf("Client %.*s negotiated BINARY TCP 1.0 with a window of %u\n", text_length, r->text, r->args[1]);
+        } else if (r->args[1] > 0) {
+            printf("Client %.*s negotiated TEXT TCP 1.1 with a window of %u\n", text_length, r->text, r->args[1]);
+        } else {
+            printf("Client %.*s negotiated TEXT TCP 1.1\n", text_length, r->text);
+        }
+        break;
+    case LOG_TASK_SENT:
+        if (r->args[1]) {
+            printf("Task sent to client: %u %.*s", r->args[0], text_length, r->text);
+        } else {
+            printf("Task sent to client: %.*s", text_length, r->text);
+        }
+        break;
+    case LOG_RESULT:
+        printf("%s %s result.\n", r->args[0] ? "Correct" : "Incorrect", r->args[1] ? "floating-point" : "integer");
+        break;
+    case LOG_SESSION_ENDED:
+        printf("Client ended the session after %u tasks.\n", r->args[0]);
+        break;
+    case LOG_INVALID_RESPONSE:
+        printf("Invalid client response: %.*s\n", text_length, r->text);
+        break;
+    case LOG_UNEXPECTED_RESULT:
+        printf("Unexpected result from client: %.*s", text_length, r->text);
+        break;
+    case LOG_UNEXPECTED_FRAME:
+        printf("Unexpected frame from client: opcode %u, task %u\n", r->args[0], r->args[1]);
+        break;
+    case LOG_DISCONNECTED:
+        printf("Client disconnected unexpectedly.\n");
+        break;
+    case LOG_LINE_TOO_LONG:
+        printf("Client line too long.\n");
+        break;
+    case LOG_TIMEOUT:
+        if (r->args[0] == WAIT_OK) {
+            printf("Client response timed out.\n");
+        } else if (r->args[0] == WAIT_RESULT) {
+            printf("Timeout waiting for client result.\n");
+        } else {
+            printf("Timeout sending to client.\n");
+        }
+        break;
+    case LOG_SHARED_MEMORY:
+        if (r->args[0]) {
+            printf("Client %.*s moved to shared memory\n", text_length, r->text);
+        } else {
+            printf("Client %.*s asked for shared memory, declined\n", text_length, r->text);
+        }
+        break;
+    }
+}
+
+/**
+ * Print every record that is complete, in ring order.
+ *
+ * @return: Records printed.
+ */
+static size_t log_drain(void) {
+    size_t count = 0;
+    while (1) {
+        struct log_slot *slot = &slots[read_position & (LOG_RING_SIZE - 1)];
+        if (slot->sequence.load(std::memory_order_acquire) != read_position + 1) {
+            break; // Empty, or the producer of the next record is not done with it yet
+        }
+        log_print(&slot->record);
+        slot->sequence.store(read_position + LOG_RING_SIZE, std::memory_order_release);
+        read_position++;
+        count++;
+    }
+
+    uint64_t lost = dropped.load(std::memory_order_relaxed) - dropped_reported;
+    if (lost > 0) {
+        printf("Log ring full, %llu records dropped.\n", (unsigned long long)lost);
+        dropped_reported += lost;
+    }
+    return count;
+}
+
+/**
+ * Drain thread: print what the ring holds, flush and nap once it is empty.
+ */
+static void *log_main(void *) {
+    struct timespec idle = {0, LOG_IDLE_SLEEP_NS};
+    while (!stopping.load(std::memory_order_acquire)) {
+        if (log_drain() == 0) {
+            fflush(stdout);
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * At exit: stop the drain thread and print what is left.
+ */
+static void log_stop(void) {
+    stopping.store(1, std::memory_order_release);
+    pthread_join(thread, NULL);
+    log_drain();
+    fflush(stdout);
+}
+
+int log_start(enum log_level level, unsigned rate) {
+    log_threshold = level;
+    sample_rate = rate > 0 ? rate : 1;
+    if (level == LOG_OFF) {
+        return 0; // Nothing is ever written
+    }
+
+    slots = (struct log_slot*)calloc(LOG_RING_SIZE, sizeof(struct log_slot));
+    if (slots == NULL) {
+        perror("Failed to allocate log ring");
+        return -1;
+    }
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    int rv = pthread_create(&thread, NULL, log_main, NULL);
+    if (rv != 0) {
+        fprintf(stderr, "Failed to start log thread: %s\n", strerror(rv));
+        return -1;
+    }
+    atexit(log_stop);
+    return 0;
+}
+
+bool log_sample_session(void) {
+    static thread_local unsigned sessions;
+    return sessions++ % sample_rate == 0;
+}
+
+void log_write(enum log_level level, enum log_event event, uint32_t arg0, uint32_t arg1,
+               const char *text, size_t text_length) {
+    // Claim a slot: the one at write_position, if its previous record has been drained
+    uint64_t position = write_position.load(std::memory_order_relaxed);
+    struct log_slot *slot;
+    while (1) {
+        slot = &slots[position & (LOG_RING_SIZE - 1)];
+        int64_t lag = (int64_t)(slot->sequence.load(std::memory_order_acquire) - position);
+        if (lag == 0) {
+            if (write_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (lag < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed); // Full
+            return;
+        } else {
+            position = write_position.load(std::memory_order_relaxed); // Claimed by another producer
+        }
+    }
+
+    struct log_record *r = &slot->record;
+    r->event = (uint16_t)event;
+    r->level = (uint8_t)level;
+    r->args[0] = arg0;
+    r->args[1] = arg1;
+    if (text_length > LOG_TEXT_SIZE) {
+        text_length = LOG_TEXT_SIZE;
+    }
+    if (text_length > 0) {
+        memcpy(r->text, text, text_length);
+    }
+    r->text_length = (uint8_t)text_length;
+    slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+uint64_t log_dropped(void) {
+    return dropped.load(std::memory_order_relaxed);
+}
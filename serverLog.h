@@ -0,0 +1,106 @@
+#ifndef __SERVER_LOG
+#define __SERVER_LOG
+
+/*
+
+Asynchronous session log of the server.
+
+The event loops do not format or print anything: log_write() copies a small binary record
+(an event number, a few integers and a short text) into a lock-free multi-producer ring and
+returns. A background thread drains the ring, formats the records into the same lines the
+server used to printf() and writes them to stdout, flushing whenever the ring runs empty.
+
+Records are filtered by level before they are written, and sessions can be sampled: with
+a sample rate of N only one session in N logs anything. When the ring is full a record is
+dropped rather than stalling the event loop; the drain thread reports how many were lost.
+
+Implementation in serverLog.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+
+#define LOG_RING_SIZE 16384      // Records the ring holds, a power of two
+#define LOG_TEXT_SIZE 104        // Text bytes per record, longer texts are cut
+
+enum log_level {
+    LOG_OFF,
+    LOG_ERROR,   // Sessions that end badly: protocol violations, timeouts, lost clients
+    LOG_INFO,    // Session life cycle: connects, negotiations, orderly ends
+    LOG_DEBUG    // Every task and verdict
+};
+
+/**
+ * What a record says; the drain thread turns it back into a line.
+ */
+enum log_event {
+    LOG_CONNECTED,          // text: client address
+    LOG_NEGOTIATED,         // args[0]: session_protocol, args[1]: window (0 for lockstep), text: client address
+    LOG_TASK_SENT,          // text: the task line as sent; for a binary task args[1] is 1 and
+                            // args[0] the sequence number, which text then leaves out
+    LOG_RESULT,             // args[0]: correct, args[1]: float operation
+    LOG_SESSION_ENDED,      // args[0]: tasks done
+    LOG_INVALID_RESPONSE,   // text: the client's reply to the greeting
+    LOG_UNEXPECTED_RESULT,  // text: the offending line
+    LOG_UNEXPECTED_FRAME,   // args[0]: opcode, args[1]: sequence number
+    LOG_DISCONNECTED,
+    LOG_LINE_TOO_LONG,
+    LOG_TIMEOUT,            // args[0]: session_state
+    LOG_SHARED_MEMORY       // args[0]: granted, text: client address
+};
+
+struct log_record {
+    uint16_t event;
+    uint8_t level;
+    uint8_t text_length;
+    uint32_t args[2];
+    char text[LOG_TEXT_SIZE];
+};
+
+/**
+ * Ring slot. sequence tells whose turn the slot is: position for the producer that claims
+ * position, position + 1 for the consumer once the record is in.
+ */
+struct alignas(64) log_slot {
+    std::atomic<uint64_t> sequence;
+    struct log_record record;
+};
+
+extern enum log_level log_threshold;
+
+/**
+ * Start the drain thread. Records below level are not written at all; sample_rate N logs
+ * one session in N (1 for all). The ring is drained once more when the process exits.
+ *
+ * @return: 0 on success, -1 on failure.
+ */
+int log_start(enum log_level level, unsigned sample_rate);
+
+/**
+ * Whether records of level are written at all.
+ */
+static inline bool log_enabled(enum log_level level) {
+    return level <= log_threshold;
+}
+
+/**
+ * Whether a new session is one of the sampled ones. Call once per session.
+ */
+bool log_sample_session(void);
+
+/**
+ * Queue a record of a level log_enabled() accepts. Never blocks; the record is counted as
+ * dropped if the ring is full.
+ */
+void log_write(enum log_level level, enum log_event event, uint32_t arg0, uint32_t arg1,
+               const char *text, size_t text_length);
+
+/**
+ * Records dropped so far because the ring was full.
+ */
+uint64_t log_dropped(void);
+
+#endif
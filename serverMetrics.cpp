@@ -0,0 +1,433 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "serverMetrics.h"
+
+#define MAX_REGISTERED 256       // Event loops, one per worker
+#define REQUEST_TIMEOUT_MS 200   // How long a scraper gets to send its request line
+
+static struct server_metrics *registered[MAX_REGISTERED];
+static int registered_count;
+static pthread_mutex_t registered_lock = PTHREAD_MUTEX_INITIALIZER;
+static int listeners[MAX_REGISTERED];  // TCP listeners, one per worker
+static int listener_count;
+
+static const char *timeout_names[TIMEOUT_COUNT] = {"handshake", "result", "send"};
+static const char *phase_names[PHASE_COUNT] = {"handshake", "task", "session"};
+static const char *pool_names[POOL_BUFFERS] = {"session", "session_cold"};
+
+// Upper bounds (seconds) of the histogram buckets reported; the finer buckets are folded into these
+static const double latency_bounds[] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+void metrics_register(struct server_metrics *m) {
+    memset(m, 0, sizeof(*m));
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        histogram_init(&m->latency[phase]);
+    }
+    pthread_mutex_lock(&registered_lock);
+    if (registered_count < MAX_REGISTERED) {
+        registered[registered_count++] = m;
+    }
+    pthread_mutex_unlock(&registered_lock);
+}
+
+void metrics_watch_listener(int listen_socket) {
+    pthread_mutex_lock(&registered_lock);
+    if (listener_count < MAX_REGISTERED) {
+        listeners[listener_count++] = listen_socket;
+    }
+    pthread_mutex_unlock(&registered_lock);
+}
+
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add the histogram another thread is recording into to a local one.
+ */
+static void histogram_add_live(struct histogram *into, const struct histogram *from) {
+    for (unsigned i = 0; i < HISTOGRAM_SIZE; i++) {
+        into->counts[i] += load(&from->counts[i]);
+    }
+    into->total += load(&from->total);
+    double sum;
+    __atomic_load(&from->sum, &sum, __ATOMIC_RELAXED);
+    into->sum += sum;
+}
+
+/**
+ * Add up the metrics of every event loop.
+ */
+static void metrics_collect(struct server_metrics *total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&registered_lock);
+    for (int r = 0; r < registered_count; r++) {
+        const struct server_metrics *m = registered[r];
+        total->accepts += load(&m->accepts);
+        total->shed += load(&m->shed);
+        total->evictions += load(&m->evictions);
+        total->sessions_closed += load(&m->sessions_closed);
+        total->handshake_failures += load(&m->handshake_failures);
+        for (int i = 0; i < TIMEOUT_COUNT; i++) {
+            total->timeouts[i] += load(&m->timeouts[i]);
+            uint64_t timeout_ms = load(&m->timeout_ms[i]);
+            if (timeout_ms > total->timeout_ms[i]) {
+                total->timeout_ms[i] = timeout_ms; // The longest, not a sum
+            }
+        }
+        for (int op = 0; op < CALC_OP_COUNT; op++) {
+            total->results[op][0] += load(&m->results[op][0]);
+            total->results[op][1] += load(&m->results[op][1]);
+        }
+        total->bytes_received += load(&m->bytes_received);
+        total->bytes_sent += load(&m->bytes_sent);
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            histogram_add_live(&total->latency[phase], &m->latency[phase]);
+        }
+        for (int i = 0; i < POOL_COUNT; i++) {
+            total->pools[i].slabs += load(&m->pools[i].slabs);
+            total->pools[i].in_use += load(&m->pools[i].in_use);
+            total->pools[i].peak += load(&m->pools[i].peak);
+            total->pools[i].allocations += load(&m->pools[i].allocations);
+            total->pools[i].failures += load(&m->pools[i].failures);
+        }
+    }
+    pthread_mutex_unlock(&registered_lock);
+}
+
+/**
+ * Add up the accept queues of the watched listeners.
+ *
+ * @param queued: Receives the connections waiting to be accepted.
+ * @param backlog: Receives the room the queues have.
+ */
+static void listeners_collect(uint64_t *queued, uint64_t *backlog) {
+    *queued = *backlog = 0;
+    pthread_mutex_lock(&registered_lock);
+    for (int i = 0; i < listener_count; i++) {
+        // On a listening socket these two fields hold the accept queue's length and limit
+        struct tcp_info info;
+        socklen_t length = sizeof(info);
+        if (getsockopt(listeners[i], IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+            *queued += info.tcpi_unacked;
+            *backlog += info.tcpi_sacked;
+        }
+    }
+    pthread_mutex_unlock(&registered_lock);
+}
+
+/**
+ * A TcpExt counter of the kernel from /proc/net/netstat, a line of names followed by a
+ * line of values.
+ *
+ * @return: 0 on success, -1 if it cannot be read.
+ */
+static int netstat_counter(const char *name, uint64_t *value) {
+    FILE *file = fopen("/proc/net/netstat", "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char *names = NULL, *values = NULL;
+    size_t names_size = 0, values_size = 0;
+    int rv = -1;
+    while (getline(&names, &names_size, file) != -1 && getline(&values, &values_size, file) != -1) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        char *name_save, *value_save;
+        char *n = strtok_r(names, " \n", &name_save);
+        char *v = strtok_r(values, " \n", &value_save);
+        while (n != NULL && v != NULL) {
+            if (strcmp(n, name) == 0) {
+                *value = strtoull(v, NULL, 10);
+                rv = 0;
+                break;
+            }
+            n = strtok_r(NULL, " \n", &name_save);
+            v = strtok_r(NULL, " \n", &value_save);
+        }
+        break;
+    }
+    free(names);
+    free(values);
+    fclose(file);
+    return rv;
+}
+
+static void write_counter(FILE *out, const char *name, const char *help, uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+}
+
+static void write_gauge(FILE *out, const char *name, const char *help, uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+}
+
+/**
+ * A histogram as calc_latency_seconds, in cumulative latency_bounds buckets.
+ */
+static void write_latency(FILE *out, const char *phase, const struct histogram *h) {
+    size_t bound_count = sizeof(latency_bounds) / sizeof(latency_bounds[0]);
+    uint64_t cumulative = 0;
+    unsigned i = 0;
+    for (size_t b = 0; b < bound_count; b++) {
+        uint64_t bound_ns = (uint64_t)(latency_bounds[b] * 1e9);
+        while (i < HISTOGRAM_SIZE && histogram_bucket_max(i) <= bound_ns) {
+            cumulative += h->counts[i++];
+        }
+        fprintf(out, "calc_latency_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", phase, latency_bounds[b],
+                (unsigned long long)cumulative);
+    }
+    fprintf(out, "calc_latency_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phase, (unsigned long long)h->total);
+    fprintf(out, "calc_latency_seconds_sum{phase=\"%s\"} %.9f\n", phase, h->sum / 1e9);
+    fprintf(out, "calc_latency_seconds_count{phase=\"%s\"} %llu\n", phase, (unsigned long long)h->total);
+}
+
+/**
+ * One sample of a per-pool metric for every pool.
+ *
+ * @param field: Offset of the value in struct slab_stats.
+ * @param scale: Factor applied to the value.
+ */
+static void write_pools(FILE *out, const char *name, const char *type, const char *help,
+                        const struct slab_stats *pools, size_t field, uint64_t scale) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int i = 0; i < POOL_COUNT; i++) {
+        uint64_t value = *(const uint64_t*)((const char*)&pools[i] + field) * scale;
+        if (i < POOL_BUFFERS) {
+            fprintf(out, "%s{pool=\"%s\"} %llu\n", name, pool_names[i], (unsigned long long)value);
+        } else {
+            fprintf(out, "%s{pool=\"buffer_%zu\"} %llu\n", name, BUFFER_MIN_SIZE << (i - POOL_BUFFERS),
+                    (unsigned long long)value);
+        }
+    }
+}
+
+/**
+ * Render the current totals.
+ *
+ * @return: The text (to free()), or NULL on failure.
+ */
+static char *metrics_render(size_t *length) {
+    static struct server_metrics total; // Only the stats thread renders
+    metrics_collect(&total);
+
+    char *text = NULL;
+    FILE *out = open_memstream(&text, length);
+    if (out == NULL) {
+        return NULL;
+    }
+    write_counter(out, "calc_accepts_total", "Connections accepted.", total.accepts);
+    write_counter(out, "calc_shed_total", "Connections turned away with ERROR BUSY, included in the accepted ones.", total.shed);
+    write_gauge(out, "calc_sessions_active", "Sessions open now.", total.accepts - total.shed - total.sessions_closed);
+
+    uint64_t queued, backlog, overflows;
+    listeners_collect(&queued, &backlog);
+    write_gauge(out, "calc_listen_queued", "Connections waiting in the accept queues of the TCP listeners.", queued);
+    write_gauge(out, "calc_listen_backlog", "Connections the accept queues of the TCP listeners can hold.", backlog);
+    if (netstat_counter("ListenOverflows", &overflows) == 0) {
+        write_counter(out, "calc_listen_overflows_total",
+                      "Connections the kernel dropped because an accept queue was full, over every socket of the host.",
+                      overflows);
+    }
+    write_counter(out, "calc_handshake_failures_total", "Clients that did not answer the greeting properly.",
+                  total.handshake_failures);
+
+    fprintf(out, "# HELP calc_timeouts_total Sessions dropped for being too slow, by stage.\n"
+                 "# TYPE calc_timeouts_total counter\n");
+    for (int i = 0; i < TIMEOUT_COUNT; i++) {
+        fprintf(out, "calc_timeouts_total{phase=\"%s\"} %llu\n", timeout_names[i], (unsigned long long)total.timeouts[i]);
+    }
+    write_counter(out, "calc_evictions_total", "Idle sessions dropped to make room, included in the timeouts.", total.evictions);
+    fprintf(out, "# HELP calc_timeout_seconds Timeout of a stage now, the longest over the event loops.\n"
+                 "# TYPE calc_timeout_seconds gauge\n");
+    for (int i = 0; i < TIMEOUT_COUNT; i++) {
+        fprintf(out, "calc_timeout_seconds{phase=\"%s\"} %.3f\n", timeout_names[i], total.timeout_ms[i] / 1000.0);
+    }
+
+    fprintf(out, "# HELP calc_results_total Results checked, by operation and verdict.\n"
+                 "# TYPE calc_results_total counter\n");
+    for (int op = 0; op < CALC_OP_COUNT; op++) {
+        fprintf(out, "calc_results_total{op=\"%s\",verdict=\"correct\"} %llu\n", calcOps[op].name,
+                (unsigned long long)total.results[op][1]);
+        fprintf(out, "calc_results_total{op=\"%s\",verdict=\"incorrect\"} %llu\n", calcOps[op].name,
+                (unsigned long long)total.results[op][0]);
+    }
+
+    write_counter(out, "calc_received_bytes_total", "Bytes received from clients.", total.bytes_received);
+    write_counter(out, "calc_sent_bytes_total", "Bytes sent to clients.", total.bytes_sent);
+
+    fprintf(out, "# HELP calc_latency_seconds Handshake, task round trip and session durations.\n"
+                 "# TYPE calc_latency_seconds histogram\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        write_latency(out, phase_names[phase], &total.latency[phase]);
+    }
+
+    write_pools(out, "calc_pool_objects", "gauge", "Objects in use, by slab pool.", total.pools,
+                offsetof(struct slab_stats, in_use), 1);
+    write_pools(out, "calc_pool_peak_objects", "gauge", "Most objects in use at once, summed over the event loops.",
+                total.pools, offsetof(struct slab_stats, peak), 1);
+    write_pools(out, "calc_pool_bytes", "gauge", "Memory mapped for the slabs of a pool.", total.pools,
+                offsetof(struct slab_stats, slabs), SLAB_SIZE);
+    write_pools(out, "calc_pool_allocations_total", "counter", "Objects handed out.", total.pools,
+                offsetof(struct slab_stats, allocations), 1);
+    write_pools(out, "calc_pool_failures_total", "counter", "Allocations that found no memory.", total.pools,
+                offsetof(struct slab_stats, failures), 1);
+
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static void send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += sent;
+        length -= sent;
+    }
+}
+
+/**
+ * Answer one scrape.
+ */
+static void metrics_answer(int fd) {
+    struct timeval timeout = {0, REQUEST_TIMEOUT_MS * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[1024];
+    ssize_t received = recv(fd, request, sizeof(request), 0);
+    bool http = received >= 4 && memcmp(request, "GET ", 4) == 0;
+
+    size_t length;
+    char *text = metrics_render(&length);
+    if (text == NULL) {
+        return;
+    }
+    if (http) {
+        char header[128];
+        int header_length = snprintf(header, sizeof(header),
+                                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                     "Content-Length: %zu\r\n\r\n", length);
+        send_all(fd, header, header_length);
+    }
+    send_all(fd, text, length);
+    free(text);
+}
+
+static void *metrics_main(void *arg) {
+    int listen_socket = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(listen_socket, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Failed to accept stats connection");
+            }
+            continue;
+        }
+        metrics_answer(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Listen on "unix:/path" or "host:port".
+ */
+static int metrics_listen(const char *address) {
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Stats socket path too long: %s\n", address + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, address + 5);
+        unlink(addr.sun_path); // Left over from an earlier run
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+            perror("Failed to listen on stats socket");
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || (size_t)(colon - address) >= sizeof(host)) {
+        fprintf(stderr, "Error: Invalid stats address %s. Use IP:PORT or unix:PATH.\n", address);
+        return -1;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rv = getaddrinfo(host, colon + 1, &hints, &info);
+    if (rv != 0) {
+        fprintf(stderr, "Stats address resolution failed: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *addr = info; addr != NULL; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        int opt_reuse = 1;
+        if (fd != -1 && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_reuse, sizeof(opt_reuse)) == 0
+            && bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+            break;
+        }
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(info);
+    if (fd == -1) {
+        perror("Failed to listen on stats address");
+    }
+    return fd;
+}
+
+int metrics_serve(const char *address) {
+    int fd = metrics_listen(address);
+    if (fd == -1) {
+        return -1;
+    }
+    pthread_t thread;
+    int rv = pthread_create(&thread, NULL, metrics_main, (void*)(intptr_t)fd);
+    if (rv != 0) {
+        fprintf(stderr, "Failed to start stats thread: %s\n", strerror(rv));
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
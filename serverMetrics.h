@@ -0,0 +1,111 @@
+#ifndef __SERVER_METRICS
+#define __SERVER_METRICS
+
+/*
+
+Counters and latency histograms of the server.
+
+Every event loop owns a server_metrics and is the only thread that writes it: recording is
+an atomic store of the new value of a counter or histogram field (see histogram.h), with no
+lock and no atomic read-modify-write.
+The loops register their metrics once; metrics_serve() starts a thread that, for every
+connection to the stats address, adds up all registered metrics (reading each field
+atomically, so a scrape sees values at most a few updates old) and answers with the totals
+in the Prometheus text format. A request starting with "GET " gets an HTTP response around
+it, so Prometheus can scrape the address directly; anything else gets the bare text.
+
+The TCP listeners are watched too: every scrape reads their accept queue with TCP_INFO, and
+the kernel's count of connections dropped because a queue was full from /proc/net/netstat.
+
+Implementation in serverMetrics.cpp
+
+*/
+
+#include <stdint.h>
+#include "calcLib.h"
+#include "histogram.h"
+#include "slabPool.h"
+
+/**
+ * Stage of a session a timeout hit.
+ */
+enum metric_timeout {
+    TIMEOUT_HANDSHAKE,   // Greeting not sent or not answered in time
+    TIMEOUT_RESULT,      // Client did not send a result in time
+    TIMEOUT_SEND,        // Client did not read a task or verdict in time
+    TIMEOUT_COUNT
+};
+
+/**
+ * Latencies measured, in nanoseconds.
+ */
+enum metric_phase {
+    PHASE_HANDSHAKE,     // Accept to negotiated protocol
+    PHASE_TASK,          // Task queued to its result received
+    PHASE_SESSION,       // Accept to close
+    PHASE_COUNT
+};
+
+/**
+ * Slab pools of an event loop whose usage is reported.
+ */
+enum metric_pool {
+    POOL_SESSIONS,       // struct session
+    POOL_SESSION_COLD,   // struct session_cold
+    POOL_BUFFERS,        // First of the BUFFER_CLASSES buffer pool classes
+    POOL_COUNT = POOL_BUFFERS + BUFFER_CLASSES
+};
+
+struct server_metrics {
+    uint64_t accepts;
+    uint64_t shed;                 // Connections turned away with BUSY_MESSAGE
+    uint64_t evictions;            // Idle sessions dropped under pressure, also counted as timeouts
+    uint64_t timeout_ms[TIMEOUT_COUNT]; // Current timeout of every stage
+    uint64_t sessions_closed;      // Including the ones that failed to start
+    uint64_t handshake_failures;   // Bad or no reply to the greeting
+    uint64_t timeouts[TIMEOUT_COUNT];
+    uint64_t results[CALC_OP_COUNT][2]; // Indexed by operation, then correct
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    struct histogram latency[PHASE_COUNT];
+    struct slab_stats pools[POOL_COUNT]; // Written by the loop's slab pools
+};
+
+/**
+ * Add n to a counter of the calling thread's own metrics.
+ */
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set a gauge of the calling thread's own metrics.
+ */
+static inline void metrics_set(uint64_t *gauge, uint64_t value) {
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_latency(struct server_metrics *m, enum metric_phase phase, long long ns) {
+    histogram_record(&m->latency[phase], ns > 0 ? (uint64_t)ns : 0);
+}
+
+/**
+ * Clear m and include it in every scrape from now on. m must outlive the process.
+ */
+void metrics_register(struct server_metrics *m);
+
+/**
+ * Report the accept queue of a listening TCP socket in every scrape. Call once per socket,
+ * before metrics_serve().
+ */
+void metrics_watch_listener(int listen_socket);
+
+/**
+ * Answer scrapes on address, "host:port" for TCP or "unix:/path" for a Unix socket, from
+ * a background thread.
+ *
+ * @return: 0 on success, -1 if the address cannot be listened on.
+ */
+int metrics_serve(const char *address);
+
+#endif
@@ -3,120 +3,65 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
-#include <sys/time.h>
-#include <math.h>
 #include "calcLib.h"
+#include "serverEngine.h"
+#include "taskPool.h"
+#include "serverLog.h"
+#include "serverMetrics.h"
+#include "udpServer.h"
+#include "sessionTrace.h"
 
-#define MAX_QUEUE 5              // Maximum client connections in the queue
-#define RESPONSE_TIMEOUT 5       // Timeout (seconds) for client responses
-#define PROTOCOL_MESSAGE "TEXT TCP 1.0\n\n" // Protocol initialization message
-#define BUFFER_SIZE 1024         // Size for buffer
-#define FLOAT_PRECISION 0.0001   // Tolerance for floating-point comparison
+#define MAX_QUEUE SOMAXCONN      // Default --backlog; the kernel caps it at net.core.somaxconn
+#define MAX_WORKERS 256          // Upper bound for --workers
 
 /**
- * Get the readable IP address from a sockaddr structure (IPv4 or IPv6).
+ * One event loop thread and the listening socket it owns.
  */
-void *extract_ip_address(struct sockaddr *addr) {
-    if (addr->sa_family == AF_INET) { // IPv4
-        return &(((struct sockaddr_in*)addr)->sin_addr);
-    } else { // IPv6
-        return &(((struct sockaddr_in6*)addr)->sin6_addr);
-    }
-}
+struct worker {
+    pthread_t thread;
+    int listen_socket;
+    pthread_t udp_thread;
+    int udp_socket;              // TEXT UDP 1.0 socket served by udp_thread, -1 without --udp
+    const struct server_config *config;
+    int index;                   // Worker number, also its random stream
+    unsigned task_stream;        // Random stream of the worker's task pool
+    unsigned udp_stream;         // Random stream of the UDP thread
+    int cpu;                     // CPU to pin the thread to, -1 to let the scheduler decide
+};
 
 /**
- * Verify the correctness of a floating-point result sent by the client.
+ * Create a socket bound to ip:port, listening if it is a TCP socket.
  *
- * @param operation: The operation type (e.g., "fadd", "fsub").
- * @param operand1: First operand (floating-point).
- * @param operand2: Second operand (floating-point).
- * @param client_result: The result received from the client.
- * @return: 1 if the result is correct, 0 otherwise.
+ * @param server_ip: Host or address to bind to.
+ * @param server_port: Port (service) to bind to.
+ * @param socktype: SOCK_STREAM or SOCK_DGRAM.
+ * @param reuse_port: Set SO_REUSEPORT so several sockets can share the address.
+ * @param backlog: Length of the accept queue of a TCP socket.
+ * @return: The socket, or -1 on failure.
  */
-int check_float_result(const char* operation, double operand1, double operand2, double client_result) {
-    double expected_result = 0.0;
-
-    if (strcmp(operation, "fadd") == 0) {
-        expected_result = operand1 + operand2;
-    } else if (strcmp(operation, "fsub") == 0) {
-        expected_result = operand1 - operand2;
-    } else if (strcmp(operation, "fmul") == 0) {
-        expected_result = operand1 * operand2;
-    } else if (strcmp(operation, "fdiv") == 0) {
-        expected_result = operand1 / operand2;
-    }
-
-    return fabs(expected_result - client_result) < FLOAT_PRECISION; // Compare within tolerance
-}
-
-/**
- * Verify the correctness of an integer result sent by the client.
- *
- * @param operation: The operation type (e.g., "add", "sub").
- * @param operand1: First operand (integer).
- * @param operand2: Second operand (integer).
- * @param client_result: The result received from the client.
- * @return: 1 if the result is correct, 0 otherwise.
- */
-int check_integer_result(const char* operation, int operand1, int operand2, int client_result) {
-    int expected_result = 0;
-
-    if (strcmp(operation, "add") == 0) {
-        expected_result = operand1 + operand2;
-    } else if (strcmp(operation, "sub") == 0) {
-        expected_result = operand1 - operand2;
-    } else if (strcmp(operation, "mul") == 0) {
-        expected_result = operand1 * operand2;
-    } else if (strcmp(operation, "div") == 0) {
-        expected_result = operand1 / operand2;
-    }
-
-    return expected_result == client_result;
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <IP:PORT>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    initCalcLib(); // Initialize calculation library for random operations
-
-    // Parse server IP and port
-    char *server_ip = strtok(argv[1], ":");
-    char *server_port = strtok(NULL, ":");
-    if (server_ip == NULL || server_port == NULL) {
-        fprintf(stderr, "Error: Invalid format. Use IP:PORT.\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Server socket setup
-    int server_socket;
+static int create_listener(const char *server_ip, const char *server_port, int socktype, int reuse_port, int backlog) {
+    int server_socket = -1;
     struct addrinfo hints, *server_info, *addr;
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len;
-    char client_ip_str[INET6_ADDRSTRLEN];
     int opt_reuse = 1;
 
-    fd_set active_fds; // File descriptor set for monitoring client activity
-    struct timeval timeout; // Timeout structure
-
     // Address setup
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;     // Support both IPv4 and IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP socket
+    hints.ai_socktype = socktype;
     hints.ai_flags = AI_PASSIVE;     // Automatically bind to the host IP
 
     // Resolve address and port
     if (getaddrinfo(server_ip, server_port, &hints, &server_info) != 0) {
         perror("Address resolution failed");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Create and bind the server socket
@@ -131,7 +76,16 @@ int main(int argc, char *argv[]) {
         if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt_reuse, sizeof(int)) == -1) {
             perror("Setting socket options failed");
             close(server_socket);
-            exit(EXIT_FAILURE);
+            freeaddrinfo(server_info);
+            return -1;
+        }
+
+        // Let every worker bind its own socket; the kernel spreads connections across them
+        if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt_reuse, sizeof(int)) == -1) {
+            perror("Setting SO_REUSEPORT failed");
+            close(server_socket);
+            freeaddrinfo(server_info);
+            return -1;
         }
 
         if (bind(server_socket, addr->ai_addr, addr->ai_addrlen) == -1) {
@@ -147,121 +101,379 @@ int main(int argc, char *argv[]) {
 
     if (addr == NULL) {
         fprintf(stderr, "Failed to bind to any address\n");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Start listening for incoming connections
-    if (listen(server_socket, MAX_QUEUE) == -1) {
+    if (socktype == SOCK_STREAM && listen(server_socket, backlog) == -1) {
         perror("Listening failed");
-        exit(EXIT_FAILURE);
+        close(server_socket);
+        return -1;
+    }
+
+    return server_socket;
+}
+
+/**
+ * Create a Unix socket listening on path, replacing a socket file left from an earlier run.
+ *
+ * @param backlog: Length of the accept queue.
+ * @return: The socket, or -1 on failure.
+ */
+static int create_unix_listener(const char *path, int backlog) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
     }
+    strcpy(addr.sun_path, path);
+    unlink(path);
 
-    printf("Server running on %s:%s\n", server_ip, server_port);
+    int server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_socket == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    if (bind(server_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("Socket binding failed");
+        close(server_socket);
+        return -1;
+    }
+    if (listen(server_socket, backlog) == -1) {
+        perror("Listening failed");
+        close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
 
-    while (1) {
-        client_addr_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_addr_len);
-        if (client_socket == -1) {
-            perror("Failed to accept connection");
-            continue;
+/**
+ * Thread entry point: pin to the worker's CPU if requested, then serve its listener with
+ * tasks drawn from the worker's own random stream.
+ */
+static void *worker_main(void *arg) {
+    struct worker *w = (struct worker*)arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rv != 0) {
+            fprintf(stderr, "Failed to pin worker to CPU %d: %s\n", w->cpu, strerror(rv));
         }
+    }
 
-        // Convert client IP to readable string
-        inet_ntop(client_addr.ss_family, extract_ip_address((struct sockaddr*)&client_addr), client_ip_str, sizeof(client_ip_str));
-        printf("Connected to client: %s\n", client_ip_str);
+    initCalcLib_stream(w->index);
+    run_event_loop(w->listen_socket, w->config, w->task_stream);
+    exit(EXIT_FAILURE); // Serving only stops when a loop fails; its listener would strand connections
+}
 
-        // Send protocol message
-        if (send(client_socket, PROTOCOL_MESSAGE, strlen(PROTOCOL_MESSAGE), 0) == -1) {
-            perror("Failed to send protocol message");
-            close(client_socket);
-            continue;
-        }
+/**
+ * UDP thread entry point: serve the worker's UDP socket from the same CPU as the worker.
+ */
+static void *udp_main(void *arg) {
+    struct worker *w = (struct worker*)arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus); // Reported by the worker if it fails
+    }
 
-        // Prepare for client response
-        FD_ZERO(&active_fds);
-        FD_SET(client_socket, &active_fds);
-        timeout.tv_sec = RESPONSE_TIMEOUT;
-        timeout.tv_usec = 0;
-
-        // Wait for acknowledgment ("OK\n")
-        int activity = select(client_socket + 1, &active_fds, NULL, NULL, &timeout);
-        if (activity <= 0) {
-            printf("Client response timed out.\n");
-            send(client_socket, "ERROR TO\n", 9, 0);
-            close(client_socket);
-            continue;
+    initCalcLib_stream(w->udp_stream);
+    run_udp_loop(w->udp_socket, w->config);
+    exit(EXIT_FAILURE); // Serving only stops when a loop fails
+}
+
+/**
+ * Pick the CPU for worker number index among the CPUs this process may run on.
+ */
+static int worker_cpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return -1;
+    }
+    int count = CPU_COUNT(&allowed);
+    int wanted = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && wanted-- == 0) {
+            return cpu;
         }
+    }
+    return -1;
+}
 
-        char buffer[BUFFER_SIZE];
-        memset(buffer, 0, sizeof(buffer));
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received <= 0 || strcmp(buffer, "OK\n") != 0) {
-            printf("Invalid client response: %s\n", buffer);
-            close(client_socket);
-            continue;
+/**
+ * Log level named name, or -1.
+ */
+static int parse_log_level(const char *name) {
+    static const char *names[] = {"off", "error", "info", "debug"};
+    for (int level = LOG_OFF; level <= LOG_DEBUG; level++) {
+        if (strcmp(name, names[level]) == 0) {
+            return level;
         }
+    }
+    return -1;
+}
 
-        // Generate random operation
-        char* operation = randomType();
-        double op1_f, op2_f, result_f_client;
-        int op1_i, op2_i, result_i_client;
+/**
+ * Timeout given in seconds, as milliseconds. Exits on anything but a positive number.
+ */
+static unsigned parse_timeout(const char *option, const char *seconds) {
+    double value = strtod(seconds, NULL);
+    if (!(value >= 0.001 && value <= 3600)) {
+        fprintf(stderr, "Error: %s must be between 0.001 and 3600 seconds.\n", option);
+        exit(EXIT_FAILURE);
+    }
+    return (unsigned)(value * 1000 + 0.5);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s <IP:PORT | unix:PATH> [--workers N] [--pin] [--max-tasks N] [--max-window N] [--task-pool N] [--io-uring]\n"
+                    "       [--backlog N] [--max-sessions N] [--handshake-timeout S] [--result-timeout S] [--send-timeout S]\n"
+                    "       [--adaptive-timeouts] [--log-level L] [--log-sample N] [--stats ADDRESS] [--udp]\n"
+                    "       [--seed N] [--record FILE [--record-limit N]]\n", program);
+    fprintf(stderr, "  unix:PATH       Listen on a Unix socket; its clients may ask for the shared-memory transport\n");
+    fprintf(stderr, "  --workers N     Serve with N event loop threads, each with its own SO_REUSEPORT socket\n");
+    fprintf(stderr, "  --pin           Pin each worker thread to its own CPU\n");
+    fprintf(stderr, "  --max-tasks N   Close TEXT TCP 1.1 sessions after N tasks (default 0, no limit)\n");
+    fprintf(stderr, "  --max-window N  Most tasks a pipelined session may have outstanding (default %d)\n", MAX_WINDOW);
+    fprintf(stderr, "  --task-pool N   Tasks each worker keeps prepared, a power of two of at least 2, 0 to draw them on demand (default %d)\n", TASK_POOL_SIZE);
+    fprintf(stderr, "  --io-uring      Do the socket I/O through io_uring instead of epoll, if the kernel supports it\n");
+    fprintf(stderr, "  --backlog N     Connections each listener queues until they are accepted (default %d)\n", MAX_QUEUE);
+    fprintf(stderr, "  --max-sessions N Sessions open at once; further connections get \"ERROR BUSY\" (default 0, no limit)\n");
+    fprintf(stderr, "  --handshake-timeout S Seconds a client has to answer the greeting (default %d)\n", RESPONSE_TIMEOUT);
+    fprintf(stderr, "  --result-timeout S Seconds a client has to send a result (default %d)\n", RESPONSE_TIMEOUT);
+    fprintf(stderr, "  --send-timeout S Seconds a client has to read a task or verdict (default %d)\n", RESPONSE_TIMEOUT);
+    fprintf(stderr, "  --adaptive-timeouts Shorten the handshake and result timeouts to %dx the p%g latency of the clients\n",
+            ADAPT_FACTOR, ADAPT_PERCENTILE);
+    fprintf(stderr, "  --log-level L   Session log detail: off, error, info or debug (default debug, every task)\n");
+    fprintf(stderr, "  --log-sample N  Log only one session in N (default 1, all)\n");
+    fprintf(stderr, "  --stats ADDRESS Serve Prometheus metrics on IP:PORT or unix:PATH\n");
+    fprintf(stderr, "  --udp           Also serve TEXT UDP 1.0 on the same port, one UDP thread per worker\n");
+    fprintf(stderr, "  --seed N        Draw the tasks from seed N instead of the time, so a run can be repeated\n");
+    fprintf(stderr, "  --record FILE   Journal every TCP session to FILE, for calcreplay\n");
+    fprintf(stderr, "  --record-limit N Sessions the journal holds, later ones are not recorded (default %d)\n", TRACE_CAPACITY);
+    exit(EXIT_FAILURE);
+}
 
-        memset(buffer, 0, sizeof(buffer));
-        if (operation[0] == 'f') {
-            op1_f = randomFloat();
-            op2_f = randomFloat();
-            sprintf(buffer, "%s %8.8g %8.8g\n", operation, op1_f, op2_f);
+int main(int argc, char *argv[]) {
+    char *address = NULL;
+    int worker_count = 1;
+    int pin_workers = 0;
+    int log_level = LOG_DEBUG;
+    unsigned log_sample = 1;
+    const char *stats_address = NULL;
+    int serve_udp = 0;
+    int backlog = MAX_QUEUE;
+    const char *record_path = NULL;
+    unsigned long long record_limit = TRACE_CAPACITY;
+    const char *seed = NULL;
+    static struct server_config config;
+    config.max_window = MAX_WINDOW;
+    config.task_pool = TASK_POOL_SIZE;
+    config.handshake_timeout_ms = RESPONSE_TIMEOUT * 1000;
+    config.result_timeout_ms = RESPONSE_TIMEOUT * 1000;
+    config.send_timeout_ms = RESPONSE_TIMEOUT * 1000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+            if (worker_count < 1 || worker_count > MAX_WORKERS) {
+                fprintf(stderr, "Error: --workers must be between 1 and %d.\n", MAX_WORKERS);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--max-tasks") == 0 && i + 1 < argc) {
+            config.max_tasks = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-window") == 0 && i + 1 < argc) {
+            config.max_window = strtoul(argv[++i], NULL, 10);
+            if (config.max_window < 1 || config.max_window > MAX_WINDOW) {
+                fprintf(stderr, "Error: --max-window must be between 1 and %d.\n", MAX_WINDOW);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--task-pool") == 0 && i + 1 < argc) {
+            config.task_pool = strtoul(argv[++i], NULL, 10);
+            // A pool of one would never be over half full and its refill thread would spin
+            if (config.task_pool == 1 || (config.task_pool & (config.task_pool - 1)) != 0
+                || config.task_pool > (1u << 20)) {
+                fprintf(stderr, "Error: --task-pool must be 0 or a power of two from 2 up to %u.\n", 1u << 20);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            backlog = atoi(argv[++i]);
+            if (backlog < 1) {
+                fprintf(stderr, "Error: --backlog must be at least 1.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc) {
+            config.max_sessions = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--handshake-timeout") == 0 && i + 1 < argc) {
+            config.handshake_timeout_ms = parse_timeout(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--result-timeout") == 0 && i + 1 < argc) {
+            config.result_timeout_ms = parse_timeout(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--send-timeout") == 0 && i + 1 < argc) {
+            config.send_timeout_ms = parse_timeout(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--adaptive-timeouts") == 0) {
+            config.adaptive_timeouts = true;
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            log_level = parse_log_level(argv[++i]);
+            if (log_level == -1) {
+                fprintf(stderr, "Error: --log-level must be off, error, info or debug.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--log-sample") == 0 && i + 1 < argc) {
+            log_sample = strtoul(argv[++i], NULL, 10);
+            if (log_sample < 1) {
+                fprintf(stderr, "Error: --log-sample must be at least 1.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_address = argv[++i];
+        } else if (strcmp(argv[i], "--udp") == 0) {
+            serve_udp = 1;
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pin_workers = 1;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            config.io_uring = true;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--record-limit") == 0 && i + 1 < argc) {
+            record_limit = strtoull(argv[++i], NULL, 10);
+            if (record_limit < 1) {
+                fprintf(stderr, "Error: --record-limit must be at least 1.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (address == NULL && argv[i][0] != '-') {
+            address = argv[i];
         } else {
-            op1_i = randomInt();
-            op2_i = randomInt();
-            sprintf(buffer, "%s %d %d\n", operation, op1_i, op2_i);
+            usage(argv[0]);
         }
+    }
+    if (address == NULL) {
+        usage(argv[0]);
+    }
 
-        // Send task to client
-        send(client_socket, buffer, strlen(buffer), 0);
-        printf("Task sent to client: %s", buffer);
-
-        // Receive and validate client result
-        memset(buffer, 0, sizeof(buffer));
-        activity = select(client_socket + 1, &active_fds, NULL, NULL, &timeout);
-        if (activity <= 0) {
-            printf("Timeout waiting for client result.\n");
-            send(client_socket, "ERROR TO\n", 9, 0);
-            close(client_socket);
-            continue;
-        }
+    // Initialize calculation library for random operations
+    if (seed != NULL) {
+        initCalcLib_seed(strtoul(seed, NULL, 10));
+    } else {
+        initCalcLib();
+    }
 
-        bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received <= 0) {
-            printf("Client disconnected unexpectedly.\n");
-            close(client_socket);
-            continue;
+    // Parse server IP and port, or the socket path
+    const char *unix_path = strncmp(address, "unix:", 5) == 0 ? address + 5 : NULL;
+    char *server_ip = NULL;
+    char *server_port = NULL;
+    if (unix_path != NULL) {
+        if (serve_udp) {
+            fprintf(stderr, "Error: --udp needs an IP:PORT address.\n");
+            exit(EXIT_FAILURE);
         }
+    } else {
+        server_ip = strtok(address, ":");
+        server_port = strtok(NULL, ":");
+        if (server_ip == NULL || server_port == NULL) {
+            fprintf(stderr, "Error: Invalid format. Use IP:PORT or unix:PATH.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-        if (operation[0] == 'f') {
-            sscanf(buffer, "%lf", &result_f_client);
-            if (check_float_result(operation, op1_f, op2_f, result_f_client)) {
-                send(client_socket, "OK\n", 3, 0);
-                printf("Correct floating-point result.\n");
-            } else {
-                send(client_socket, "ERROR\n", 6, 0);
-                printf("Incorrect floating-point result.\n");
-            }
+    // Bind every listener before serving, so a bad address fails at startup. A Unix socket
+    // has no SO_REUSEPORT: the workers share one and race for its connections.
+    static struct worker workers[MAX_WORKERS];
+    char bound_port[NI_MAXSERV];
+    for (int i = 0; i < worker_count; i++) {
+        if (unix_path == NULL) {
+            workers[i].listen_socket = create_listener(server_ip, server_port, SOCK_STREAM, worker_count > 1, backlog);
         } else {
-            sscanf(buffer, "%d", &result_i_client);
-            if (check_integer_result(operation, op1_i, op2_i, result_i_client)) {
-                send(client_socket, "OK\n", 3, 0);
-                printf("Correct integer result.\n");
-            } else {
-                send(client_socket, "ERROR\n", 6, 0);
-                printf("Incorrect integer result.\n");
+            workers[i].listen_socket = i == 0 ? create_unix_listener(unix_path, backlog) : workers[0].listen_socket;
+        }
+        if (workers[i].listen_socket == -1) {
+            exit(EXIT_FAILURE);
+        }
+        if (unix_path == NULL) {
+            metrics_watch_listener(workers[i].listen_socket);
+        }
+        workers[i].index = i;
+        workers[i].task_stream = worker_count + i;
+        workers[i].udp_stream = 2 * worker_count + i;
+        workers[i].udp_socket = -1;
+        workers[i].cpu = pin_workers ? worker_cpu(i) : -1;
+        workers[i].config = &config;
+
+        if (i == 0 && unix_path == NULL) {
+            // With port 0 the kernel picks one; the other workers must join the same port
+            struct sockaddr_storage bound_addr;
+            socklen_t bound_len = sizeof(bound_addr);
+            getsockname(workers[0].listen_socket, (struct sockaddr*)&bound_addr, &bound_len);
+            if (getnameinfo((struct sockaddr*)&bound_addr, bound_len, NULL, 0, bound_port, sizeof(bound_port), NI_NUMERICSERV) == 0) {
+                server_port = bound_port;
             }
         }
+    }
 
-        close(client_socket); // Close client connection
+    // TEXT UDP 1.0 on the same port, once it is known
+    for (int i = 0; serve_udp && i < worker_count; i++) {
+        workers[i].udp_socket = create_listener(server_ip, server_port, SOCK_DGRAM, worker_count > 1, 0);
+        if (workers[i].udp_socket == -1) {
+            exit(EXIT_FAILURE);
+        }
     }
 
-    close(server_socket); // Close server socket
-    return 0;
-}
+    if (stats_address != NULL && metrics_serve(stats_address) == -1) {
+        exit(EXIT_FAILURE);
+    }
 
+    if (record_path != NULL
+        && trace_open(record_path, record_limit, strtoul(seed != NULL ? seed : "0", NULL, 10), seed != NULL, worker_count) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (unix_path != NULL) {
+        printf("Server running on unix:%s\n", unix_path);
+    } else {
+        printf("Server running on %s:%s\n", server_ip, server_port);
+    }
+    if (worker_count > 1) {
+        printf("Using %d workers%s\n", worker_count, pin_workers ? " pinned to CPUs" : "");
+    }
+    if (serve_udp) {
+        printf("Serving TEXT UDP 1.0 on the same port\n");
+    }
+    fflush(stdout);
+
+    // From here on stdout belongs to the log thread
+    if (log_start((enum log_level)log_level, log_sample) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; serve_udp && i < worker_count; i++) {
+        int rv = pthread_create(&workers[i].udp_thread, NULL, udp_main, &workers[i]);
+        if (rv != 0) {
+            fprintf(stderr, "Failed to start UDP thread %d: %s\n", i, strerror(rv));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Worker 0 runs on the main thread
+    for (int i = 1; i < worker_count; i++) {
+        int rv = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (rv != 0) {
+            fprintf(stderr, "Failed to start worker %d: %s\n", i, strerror(rv));
+            exit(EXIT_FAILURE);
+        }
+    }
+    worker_main(&workers[0]);
+
+    // Serving only stops when an event loop fails
+    exit(EXIT_FAILURE);
+}
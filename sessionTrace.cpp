@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sessionTrace.h"
+
+bool trace_active;
+
+static struct trace_header *journal;
+static size_t journal_size;
+static long long started_ns;     // CLOCK_MONOTONIC when the journal was opened
+static uint64_t flushed;         // Slots msync()ed so far, flush thread only
+static pthread_t flush_thread;
+
+static long long clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * msync() the slots committed since the last pass, and the header. Stops at the first slot
+ * that is claimed but not committed yet, so that a later pass syncs it once it is written.
+ */
+static void trace_flush(void) {
+    uint64_t claimed = journal->claimed.load(std::memory_order_acquire);
+    if (claimed > journal->capacity) {
+        claimed = journal->capacity;
+    }
+    const struct trace_record *records = (const struct trace_record*)(journal + 1);
+    uint64_t committed = flushed;
+    while (committed < claimed && records[committed].committed.load(std::memory_order_acquire)) {
+        committed++;
+    }
+    if (committed > flushed) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = (sizeof(struct trace_header) + flushed * sizeof(struct trace_record)) & ~(page - 1);
+        size_t end = sizeof(struct trace_header) + committed * sizeof(struct trace_record);
+        msync((char*)journal + start, end - start, MS_SYNC);
+        flushed = committed;
+    }
+    msync(journal, sizeof(struct trace_header), MS_SYNC);
+}
+
+static void *trace_main(void *) {
+    struct timespec interval = {TRACE_FLUSH_MS / 1000, (TRACE_FLUSH_MS % 1000) * 1000000L};
+    while (1) {
+        nanosleep(&interval, NULL);
+        trace_flush();
+    }
+    return NULL;
+}
+
+static void trace_close(void) {
+    pthread_cancel(flush_thread);
+    pthread_join(flush_thread, NULL);
+    trace_flush();
+}
+
+int trace_open(const char *path, uint64_t capacity, uint32_t seed, bool seeded, unsigned workers) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("Failed to create the session journal");
+        return -1;
+    }
+    journal_size = sizeof(struct trace_header) + capacity * sizeof(struct trace_record);
+    if (ftruncate(fd, journal_size) == -1) { // Sparse: only written slots take disk space
+        perror("Failed to size the session journal");
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, journal_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file
+    if (data == MAP_FAILED) {
+        perror("Failed to map the session journal");
+        return -1;
+    }
+
+    journal = (struct trace_header*)data;
+    memcpy(journal->magic, TRACE_MAGIC, sizeof(journal->magic));
+    journal->version = TRACE_VERSION;
+    journal->record_size = sizeof(struct trace_record);
+    journal->capacity = capacity;
+    journal->seed = seed;
+    journal->seeded = seeded;
+    journal->workers = workers;
+    journal->claimed.store(0, std::memory_order_relaxed);
+    journal->dropped.store(0, std::memory_order_relaxed);
+    started_ns = clock_ns(CLOCK_MONOTONIC);
+    journal->started_realtime_ns = clock_ns(CLOCK_REALTIME);
+
+    int rv = pthread_create(&flush_thread, NULL, trace_main, NULL);
+    if (rv != 0) {
+        fprintf(stderr, "Failed to start the journal flush thread: %s\n", strerror(rv));
+        return -1;
+    }
+    atexit(trace_close);
+    trace_active = true;
+    return 0;
+}
+
+void trace_append(const struct trace_record *record) {
+    uint64_t slot = journal->claimed.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= journal->capacity) {
+        journal->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    struct trace_record *r = (struct trace_record*)(journal + 1) + slot;
+    memcpy((void*)r, (const void*)record, offsetof(struct trace_record, committed));
+    r->accepted_ns = record->accepted_ns - started_ns;
+    r->committed.store(1, std::memory_order_release);
+}
+
+const struct trace_header *trace_map(const char *path, uint64_t *count, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("Failed to open the session journal");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s is not a session journal\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Failed to map the session journal");
+        return NULL;
+    }
+
+    const struct trace_header *header = (const struct trace_header*)data;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != TRACE_VERSION
+        || header->record_size != sizeof(struct trace_record)
+        || header->capacity > (SIZE_MAX - sizeof(struct trace_header)) / sizeof(struct trace_record)
+        || (size_t)st.st_size < sizeof(struct trace_header) + header->capacity * sizeof(struct trace_record)) {
+        fprintf(stderr, "%s is not a version %d session journal\n", path, TRACE_VERSION);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    uint64_t claimed = header->claimed.load(std::memory_order_acquire);
+    *count = claimed < header->capacity ? claimed : header->capacity;
+    *size = st.st_size;
+    return header;
+}
@@ -0,0 +1,129 @@
+#ifndef __SESSION_TRACE
+#define __SESSION_TRACE
+
+/*
+
+Session journal of the server (--record), read back by the replayer (calcreplay).
+
+A journal is a file of one trace_header followed by up to header.capacity trace_record
+slots, sized up front and memory-mapped shared. A session fills its trace_record as it goes
+and, when it closes, claims the next slot with one atomic increment of header.claimed and
+copies the record there: no system call per session. The record's committed field is set
+last, so a reader skips slots that were claimed but not yet (or never) filled. Once the
+journal is full further sessions are not recorded, only counted.
+
+A background thread msync()s the slots written since its last pass every TRACE_FLUSH_MS,
+and once more when the process exits normally; the page cache keeps what was written even
+if the server is killed.
+
+Records are in order of the end of their session; a reader sorts them by accepted_ns. The
+first task of a session is recorded in full (the only one of a TEXT TCP 1.0 session); for
+later ones the record only keeps counts and the time of the last result.
+
+Implementation in sessionTrace.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "calcLib.h"
+
+#define TRACE_MAGIC "CALCTRC1"
+#define TRACE_VERSION 1
+#define TRACE_FLUSH_MS 1000      // Time between two msync() passes
+#define TRACE_CAPACITY 1000000   // Default number of sessions a journal holds
+#define TRACE_NEVER UINT32_MAX   // Phase time of a phase the session never reached
+#define TRACE_NO_VERDICT 2       // verdict of a first task that never got one
+
+/**
+ * How a session ended.
+ */
+enum trace_end {
+    TRACE_END_ERROR,             // Closed by the server: protocol violation, line too long, failed send
+    TRACE_END_DONE,              // Closed by the server after the last verdict
+    TRACE_END_QUIT,              // The client sent QUIT
+    TRACE_END_CLOSED,            // The client closed the connection
+    TRACE_END_TIMEOUT            // The client was too slow, "ERROR TO"
+};
+
+struct trace_header {
+    char magic[8];               // TRACE_MAGIC
+    uint32_t version;            // TRACE_VERSION
+    uint32_t record_size;        // sizeof(struct trace_record)
+    uint64_t capacity;           // Record slots after the header
+    uint64_t started_realtime_ns; // Wall clock when the journal was opened, accepted_ns counts from here
+    uint32_t seed;               // --seed of the server, valid if seeded
+    uint32_t seeded;
+    uint32_t workers;
+    uint32_t reserved;
+    alignas(64) std::atomic<uint64_t> claimed; // Slots claimed so far, may exceed capacity
+    alignas(64) std::atomic<uint64_t> dropped; // Sessions not recorded because the journal was full
+};
+
+/**
+ * One session. Phase times are microseconds after accepted_ns, TRACE_NEVER if not reached.
+ */
+struct trace_record {
+    uint64_t accepted_ns;        // Accept time, nanoseconds after the journal was opened
+    uint32_t negotiated_us;      // Protocol reply handled
+    uint32_t first_task_us;      // First task queued
+    uint32_t first_result_us;    // Result of the first task received
+    uint32_t last_result_us;     // Last result received
+    uint32_t closed_us;          // Session closed
+    uint32_t tasks;              // Verdicts sent
+    uint32_t correct;            // Of them correct
+    uint8_t protocol;            // session_protocol
+    uint8_t tagged;              // Sequence numbers on the wire (a window was asked for)
+    uint8_t window;
+    uint8_t end;                 // trace_end
+    uint8_t op;                  // First task: calc_op_t
+    uint8_t verdict;             // First task: 1 correct, 0 incorrect, TRACE_NO_VERDICT
+    uint8_t family;              // Peer address family, AF_INET, AF_INET6 or AF_UNIX
+    uint8_t shm;                 // Moved to the shared-memory transport
+    calc_value_t a, b;           // First task: operands
+    calc_value_t answer;         // First task: the client's result
+    uint16_t port;               // Peer port, host order
+    uint8_t address[16];         // Peer address, IPv4 in the first 4 bytes
+    uint8_t reserved[37];
+    std::atomic<uint8_t> committed; // Set once the rest is in
+};
+
+static_assert(sizeof(struct trace_header) == 192, "trace_header layout changed");
+static_assert(sizeof(struct trace_record) == 128, "trace_record layout changed");
+
+/**
+ * Create (or truncate) the journal at path and start its flush thread.
+ *
+ * @param capacity: Sessions it can hold.
+ * @param seed: Seed the tasks are drawn with, recorded if seeded.
+ * @return: 0 on success, -1 on failure.
+ */
+int trace_open(const char *path, uint64_t capacity, uint32_t seed, bool seeded, unsigned workers);
+
+/**
+ * Whether a journal is open; sessions skip tracing otherwise.
+ */
+extern bool trace_active;
+
+/**
+ * Append a finished session to the journal. Safe to call from any thread.
+ *
+ * @param record: The session's record, accepted_ns still absolute (CLOCK_MONOTONIC).
+ */
+void trace_append(const struct trace_record *record);
+
+/**
+ * Map a journal for reading.
+ *
+ * @param count: Receives the number of slots that were claimed and fit.
+ * @param size: Receives the size of the mapping, for munmap().
+ * @return: The header, the records follow it; NULL with a message on stderr on failure.
+ */
+const struct trace_header *trace_map(const char *path, uint64_t *count, size_t *size);
+
+static inline const struct trace_record *trace_records(const struct trace_header *header) {
+    return (const struct trace_record*)(header + 1);
+}
+
+#endif
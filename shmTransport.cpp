@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <errno.h>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "shmTransport.h"
+
+void shm_ring_doorbell(int doorbell) {
+    eventfd_write(doorbell, 1);
+}
+
+void shm_drain_doorbell(int doorbell) {
+    eventfd_t count;
+    eventfd_read(doorbell, &count); // Non-blocking: fails with EAGAIN if nothing is pending
+}
+
+struct shm_channel *shm_channel_create(int fds[SHM_FD_COUNT]) {
+    for (int i = 0; i < SHM_FD_COUNT; i++) {
+        fds[i] = -1;
+    }
+    fds[SHM_FD_MEMORY] = memfd_create("calc-shm", MFD_CLOEXEC);
+    fds[SHM_FD_SERVER_DOORBELL] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[SHM_FD_CLIENT_DOORBELL] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    void *memory = MAP_FAILED;
+    if (fds[SHM_FD_MEMORY] != -1 && fds[SHM_FD_SERVER_DOORBELL] != -1 && fds[SHM_FD_CLIENT_DOORBELL] != -1
+        && ftruncate(fds[SHM_FD_MEMORY], sizeof(struct shm_channel)) == 0) {
+        memory = mmap(NULL, sizeof(struct shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_MEMORY], 0);
+    }
+    if (memory == MAP_FAILED) {
+        perror("Failed to create shared memory channel");
+        for (int i = 0; i < SHM_FD_COUNT; i++) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+        return NULL;
+    }
+    return new (memory) shm_channel(); // Zeroed by ftruncate(), the constructor only makes it official
+}
+
+struct shm_channel *shm_channel_map(int memory_fd) {
+    struct stat info;
+    if (fstat(memory_fd, &info) == -1 || (size_t)info.st_size != sizeof(struct shm_channel)) {
+        return NULL;
+    }
+    void *memory = mmap(NULL, sizeof(struct shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+    return memory == MAP_FAILED ? NULL : (struct shm_channel*)memory;
+}
+
+void shm_channel_unmap(struct shm_channel *channel) {
+    munmap(channel, sizeof(*channel));
+}
+
+ssize_t shm_send_fds(int socket, const char *message, size_t length, const int fds[SHM_FD_COUNT]) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * SHM_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {(void*)message, length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SHM_FD_COUNT);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * SHM_FD_COUNT);
+    return sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+ssize_t shm_recv_fds(int socket, void *buffer, size_t length, int fds[SHM_FD_COUNT], int *fd_count) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * SHM_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {buffer, length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    *fd_count = 0;
+    ssize_t received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    if (received == -1) {
+        return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*fd_count < SHM_FD_COUNT) {
+                fds[(*fd_count)++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    return received;
+}
@@ -0,0 +1,174 @@
+#ifndef __SHM_TRANSPORT
+#define __SHM_TRANSPORT
+
+/*
+
+Shared-memory transport for clients on the same host, shared by the server and the client.
+
+A client connected over a Unix socket may answer the greeting with SHM_REQUEST before its
+protocol reply. The server answers on the socket with either SHM_DECLINE, and the session
+goes on over the socket, or SHM_ACCEPT carrying three file descriptors (SCM_RIGHTS):
+
+  SHM_FD_MEMORY          memfd holding a shm_channel
+  SHM_FD_SERVER_DOORBELL eventfd the server waits on
+  SHM_FD_CLIENT_DOORBELL eventfd the client waits on
+
+From then on every byte of the session (starting with the client's protocol reply) goes
+through the two single-producer single-consumer byte rings of the channel instead of the
+socket, with exactly the framing it would have on the socket. The socket stays open: the
+client closing it ends the session, like on TCP.
+
+Neither side makes a system call while the other keeps up. A side about to block sets its
+*_sleeping flag, checks the rings once more and then waits on its doorbell; the other side
+rings that doorbell (one eventfd write) only when it finds the flag set after producing or
+consuming, and clears the flag as it does. The server sets server_closed (and always rings
+the client) when it ends the session, after any last output is in the ring.
+
+Implementation in shmTransport.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <atomic>
+
+#define SHM_REQUEST "SHM 1.0\n"  // Client asks for the shared-memory transport
+#define SHM_ACCEPT "SHM OK\n"    // Server agrees, with the descriptors attached
+#define SHM_DECLINE "SHM NO\n"   // Server stays on the socket
+#define SHM_RING_SIZE 16384      // Bytes per direction, a power of two
+#define SHM_SPIN 256             // Polls of an empty ring before a client goes to sleep
+
+enum shm_fd {
+    SHM_FD_MEMORY,
+    SHM_FD_SERVER_DOORBELL,
+    SHM_FD_CLIENT_DOORBELL,
+    SHM_FD_COUNT
+};
+
+/**
+ * One direction. head and tail count bytes from the start and are only ever increased, by
+ * the consumer and the producer respectively.
+ */
+struct shm_ring {
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    alignas(64) char data[SHM_RING_SIZE];
+};
+
+struct shm_channel {
+    alignas(64) std::atomic<uint32_t> server_sleeping;
+    alignas(64) std::atomic<uint32_t> client_sleeping;
+    alignas(64) std::atomic<uint32_t> server_closed;
+    struct shm_ring to_client;
+    struct shm_ring to_server;
+};
+
+/**
+ * Bytes waiting in a ring (consumer side).
+ */
+static inline uint32_t shm_ring_length(const struct shm_ring *ring) {
+    return ring->tail.load(std::memory_order_acquire) - ring->head.load(std::memory_order_relaxed);
+}
+
+/**
+ * Bytes that can be written to a ring (producer side).
+ */
+static inline uint32_t shm_ring_room(const struct shm_ring *ring) {
+    return SHM_RING_SIZE - (ring->tail.load(std::memory_order_relaxed) - ring->head.load(std::memory_order_acquire));
+}
+
+/**
+ * Copy up to length bytes into a ring.
+ *
+ * @return: Bytes written, 0 if the ring is full.
+ */
+static inline size_t shm_ring_write(struct shm_ring *ring, const void *data, size_t length) {
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint32_t room = SHM_RING_SIZE - (tail - ring->head.load(std::memory_order_acquire));
+    if (length > room) {
+        length = room;
+    }
+    uint32_t offset = tail & (SHM_RING_SIZE - 1);
+    size_t first = SHM_RING_SIZE - offset < length ? SHM_RING_SIZE - offset : length;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const char*)data + first, length - first);
+    ring->tail.store(tail + (uint32_t)length, std::memory_order_release);
+    return length;
+}
+
+/**
+ * Move up to length bytes out of a ring.
+ *
+ * @return: Bytes read, 0 if the ring is empty.
+ */
+static inline size_t shm_ring_read(struct shm_ring *ring, void *out, size_t length) {
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    uint32_t available = ring->tail.load(std::memory_order_acquire) - head;
+    if (length > available) {
+        length = available;
+    }
+    uint32_t offset = head & (SHM_RING_SIZE - 1);
+    size_t first = SHM_RING_SIZE - offset < length ? SHM_RING_SIZE - offset : length;
+    memcpy(out, ring->data + offset, first);
+    memcpy((char*)out + first, ring->data, length - first);
+    ring->head.store(head + (uint32_t)length, std::memory_order_release);
+    return length;
+}
+
+/**
+ * Wake the side waiting on doorbell.
+ */
+void shm_ring_doorbell(int doorbell);
+
+/**
+ * After producing into or consuming from a ring: wake the other side if it went to sleep.
+ */
+static inline void shm_wake(std::atomic<uint32_t> *sleeping, int doorbell) {
+    std::atomic_thread_fence(std::memory_order_seq_cst); // Order the ring update before the check
+    if (sleeping->load(std::memory_order_relaxed) && sleeping->exchange(0, std::memory_order_seq_cst)) {
+        shm_ring_doorbell(doorbell);
+    }
+}
+
+/**
+ * Create a channel and its doorbells (server side).
+ *
+ * @param fds: Receives the SHM_FD_COUNT descriptors, to pass to the client.
+ * @return: The mapped channel, or NULL on failure.
+ */
+struct shm_channel *shm_channel_create(int fds[SHM_FD_COUNT]);
+
+/**
+ * Map the channel in a memfd received from the server (client side).
+ *
+ * @return: The mapped channel, or NULL if the memfd is not a channel.
+ */
+struct shm_channel *shm_channel_map(int memory_fd);
+
+void shm_channel_unmap(struct shm_channel *channel);
+
+/**
+ * Send a message with the channel's descriptors attached, without blocking.
+ *
+ * @return: Bytes sent, or -1 with errno set.
+ */
+ssize_t shm_send_fds(int socket, const char *message, size_t length, const int fds[SHM_FD_COUNT]);
+
+/**
+ * recv() that also takes descriptors passed along with the data. Descriptors beyond
+ * SHM_FD_COUNT are closed.
+ *
+ * @param fds: Receives the descriptors.
+ * @param fd_count: Number of descriptors received, 0 if none.
+ * @return: As recv().
+ */
+ssize_t shm_recv_fds(int socket, void *buffer, size_t length, int fds[SHM_FD_COUNT], int *fd_count);
+
+/**
+ * Consume the wakeups pending on a doorbell.
+ */
+void shm_drain_doorbell(int doorbell);
+
+#endif
@@ -0,0 +1,79 @@
+#include <sys/mman.h>
+#include "slabPool.h"
+
+/**
+ * Add n to a counter only the owner of the pool writes.
+ */
+static inline void stat_add(uint64_t *counter, int64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void slab_init(struct slab_pool *pool, size_t object_size, struct slab_stats *stats) {
+    pool->object_size = (object_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    pool->free_list = NULL;
+    pool->next = pool->end = NULL;
+    pool->stats = stats;
+}
+
+void *slab_alloc(struct slab_pool *pool) {
+    void *object = pool->free_list;
+    if (object != NULL) {
+        pool->free_list = *(void**)object;
+    } else {
+        if (pool->next == NULL || (size_t)(pool->end - pool->next) < pool->object_size) {
+            // What is left of the current slab is smaller than an object and stays unused
+            void *slab = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED) {
+                stat_add(&pool->stats->failures, 1);
+                return NULL;
+            }
+            pool->next = (char*)slab;
+            pool->end = (char*)slab + SLAB_SIZE;
+            stat_add(&pool->stats->slabs, 1);
+        }
+        object = pool->next;
+        pool->next += pool->object_size;
+    }
+
+    struct slab_stats *stats = pool->stats;
+    stat_add(&stats->allocations, 1);
+    stat_add(&stats->in_use, 1);
+    if (stats->in_use > stats->peak) {
+        stat_add(&stats->peak, stats->in_use - stats->peak);
+    }
+    return object;
+}
+
+void slab_free(struct slab_pool *pool, void *object) {
+    *(void**)object = pool->free_list;
+    pool->free_list = object;
+    stat_add(&pool->stats->in_use, -1);
+}
+
+/**
+ * Index of the smallest buffer class holding size bytes.
+ */
+static unsigned buffer_class(size_t size) {
+    unsigned index = 0;
+    while ((BUFFER_MIN_SIZE << index) < size) {
+        index++;
+    }
+    return index;
+}
+
+void buffer_pool_init(struct buffer_pool *pool, struct slab_stats *stats) {
+    for (unsigned i = 0; i < BUFFER_CLASSES; i++) {
+        slab_init(&pool->classes[i], BUFFER_MIN_SIZE << i, &stats[i]);
+    }
+}
+
+void *buffer_alloc(struct buffer_pool *pool, size_t size) {
+    if (size > BUFFER_MAX_SIZE) {
+        return NULL;
+    }
+    return slab_alloc(&pool->classes[buffer_class(size)]);
+}
+
+void buffer_free(struct buffer_pool *pool, void *buffer, size_t size) {
+    slab_free(&pool->classes[buffer_class(size)], buffer);
+}
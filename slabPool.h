@@ -0,0 +1,93 @@
+#ifndef __SLAB_POOL
+#define __SLAB_POOL
+
+/*
+
+Slab allocator for the fixed-size objects of an event loop: sessions, their cold parts, and
+the buffers a session only takes while it needs more room than it has inline.
+
+A slab_pool hands out objects of one size, rounded up to a cache line, so no two objects
+share a line and every object starts on one. Objects are cut from SLAB_SIZE slabs mapped
+on demand; the slab's pages are only touched as objects are cut from it. A freed object
+goes on the pool's free list and is handed out again before the next one is cut. Slabs are
+kept for the life of the pool, so its footprint is that of its peak.
+
+A buffer_pool is a set of slab pools for BUFFER_CLASSES power-of-two sizes, from
+BUFFER_MIN_SIZE to BUFFER_MAX_SIZE. A request takes a buffer of the smallest class that
+fits it.
+
+Pools are not thread-safe: each event loop owns its own. Every pool counts its slabs and
+objects in a slab_stats, updated with relaxed atomic stores so another thread (the metrics
+scraper) may read it while the owner allocates.
+
+Implementation in slabPool.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+#define SLAB_SIZE (256 << 10)    // Bytes mapped per slab
+#define BUFFER_MIN_SHIFT 6       // Smallest buffer class, 64 bytes
+#define BUFFER_CLASSES 7         // 64 bytes to 4 KiB
+#define BUFFER_MIN_SIZE ((size_t)1 << BUFFER_MIN_SHIFT)
+#define BUFFER_MAX_SIZE (BUFFER_MIN_SIZE << (BUFFER_CLASSES - 1))
+
+struct slab_stats {
+    uint64_t slabs;              // Slabs mapped, SLAB_SIZE bytes each
+    uint64_t in_use;             // Objects handed out and not freed
+    uint64_t peak;               // Most objects in use at once
+    uint64_t allocations;
+    uint64_t failures;           // Allocations that found no memory
+};
+
+struct slab_pool {
+    size_t object_size;          // Multiple of CACHE_LINE
+    void *free_list;             // Freed objects, linked through their first word
+    char *next;                  // Next object to cut from the current slab
+    char *end;                   // End of the current slab
+    struct slab_stats *stats;
+};
+
+struct buffer_pool {
+    struct slab_pool classes[BUFFER_CLASSES];
+};
+
+/**
+ * Set up an empty pool of object_size objects, counting into stats.
+ */
+void slab_init(struct slab_pool *pool, size_t object_size, struct slab_stats *stats);
+
+/**
+ * Take an object: cache-line aligned, contents undefined.
+ *
+ * @return: The object, or NULL if no slab could be mapped.
+ */
+void *slab_alloc(struct slab_pool *pool);
+
+/**
+ * Give back an object taken from the same pool.
+ */
+void slab_free(struct slab_pool *pool, void *object);
+
+/**
+ * Set up an empty buffer pool, counting every class into its own entry of stats.
+ *
+ * @param stats: BUFFER_CLASSES entries.
+ */
+void buffer_pool_init(struct buffer_pool *pool, struct slab_stats *stats);
+
+/**
+ * Take a buffer of at least size bytes, at most BUFFER_MAX_SIZE.
+ *
+ * @return: The buffer, or NULL if no memory is left.
+ */
+void *buffer_alloc(struct buffer_pool *pool, size_t size);
+
+/**
+ * Give back a buffer, with the size it was asked for.
+ */
+void buffer_free(struct buffer_pool *pool, void *buffer, size_t size);
+
+#endif
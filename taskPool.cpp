@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lineFramer.h"
+#include "taskPool.h"
+
+void task_prepare(struct prepared_task *task, const calc_task_batch_t *batch, size_t i) {
+    const calc_op_info_t *info = &calcOps[batch->op[i]];
+
+    task->op = batch->op[i];
+    task->a = batch->a[i];
+    task->b = batch->b[i];
+    task->expected = batch->expected[i];
+
+    memset(&task->frame, 0, sizeof(task->frame));
+    task->frame.opcode = task->op;
+    task->frame.width = info->is_float ? BINARY_WIDTH_FLOAT : BINARY_WIDTH_INT;
+    if (info->is_float) {
+        task->frame.a.f = task->a.f;
+        task->frame.b.f = task->b.f;
+    } else {
+        task->frame.a.i = task->a.i;
+        task->frame.b.i = task->b.i;
+    }
+
+    char *line = task->text;
+    size_t length = info->length;
+    memcpy(line, info->name, length);
+    line[length++] = ' ';
+    if (info->is_float) {
+        length += format_float8(line + length, task->a.f);
+        line[length++] = ' ';
+        length += format_float8(line + length, task->b.f);
+    } else {
+        length += format_int(line + length, task->a.i);
+        line[length++] = ' ';
+        length += format_int(line + length, task->b.i);
+    }
+    line[length++] = '\n';
+    task->text_length = (uint8_t)length;
+}
+
+/**
+ * Refill thread: top the ring up a batch at a time, sleep while it is over half full.
+ */
+static void *task_pool_main(void *arg) {
+    struct task_pool *pool = (struct task_pool*)arg;
+    uint32_t capacity = pool->mask + 1;
+    calc_task_batch_t batch;
+
+    while (1) {
+        uint32_t tail = pool->tail.load(std::memory_order_relaxed);
+        uint32_t free_slots = capacity - (tail - pool->head.load(std::memory_order_acquire));
+
+        if (free_slots < capacity / 2) {
+            pthread_mutex_lock(&pool->lock);
+            pool->sleeping.store(1, std::memory_order_seq_cst);
+            // Check again after announcing the sleep, the event loop may have drained it meanwhile
+            while (pool->sleeping.load(std::memory_order_seq_cst)
+                   && tail - pool->head.load(std::memory_order_seq_cst) > capacity / 2) {
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+            pool->sleeping.store(0, std::memory_order_relaxed);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        size_t count = free_slots < CALC_BATCH_SIZE ? free_slots : CALC_BATCH_SIZE;
+        calcRngTaskBatch(&pool->rng, &batch, count);
+        for (size_t i = 0; i < count; i++) {
+            task_prepare(&pool->tasks[(tail + i) & pool->mask], &batch, i);
+        }
+        pool->tail.store(tail + (uint32_t)count, std::memory_order_release);
+    }
+    return NULL;
+}
+
+void task_pool_wake(struct task_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->sleeping.store(0, std::memory_order_relaxed);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int task_pool_start(struct task_pool *pool, size_t capacity, unsigned stream) {
+    pool->tasks = (struct prepared_task*)calloc(capacity, sizeof(struct prepared_task));
+    if (pool->tasks == NULL) {
+        perror("Failed to allocate task pool");
+        return -1;
+    }
+    pool->mask = (uint32_t)capacity - 1;
+    pool->head.store(0);
+    pool->tail.store(0);
+    pool->sleeping.store(0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    calcRngStream(&pool->rng, stream);
+
+    int rv = pthread_create(&pool->thread, NULL, task_pool_main, pool);
+    if (rv != 0) {
+        fprintf(stderr, "Failed to start task pool thread: %s\n", strerror(rv));
+        free(pool->tasks);
+        pool->tasks = NULL;
+        return -1;
+    }
+    pthread_detach(pool->thread);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef __TASK_POOL
+#define __TASK_POOL
+
+/*
+
+Pool of prepared tasks for one event loop.
+
+A background thread draws tasks in batches (randomTaskBatch()), renders them into the bytes
+they take on the wire and stores them, with their expected results, in a single-producer
+single-consumer ring. Handing out a task on the event loop is then a copy of ready bytes,
+and checking a result is a compare against the cached answer.
+
+The refill thread sleeps while the ring is more than half full and is woken by the event
+loop once it drops below that. When the ring runs empty the event loop prepares a task
+itself instead of waiting.
+
+Implementation in taskPool.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include "calcLib.h"
+#include "binaryProtocol.h"
+
+#define TASK_TEXT_SIZE 48        // Room for "fdiv <%8.8g> <%8.8g>\n"
+#define TASK_POOL_SIZE 4096      // Default number of prepared tasks per event loop
+
+/**
+ * A task rendered for every protocol. The sequence number is left out: it is written in
+ * front of text and into frame.seq when the task is handed to a session.
+ */
+struct prepared_task {
+    calc_op_t op;
+    calc_value_t a, b;
+    calc_value_t expected;       // Reference result
+    struct binary_frame frame;   // BINARY TCP 1.0 task, seq 0
+    uint8_t text_length;
+    char text[TASK_TEXT_SIZE];   // "op a b\n", as "%s %8.8g %8.8g\n" or "%s %d %d\n"
+};
+
+struct task_pool {
+    struct prepared_task *tasks;
+    uint32_t mask;               // Capacity - 1, the capacity is a power of two
+    std::atomic<uint32_t> head;  // Next task to hand out, advanced by the event loop
+    std::atomic<uint32_t> tail;  // Next free entry, advanced by the refill thread
+    std::atomic<int> sleeping;   // Refill thread waits for the ring to drain
+    calc_rng_t rng;              // Used by the refill thread only
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+/**
+ * Render task i of a batch.
+ */
+void task_prepare(struct prepared_task *task, const calc_task_batch_t *batch, size_t i);
+
+/**
+ * Allocate a pool of capacity (a power of two, at least 2) tasks and start its refill thread, which
+ * draws from random stream stream (see initCalcLib_stream()).
+ *
+ * @return: 0 on success, -1 on failure.
+ */
+int task_pool_start(struct task_pool *pool, size_t capacity, unsigned stream);
+
+/**
+ * Next prepared task, or NULL if the pool is empty. Stays valid until task_pool_pop().
+ */
+static inline const struct prepared_task *task_pool_front(struct task_pool *pool) {
+    uint32_t head = pool->head.load(std::memory_order_relaxed);
+    if (head == pool->tail.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    return &pool->tasks[head & pool->mask];
+}
+
+void task_pool_wake(struct task_pool *pool);
+
+/**
+ * Release the task returned by task_pool_front().
+ */
+static inline void task_pool_pop(struct task_pool *pool) {
+    uint32_t head = pool->head.load(std::memory_order_relaxed) + 1;
+    pool->head.store(head, std::memory_order_seq_cst);
+    if (pool->sleeping.load(std::memory_order_seq_cst)
+        && pool->tail.load(std::memory_order_relaxed) - head <= (pool->mask + 1) / 2) {
+        task_pool_wake(pool);
+    }
+}
+
+#endif
@@ -0,0 +1,182 @@
+#include <string.h>
+#include <limits.h>
+#include "timerWheel.h"
+
+#define SLOT_MASK (TIMER_LEVEL_SLOTS - 1)
+#define NOT_ON_WHEEL 0xff        // Level of nodes taken off the wheel to be fired
+
+static void list_init(struct timer_node *head) {
+    head->prev = head->next = head;
+}
+
+static void list_append(struct timer_node *head, struct timer_node *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_unlink(struct timer_node *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+/**
+ * Put an armed node in the slot that matches its distance from the current tick.
+ */
+static void wheel_link(struct timer_wheel *wheel, struct timer_node *node) {
+    if (node->expires < wheel->now) {
+        node->expires = wheel->now;
+    }
+
+    uint64_t delta = node->expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS))) {
+        node->expires = wheel->now + (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1; // Clamp to the wheel's range
+    }
+
+    int slot = (node->expires >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+    node->level = level;
+    node->slot = slot;
+    list_append(&wheel->slots[level][slot], node);
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * Re-distribute the timers of an upper-level slot over the levels below it.
+ */
+static void wheel_cascade(struct timer_wheel *wheel, int level, int slot) {
+    struct timer_node *head = &wheel->slots[level][slot];
+    struct timer_node pending;
+
+    if (head->next == head) {
+        return;
+    }
+
+    // Move the whole slot aside first, relinking may land nodes back on this level
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+    wheel->occupied[level] &= ~(1ULL << slot);
+
+    while (pending.next != &pending) {
+        struct timer_node *node = pending.next;
+        list_unlink(node);
+        wheel_link(wheel, node);
+    }
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, long long now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_LEVEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->now = now_ms / TIMER_TICK_MS;
+}
+
+void timer_wheel_arm(struct timer_wheel *wheel, struct timer_node *node, long long deadline_ms) {
+    timer_wheel_cancel(wheel, node);
+    node->expires = (deadline_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    wheel_link(wheel, node);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer_node *node) {
+    if (!timer_wheel_armed(node)) {
+        return;
+    }
+    int level = node->level;
+    int slot = node->slot;
+    list_unlink(node);
+    if (level != NOT_ON_WHEEL) {
+        struct timer_node *head = &wheel->slots[level][slot];
+        if (head->next == head) {
+            wheel->occupied[level] &= ~(1ULL << slot);
+        }
+    }
+    wheel->count--;
+}
+
+size_t timer_wheel_advance(struct timer_wheel *wheel, long long now_ms, timer_callback callback, void *context) {
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    size_t fired = 0;
+
+    while (wheel->now <= target) {
+        if (wheel->count == 0) {
+            wheel->now = target + 1; // Nothing to cascade or fire, jump ahead
+            break;
+        }
+
+        int index = wheel->now & SLOT_MASK;
+        if (index == 0) {
+            // Level 0 wrapped: pull down the next slot of each level that wrapped as well
+            for (int level = 1; level < TIMER_LEVELS; level++) {
+                int slot = (wheel->now >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+                wheel_cascade(wheel, level, slot);
+                if (slot != 0) {
+                    break;
+                }
+            }
+        }
+
+        struct timer_node *head = &wheel->slots[0][index];
+        if (head->next != head) {
+            struct timer_node due;
+            due.next = head->next;
+            due.prev = head->prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            list_init(head);
+            wheel->occupied[0] &= ~(1ULL << index);
+
+            for (struct timer_node *node = due.next; node != &due; node = node->next) {
+                node->level = NOT_ON_WHEEL;
+            }
+            while (due.next != &due) {
+                struct timer_node *node = due.next;
+                list_unlink(node);
+                wheel->count--;
+                fired++;
+                callback(node, context);
+            }
+        }
+
+        wheel->now++;
+    }
+
+    return fired;
+}
+
+int timer_wheel_next_timeout(const struct timer_wheel *wheel, long long now_ms) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    // Upper levels cascade when level 0 wraps, which may bring down earlier deadlines
+    uint64_t next_tick = (wheel->now + SLOT_MASK) & ~(uint64_t)SLOT_MASK;
+
+    uint64_t occupied = wheel->occupied[0];
+    if (occupied) {
+        // Level 0 only holds the next 64 ticks: rotate so bit 0 is the current tick
+        int index = wheel->now & SLOT_MASK;
+        uint64_t rotated = index ? (occupied >> index) | (occupied << (TIMER_LEVEL_SLOTS - index)) : occupied;
+        uint64_t level0_tick = wheel->now + __builtin_ctzll(rotated);
+        if (level0_tick < next_tick) {
+            next_tick = level0_tick;
+        }
+    }
+
+    long long wait_ms = (long long)next_tick * TIMER_TICK_MS - now_ms;
+    if (wait_ms < 0) {
+        return 0;
+    }
+    return wait_ms > INT_MAX ? INT_MAX : (int)wait_ms;
+}
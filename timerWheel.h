@@ -0,0 +1,83 @@
+#ifndef __TIMER_WHEEL
+#define __TIMER_WHEEL
+
+/*
+
+Hierarchical timer wheel with TIMER_TICK_MS resolution.
+
+Timers are intrusive: embed a struct timer_node in the object that needs a deadline, and
+recover the object from the node in the expiry callback (see offsetof). Arming, cancelling
+and expiring a timer are O(1); timers far in the future sit on a coarser level and are
+cascaded down as the wheel turns. The wheel never reads the clock itself, the owner passes
+in the current time, so a whole event loop iteration costs one clock read however many
+timers it touches.
+
+Implementation in timerWheel.cpp
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10         // Resolution of the wheel
+#define TIMER_LEVEL_BITS 6       // Each level has 64 slots
+#define TIMER_LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4           // 64^4 ticks of 10 ms, about 46 hours of range
+
+/**
+ * A single timer. Zero-initialised nodes are valid and not armed.
+ */
+struct timer_node {
+    struct timer_node *prev;
+    struct timer_node *next;
+    uint64_t expires;            // Tick the timer fires on
+    uint8_t level;               // Where the node is linked, for the occupancy bitmaps
+    uint8_t slot;
+};
+
+struct timer_wheel {
+    uint64_t now;                // Next tick to be processed
+    size_t count;                // Number of armed timers
+    uint64_t occupied[TIMER_LEVELS]; // Bit per non-empty slot
+    struct timer_node slots[TIMER_LEVELS][TIMER_LEVEL_SLOTS]; // List sentinels
+};
+
+typedef void (*timer_callback)(struct timer_node *node, void *context);
+
+/**
+ * Prepare an empty wheel whose clock starts at now_ms.
+ */
+void timer_wheel_init(struct timer_wheel *wheel, long long now_ms);
+
+/**
+ * Arm (or re-arm) a timer to fire at deadline_ms. Deadlines are rounded up to the next tick,
+ * so a timer never fires early and at most TIMER_TICK_MS late.
+ */
+void timer_wheel_arm(struct timer_wheel *wheel, struct timer_node *node, long long deadline_ms);
+
+/**
+ * Disarm a timer. Does nothing if it is not armed.
+ */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer_node *node);
+
+static inline int timer_wheel_armed(const struct timer_node *node) {
+    return node->next != NULL;
+}
+
+/**
+ * Fire every timer that is due at now_ms. The callback may arm or cancel any timer,
+ * including the one being fired.
+ *
+ * @return: Number of timers fired.
+ */
+size_t timer_wheel_advance(struct timer_wheel *wheel, long long now_ms, timer_callback callback, void *context);
+
+/**
+ * Milliseconds until the wheel next needs timer_wheel_advance(), suitable as an epoll_wait()
+ * timeout.
+ *
+ * @return: 0 if timers are already due, -1 if no timer is armed.
+ */
+int timer_wheel_next_timeout(const struct timer_wheel *wheel, long long now_ms);
+
+#endif
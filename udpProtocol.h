@@ -0,0 +1,33 @@
+#ifndef __UDP_PROTOCOL
+#define __UDP_PROTOCOL
+
+/*
+
+Datagrams of the "TEXT UDP 1.0" protocol, shared by the server and the client.
+
+One task takes two round trips and no connection:
+
+  client -> server   request   UDP_REQUEST
+  server -> client   task      "<token> <op> <a> <b>\n"
+  client -> server   result    "<token> <op> <a> <b> <result>\n", the task echoed with the result
+  server -> client   verdict   "<token> OK\n", "<token> ERROR\n", or "<token> ERROR TO\n" if the
+                               result came in later than the server's result timeout
+                               (--result-timeout) after the task
+
+The server keeps no state per client. The token is UDP_TOKEN_LENGTH hex digits: the time the
+task was issued (milliseconds, 32 bits) followed by a 64-bit SipHash-2-4 of that time and
+"<op> <a> <b>" under a key only the server knows. A result is checked against the task it
+echoes only if the token matches it, so a client cannot make up its own tasks (it can send
+the same result again until the token expires). Anything that is neither a request nor a
+result with a valid token is dropped without an answer.
+
+Every datagram holds exactly one message and fits in UDP_MAX_DATAGRAM bytes.
+
+*/
+
+#define UDP_REQUEST "TEXT UDP 1.0\n"
+#define UDP_TOKEN_LENGTH 24      // 8 hex digits of issue time, 16 of MAC
+#define UDP_MAX_DATAGRAM 128
+#define UDP_BATCH_SIZE 64        // Datagrams per recvmmsg()/sendmmsg() call
+
+#endif
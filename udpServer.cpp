@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include "calcLib.h"
+#include "lineFramer.h"
+#include "taskPool.h"
+#include "serverMetrics.h"
+#include "udpProtocol.h"
+#include "udpServer.h"
+
+/**
+ * Everything one UDP loop works on. An answer is addressed to the sender of the datagram it
+ * answers, straight from peer[].
+ */
+struct udp_loop {
+    int fd;
+    uint32_t now_ms;             // Clock read once per batch, wraps around
+    uint32_t result_timeout_ms;  // --result-timeout
+
+    struct mmsghdr in[UDP_BATCH_SIZE];
+    struct iovec in_iov[UDP_BATCH_SIZE];
+    struct sockaddr_storage peer[UDP_BATCH_SIZE];
+    char in_data[UDP_BATCH_SIZE][UDP_MAX_DATAGRAM];
+
+    struct mmsghdr out[UDP_BATCH_SIZE];
+    struct iovec out_iov[UDP_BATCH_SIZE];
+    char out_data[UDP_BATCH_SIZE][UDP_MAX_DATAGRAM];
+    unsigned out_count;
+
+    // Tasks drawn a batch at a time
+    calc_task_batch_t tasks;
+    size_t next_task;
+
+    // Results of this batch, checked together; check_out[i] is the answer slot of result i
+    calc_op_t check_op[UDP_BATCH_SIZE];
+    calc_value_t check_expected[UDP_BATCH_SIZE];
+    calc_value_t check_client[UDP_BATCH_SIZE];
+    unsigned char check_correct[UDP_BATCH_SIZE];
+    unsigned check_out[UDP_BATCH_SIZE];
+    size_t check_count;
+
+    struct server_metrics metrics;
+};
+
+static uint64_t token_key[2];
+static pthread_once_t token_key_once = PTHREAD_ONCE_INIT;
+
+static void token_key_init(void) {
+    if (getrandom(token_key, sizeof(token_key), 0) != sizeof(token_key)) {
+        // Not secret then, but still different for every run
+        token_key[0] = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL;
+        token_key[1] = (uint64_t)clock() ^ 0xc2b2ae3d27d4eb4fULL;
+    }
+}
+
+static inline uint64_t rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+#define SIPROUND                                                        \
+    do {                                                                \
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);       \
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;                          \
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;                          \
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);       \
+    } while (0)
+
+/**
+ * SipHash-2-4 of data under token_key.
+ */
+static uint64_t siphash(const unsigned char *data, size_t length) {
+    uint64_t v0 = token_key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = token_key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = token_key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = token_key[1] ^ 0x7465646279746573ULL;
+    const unsigned char *end = data + (length & ~(size_t)7);
+
+    for (; data != end; data += 8) {
+        uint64_t m;
+        memcpy(&m, data, 8); // Little endian, like the reference implementation
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    uint64_t last = (uint64_t)length << 56;
+    for (size_t i = 0; i < (length & 7); i++) {
+        last |= (uint64_t)data[i] << (8 * i);
+    }
+    v3 ^= last;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * MAC of a task issued at time issued: SipHash of the time and the task text.
+ */
+static uint64_t token_mac(uint32_t issued, const char *task, size_t length) {
+    unsigned char message[4 + UDP_MAX_DATAGRAM];
+    memcpy(message, &issued, 4);
+    memcpy(message + 4, task, length);
+    return siphash(message, 4 + length);
+}
+
+static void format_hex(char *out, uint64_t value, int digits) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = digits - 1; i >= 0; i--) {
+        out[i] = hex[value & 15];
+        value >>= 4;
+    }
+}
+
+static bool parse_hex(const char *in, int digits, uint64_t *value) {
+    uint64_t v = 0;
+    for (int i = 0; i < digits; i++) {
+        char c = in[i];
+        unsigned digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else {
+            return false;
+        }
+        v = (v << 4) | digit;
+    }
+    *value = v;
+    return true;
+}
+
+/**
+ * Answer slot for datagram i, addressed to its sender.
+ */
+static char *udp_answer(struct udp_loop *loop, unsigned i, size_t length) {
+    unsigned slot = loop->out_count++;
+    loop->out[slot].msg_hdr.msg_name = &loop->peer[i];
+    loop->out[slot].msg_hdr.msg_namelen = loop->in[i].msg_hdr.msg_namelen;
+    loop->out_iov[slot].iov_len = length;
+    return loop->out_data[slot];
+}
+
+/**
+ * Answer a request with a fresh task.
+ */
+static void udp_send_task(struct udp_loop *loop, unsigned i) {
+    if (loop->next_task == CALC_BATCH_SIZE) {
+        randomTaskBatch(&loop->tasks, CALC_BATCH_SIZE);
+        loop->next_task = 0;
+    }
+    struct prepared_task task;
+    task_prepare(&task, &loop->tasks, loop->next_task++);
+
+    // "<token> <op> <a> <b>\n"
+    size_t text_length = task.text_length - 1;
+    char *out = udp_answer(loop, i, UDP_TOKEN_LENGTH + 1 + task.text_length);
+    format_hex(out, loop->now_ms, 8);
+    format_hex(out + 8, token_mac(loop->now_ms, task.text, text_length), 16);
+    out[UDP_TOKEN_LENGTH] = ' ';
+    memcpy(out + UDP_TOKEN_LENGTH + 1, task.text, task.text_length);
+}
+
+/**
+ * Take a result: check its token, and add it to the batch or answer that it came too late.
+ * Anything malformed is dropped.
+ */
+static void udp_take_result(struct udp_loop *loop, unsigned i, const char *data, size_t length) {
+    const char *end = data + length;
+    uint64_t issued, mac;
+    if (length < UDP_TOKEN_LENGTH + 2 || data[UDP_TOKEN_LENGTH] != ' ' || end[-1] != '\n'
+        || !parse_hex(data, 8, &issued) || !parse_hex(data + 8, 16, &mac)) {
+        return;
+    }
+
+    // "<op> <a> <b>" is what the MAC covers, the result follows it
+    const char *task = data + UDP_TOKEN_LENGTH + 1;
+    const char *p = task;
+    const char *name;
+    size_t name_length;
+    double a, b;
+    if (!parse_word(&p, end, &name, &name_length) || !parse_double(&p, end, &a) || !parse_double(&p, end, &b)) {
+        return;
+    }
+    calc_op_t op = calcOpLookup(name, name_length);
+    if (op == CALC_OP_COUNT || token_mac((uint32_t)issued, task, p - task) != mac) {
+        return;
+    }
+
+    if (loop->now_ms - (uint32_t)issued > loop->result_timeout_ms) {
+        char *out = udp_answer(loop, i, UDP_TOKEN_LENGTH + 10);
+        memcpy(out, data, UDP_TOKEN_LENGTH);
+        memcpy(out + UDP_TOKEN_LENGTH, " ERROR TO\n", 10);
+        metrics_add(&loop->metrics.timeouts[TIMEOUT_RESULT], 1);
+        return;
+    }
+
+    // Reference result of the task as the client read it, like the client computes it
+    calc_value_t operand1, operand2, client_result;
+    if (calcOps[op].is_float) {
+        operand1.f = a;
+        operand2.f = b;
+        client_result.f = 0.0;
+        parse_double(&p, end, &client_result.f);
+    } else {
+        operand1.i = (int)a;
+        operand2.i = (int)b;
+        client_result.i = 0;
+        parse_int(&p, end, &client_result.i);
+    }
+    size_t c = loop->check_count++;
+    loop->check_op[c] = op;
+    loop->check_expected[c] = calcOps[op].compute(operand1, operand2);
+    loop->check_client[c] = client_result;
+
+    // The verdict is written once the batch is checked
+    char *out = udp_answer(loop, i, 0);
+    memcpy(out, data, UDP_TOKEN_LENGTH);
+    loop->check_out[c] = loop->out_count - 1;
+}
+
+/**
+ * Check the results of the batch and write their verdicts.
+ */
+static void udp_check_results(struct udp_loop *loop) {
+    calcCheckBatch(loop->check_op, loop->check_expected, loop->check_client, loop->check_correct,
+                   loop->check_count, FLOAT_PRECISION);
+    for (size_t c = 0; c < loop->check_count; c++) {
+        unsigned slot = loop->check_out[c];
+        bool correct = loop->check_correct[c];
+        const char *verdict = correct ? " OK\n" : " ERROR\n";
+        size_t verdict_length = correct ? 4 : 7;
+        memcpy(loop->out_data[slot] + UDP_TOKEN_LENGTH, verdict, verdict_length);
+        loop->out_iov[slot].iov_len = UDP_TOKEN_LENGTH + verdict_length;
+        metrics_add(&loop->metrics.results[loop->check_op[c]][correct], 1);
+    }
+    loop->check_count = 0;
+}
+
+/**
+ * Send the answers of the batch. A full socket buffer or an unreachable peer only loses
+ * datagrams, which the protocol tolerates.
+ */
+static void udp_send_answers(struct udp_loop *loop) {
+    unsigned sent = 0;
+    while (sent < loop->out_count) {
+        int rv = sendmmsg(loop->fd, loop->out + sent, loop->out_count - sent, 0);
+        if (rv == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sent++; // Skip the datagram that failed
+            continue;
+        }
+        for (int k = 0; k < rv; k++) {
+            metrics_add(&loop->metrics.bytes_sent, loop->out[sent + k].msg_len);
+        }
+        sent += rv;
+    }
+    loop->out_count = 0;
+}
+
+int run_udp_loop(int udp_socket, const struct server_config *config) {
+    static thread_local struct udp_loop loop; // Too large for a thread's stack
+    memset(&loop, 0, sizeof(loop));
+    loop.fd = udp_socket;
+    loop.result_timeout_ms = config->result_timeout_ms;
+    loop.next_task = CALC_BATCH_SIZE;
+    pthread_once(&token_key_once, token_key_init);
+    metrics_register(&loop.metrics);
+
+    for (unsigned i = 0; i < UDP_BATCH_SIZE; i++) {
+        loop.in_iov[i].iov_base = loop.in_data[i];
+        loop.in_iov[i].iov_len = UDP_MAX_DATAGRAM;
+        loop.in[i].msg_hdr.msg_iov = &loop.in_iov[i];
+        loop.in[i].msg_hdr.msg_iovlen = 1;
+        loop.in[i].msg_hdr.msg_name = &loop.peer[i];
+        loop.out_iov[i].iov_base = loop.out_data[i];
+        loop.out[i].msg_hdr.msg_iov = &loop.out_iov[i];
+        loop.out[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (1) {
+        for (unsigned i = 0; i < UDP_BATCH_SIZE; i++) {
+            loop.in[i].msg_hdr.msg_namelen = sizeof(loop.peer[i]);
+        }
+        // Block for the first datagram, then take whatever else is already queued
+        int count = recvmmsg(udp_socket, loop.in, UDP_BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recvmmsg failed");
+            return -1;
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        loop.now_ms = (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+
+        for (int i = 0; i < count; i++) {
+            const char *data = loop.in_data[i];
+            size_t length = loop.in[i].msg_len;
+            metrics_add(&loop.metrics.bytes_received, length);
+            if (loop.in[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                continue; // Longer than any valid message
+            }
+            if (length == strlen(UDP_REQUEST) && memcmp(data, UDP_REQUEST, length) == 0) {
+                udp_send_task(&loop, i);
+            } else {
+                udp_take_result(&loop, i, data, length);
+            }
+        }
+
+        udp_check_results(&loop);
+        udp_send_answers(&loop);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef __UDP_SERVER
+#define __UDP_SERVER
+
+/*
+
+TEXT UDP 1.0 server loop (see udpProtocol.h).
+
+The protocol is stateless on the server side, so the loop is just a batch pipeline: a
+recvmmsg() of up to UDP_BATCH_SIZE datagrams, tasks rendered for the requests and tokens
+checked for the results, all results of the batch checked together (calcCheckBatch()), and
+every answer out with one sendmmsg().
+
+Implementation in udpServer.cpp
+
+*/
+
+#include "serverEngine.h"
+
+/**
+ * Serve TEXT UDP 1.0 on udp_socket until a fatal error occurs. The calling thread should
+ * have its own random stream (initCalcLib_stream()).
+ *
+ * @param udp_socket: A bound UDP socket.
+ * @param config: Server settings; a result counts as late after config->result_timeout_ms,
+ *                which --adaptive-timeouts does not shorten here.
+ * @return: -1 on failure, does not return otherwise.
+ */
+int run_udp_loop(int udp_socket, const struct server_config *config);
+
+#endif